@@ -168,6 +168,7 @@ bool AppInit2(int argc, char* argv[])
             "  -conf=<file>     \t\t  " + _("Specify configuration file (default: bitcoin.conf)\n") +
             "  -gen             \t\t  " + _("Generate coins\n") +
             "  -gen=0           \t\t  " + _("Don't generate coins\n") +
+            "  -kernel=<name>   \t\t  " + _("SHA-256 kernel to generate with (default: fastest)\n") +
             "  -min             \t\t  " + _("Start minimized\n") +
             "  -datadir=<dir>   \t\t  " + _("Specify data directory\n") +
             "  -port=<port>     \t  " + _("Specify listen port\n") +
@@ -4,6 +4,7 @@
 
 #include "headers.h"
 #include "cryptopp/sha.h"
+#include "sha256.h"
 #ifdef _BITCOIN_MINER_CUDA_
 #include "cuda/bitcoinminercuda.h"
 #endif	// _BITCOIN_MINER_CUDA_
@@ -1402,6 +1403,9 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     nTransactionsUpdated++;
     printf("SetBestChain: new best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str());
 
+    // Remote clients are still hashing on the old tip
+    BitcoinMinerRemoteTipChanged();
+
     return true;
 }
 
@@ -2936,72 +2940,6 @@ void ThreadBitcoinMiner(void* parg)
     printf("ThreadBitcoinMiner exiting, %d threads remaining\n", vnThreadsRunning[3]);
 }
 
-#if defined(__GNUC__) && defined(CRYPTOPP_X86_ASM_AVAILABLE)
-void CallCPUID(int in, int& aret, int& cret)
-{
-    int a, c;
-    asm (
-        "mov %2, %%eax; " // in into eax
-        "cpuid;"
-        "mov %%eax, %0;" // eax into a
-        "mov %%ecx, %1;" // ecx into c
-        :"=r"(a),"=r"(c) /* output */
-        :"r"(in) /* input */
-        :"%eax","%ecx" /* clobbered register */
-    );
-    aret = a;
-    cret = c;
-}
-
-bool Detect128BitSSE2()
-{
-    int a, c, nBrand;
-    CallCPUID(0, a, nBrand);
-    bool fIntel = (nBrand == 0x6c65746e); // ntel
-    bool fAMD = (nBrand == 0x444d4163); // cAMD
-
-    struct
-    {
-        unsigned int nStepping : 4;
-        unsigned int nModel : 4;
-        unsigned int nFamily : 4;
-        unsigned int nProcessorType : 2;
-        unsigned int nUnused : 2;
-        unsigned int nExtendedModel : 4;
-        unsigned int nExtendedFamily : 8;
-    }
-    cpu;
-    CallCPUID(1, a, c);
-    memcpy(&cpu, &a, sizeof(cpu));
-    int nFamily = cpu.nExtendedFamily + cpu.nFamily;
-    int nModel = cpu.nExtendedModel*16 + cpu.nModel;
-
-    // We need Intel Nehalem or AMD K10 or better for 128bit SSE2
-    // Nehalem = i3/i5/i7 and some Xeon
-    // K10 = Opterons with 4 or more cores, Phenom, Phenom II, Athlon II
-    //  Intel Core i5  family 6, model 26 or 30
-    //  Intel Core i7  family 6, model 26 or 30
-    //  Intel Core i3  family 6, model 37
-    //  AMD Phenom    family 16, model 10
-    bool fUseSSE2 = ((fIntel && nFamily * 10000 + nModel >=  60026) ||
-                     (fAMD   && nFamily * 10000 + nModel >= 160010));
-
-    // AMD reports a lower model number in 64-bit mode
-    if (fAMD && sizeof(void*) > 4 && nFamily * 10000 + nModel >= 160000)
-        fUseSSE2 = true;
-
-    static bool fPrinted;
-    if (!fPrinted)
-    {
-        fPrinted = true;
-        printf("CPUID %08x family %d, model %d, stepping %d, fUseSSE2=%d\n", nBrand, nFamily, nModel, cpu.nStepping, fUseSSE2);
-    }
-    return fUseSSE2;
-}
-#else
-bool Detect128BitSSE2() { return false; }
-#endif
-
 int FormatHashBlocks(void* pbuffer, unsigned int len)
 {
     unsigned char* pdata = (unsigned char*)pbuffer;
@@ -3028,40 +2966,6 @@ inline void SHA256Transform(void* pstate, void* pinput, const void* pinit)
     CryptoPP::SHA256::Transform((CryptoPP::word32*)pstate, (CryptoPP::word32*)pinput);
 }
 
-//
-// ScanHash scans nonces looking for a hash with at least some zero bits.
-// It operates on big endian data.  Caller does the byte reversing.
-// All input buffers are 16-byte aligned.  nNonce is usually preserved
-// between calls, but periodically or if nNonce is 0xffff0000 or above,
-// the block is rebuilt and nNonce starts over at zero.
-//
-unsigned int ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
-{
-    unsigned int& nNonce = *(unsigned int*)(pdata + 12);
-    for (;;)
-    {
-        // Crypto++ SHA-256
-        // Hash pdata using pmidstate as the starting state into
-        // preformatted buffer phash1, then hash phash1 into phash
-        nNonce++;
-        SHA256Transform(phash1, pdata, pmidstate);
-        SHA256Transform(phash, phash1, pSHA256InitState);
-
-        // Return the nonce if the hash has at least some zero bits,
-        // caller will check if it has enough to reach the target
-        if (((unsigned short*)phash)[14] == 0)
-            return nNonce;
-
-        // If nothing found after trying for a while, return -1
-        if ((nNonce & 0xffff) == 0)
-        {
-            nHashesDone = 0xffff+1;
-            return -1;
-        }
-    }
-}
-
-extern unsigned int ScanHash_4WaySSE2(char* pmidstate, char* pblock, char* phash1, char* phash, unsigned int& nHashesDone);
 
 
 
@@ -3348,9 +3252,15 @@ void BitcoinMiner()
 {
     printf("BitcoinMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
-    bool f4WaySSE2 = Detect128BitSSE2();
-    if (mapArgs.count("-4way"))
-        f4WaySSE2 = (mapArgs["-4way"] != "0");
+
+    // Fastest SHA-256 kernel this CPU runs correctly, unless -kernel names
+    // one.  The old -4way switch still picks between SSE2 and Crypto++.
+    string strKernel = GetArg("-kernel", "");
+    if (strKernel.empty() && mapArgs.count("-4way"))
+        strKernel = (mapArgs["-4way"] != "0" ? "sse2" : "cryptopp");
+    const SHA256Kernel* pkernel = SelectSHA256Kernel(strKernel, true);
+    ScanHashFunction pScanHash = pkernel->pScanHash;
+    printf("BitcoinMiner using %s SHA-256\n", pkernel->pszDescription);
 
     // Each thread has its own key and counter
     CReserveKey reservekey;
@@ -3412,14 +3322,7 @@ void BitcoinMiner()
             unsigned int nHashesDone = 0;
             unsigned int nNonceFound;
 
-#ifdef FOURWAYSSE2
-            if (f4WaySSE2)
-                // tcatm's 4-way 128-bit SSE2 SHA-256
-                nNonceFound = ScanHash_4WaySSE2(pmidstate, pdata + 64, phash1, (char*)&hash, nHashesDone);
-            else
-#endif
-                // Crypto++ SHA-256
-                nNonceFound = ScanHash_CryptoPP(pmidstate, pdata + 64, phash1, (char*)&hash, nHashesDone);
+            nNonceFound = pScanHash(pmidstate, pdata + 64, phash1, (char*)&hash, nHashesDone);
 
             // Check if something found
             if (nNonceFound != -1)
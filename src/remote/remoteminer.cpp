@@ -19,8 +19,10 @@
 #define NOMINMAX
 
 #include "remoteminer.h"
+#include "remotestratum.h"
 #include "base64.h"
 #include "../cryptopp/misc.h"
+#include "../sha256.h"
 
 #include <ctime>
 #include <cstring>
@@ -34,10 +36,22 @@
 	#include <arpa/inet.h>
 	#include <netinet/in.h>
 	#include <netdb.h>
+	#include <fcntl.h>
+	#include <errno.h>
+	#include <sys/uio.h>
 #endif
 
 const int BITCOINMINERREMOTE_THREADINDEX=5;
 const int BITCOINMINERREMOTE_HASHESPERMETA=2000000;
+const int BITCOINMINERREMOTE_MINHASHESPERMETA=100000;
+const int BITCOINMINERREMOTE_MAXHASHESPERMETA=500000000;
+const int BITCOINMINERREMOTE_SHARESPERMETA=10;
+const int BITCOINMINERREMOTE_MINHASHESPERSHARE=1000000;
+const int BITCOINMINERREMOTE_SEGMENTSPERMETA=256;
+const int BITCOINMINERREMOTE_SECONDSPERTRUST=5;
+const int BITCOINMINERREMOTE_TRUSTPERFAILURE=20;
+const int BITCOINMINERREMOTE_MAXSENTWORK=16384;
+const int BITCOINMINERREMOTE_STRATUMJOBINTERVAL=30;
 
 TimeStats timestats("timestats.txt",600000);
 
@@ -45,34 +59,139 @@ TimeStats timestats("timestats.txt",600000);
 bool BitcoinMinerRemoteServer::m_wsastartup=false;
 #endif
 
-RemoteClientConnection::RemoteClientConnection(const SOCKET sock, sockaddr_storage &addr, const int addrlen):m_socket(sock),m_addr(addr),m_addrlen(addrlen),m_gotclienthello(false),m_connecttime(time(0)),m_lastactive(time(0)),m_lastverifiedmetahash(0),m_nextblockid(1),m_verifiedmetahashcount(0)
+int64 RemoteClientConnection::m_lastid=0;
+
+// bumped by SetBestChain, the server thread pushes new work when it changes
+static unsigned int nRemoteTipChanges=0;
+static CCriticalSection cs_nRemoteTipChanges;
+
+void BitcoinMinerRemoteTipChanged()
 {
-	m_tempbuffer.resize(8192,0);
+	CRITICAL_BLOCK(cs_nRemoteTipChanges)
+	{
+		nRemoteTipChanges++;
+	}
 }
 
-RemoteClientConnection::~RemoteClientConnection()
+static const unsigned int GetRemoteTipChanges()
 {
-	Disconnect();
-	for(std::vector<sentwork>::iterator i=m_sentwork.begin(); i!=m_sentwork.end(); i++)
+	unsigned int tipchanges=0;
+	CRITICAL_BLOCK(cs_nRemoteTipChanges)
+	{
+		tipchanges=nRemoteTipChanges;
+	}
+	return tipchanges;
+}
+
+const bool RemoteBlockTemplate::IsCurrent() const
+{
+	return m_indexprev==pindexBest && m_transactionsupdated==nTransactionsUpdated;
+}
+
+void RemoteBlockTemplate::GetBlock(const CTransaction &coinbase, CBlock &block) const
+{
+	block.vtx.clear();
+	block.vtx.reserve(m_vtx.size()+1);
+	block.vtx.push_back(coinbase);
+	block.vtx.insert(block.vtx.end(),m_vtx.begin(),m_vtx.end());
+	block.hashPrevBlock=(m_indexprev ? m_indexprev->GetBlockHash() : 0);
+	block.hashMerkleRoot=GetMerkleRoot(coinbase);
+	block.nBits=m_bits;
+}
+
+void RemoteBlockTemplate::FormatWork(const CBlock &header, std::vector<unsigned char> &block, std::vector<unsigned char> &midstate)
+{
+	static const unsigned int SHA256InitState[8] ={0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+	//
+	// Prebuild hash buffer
+	//
+	struct tmpworkspace
 	{
-		if((*i).m_pblock!=0)
+		struct unnamed2
 		{
-			delete (*i).m_pblock;
+			int nVersion;
+			uint256 hashPrevBlock;
+			uint256 hashMerkleRoot;
+			unsigned int nTime;
+			unsigned int nBits;
+			unsigned int nNonce;
 		}
-	}
+		block;
+		unsigned char pchPadding0[64];
+		uint256 hash1;
+		unsigned char pchPadding1[64];
+	};
+	char tmpbuf[sizeof(tmpworkspace)+64];
+	tmpworkspace& tmp = *(tmpworkspace*)alignup<16>(tmpbuf);
+
+	tmp.block.nVersion       = header.nVersion;
+	tmp.block.hashPrevBlock  = header.hashPrevBlock;
+	tmp.block.hashMerkleRoot = header.hashMerkleRoot;
+	tmp.block.nTime          = header.nTime;
+	tmp.block.nBits          = header.nBits;
+	tmp.block.nNonce         = header.nNonce;
+
+	FormatHashBlocks(&tmp.block, sizeof(tmp.block));
+	FormatHashBlocks(&tmp.hash1, sizeof(tmp.hash1));
+
+	// Byte swap all the input buffer
+	for (int i = 0; i < sizeof(tmp)/4; i++)
+		((unsigned int*)&tmp)[i] = CryptoPP::ByteReverse(((unsigned int*)&tmp)[i]);
+
+	// Precalc the first half of the first hash, which stays constant
+	uint256 midstatebuf[2];
+	uint256& mid = *alignup<16>(midstatebuf);
+	SHA256Transform(&mid, &tmp.block, SHA256InitState);
+
+	block.assign(((unsigned char *)&tmp.block)+64,((unsigned char *)&tmp.block)+128);
+	midstate.assign((unsigned char *)&mid,((unsigned char *)&mid)+32);
+}
+
+void RemoteBlockTemplate::SplitCoinbase(const CTransaction &coinbase, const unsigned int extrabytes, std::vector<unsigned char> &coinbase1, std::vector<unsigned char> &coinbase2)
+{
+	CDataStream sscoinbase(SER_NETWORK);
+	sscoinbase << coinbase;
+	std::vector<unsigned char> serialized(sscoinbase.begin(),sscoinbase.end());
+	// version, input count and prevout come before the scriptSig of the only input
+	const CScript &scriptsig=coinbase.vin[0].scriptSig;
+	std::vector<unsigned char>::size_type offset=4+GetSizeOfCompactSize(coinbase.vin.size())+36+GetSizeOfCompactSize(scriptsig.size())+scriptsig.size()-extrabytes;
+	coinbase1.assign(serialized.begin(),serialized.begin()+offset);
+	coinbase2.assign(serialized.begin()+offset+extrabytes,serialized.end());
+}
+
+RemoteClientConnection::RemoteClientConnection(const SOCKET sock, sockaddr_storage &addr, const int addrlen):m_id(++m_lastid),m_socket(sock),m_addr(addr),m_addrlen(addrlen),m_sendbuffersize(0),m_disconnectrequested(false),m_gotclienthello(false),m_connecttime(time(0)),m_lastactive(time(0)),m_lastverifiedmetahash(0),m_verifyingmetahash(false),m_protocolversion(REMOTEMINER_PROTOCOL_VERSION_JSON),m_useshares(false),m_usesmetahashtree(false),m_usescompactblock(false),m_rollsextranonce(false),m_nextblockid(1),m_verifiedmetahashcount(0),m_failedmetahashcount(0),m_receivedmetahashcount(0),m_lastverifiedkhash(0),m_metahashrate(60,60),m_besthashbits(600,60),m_besthashcount(600,60),m_metahashsize(BITCOINMINERREMOTE_HASHESPERMETA)
+{
+#ifdef _BITCOIN_REMOTE_EPOLL_
+	m_epollfd=-1;
+	m_epollout=false;
+#endif
+}
+
+RemoteClientConnection::~RemoteClientConnection()
+{
+	Disconnect();
+}
+
+void RemoteClientConnection::AddSentWork(const sentwork &work)
+{
+	m_sentwork[work.m_blockid]=work;
+	m_sentworkbyblock[work.m_block]=work.m_blockid;
 }
 
 void RemoteClientConnection::ClearOldSentWork(const int sec)
 {
-	for(std::vector<sentwork>::iterator i=m_sentwork.begin(); i!=m_sentwork.end();)
+	// work the client rolled keeps the time its work was sent, but sorts after all of the work sent, so everything is checked
+	for(std::map<int64,sentwork>::iterator i=m_sentwork.begin(); i!=m_sentwork.end(); )
 	{
-		if(difftime(time(0),(*i).m_senttime)>=sec)
+		if(difftime(time(0),(*i).second.m_senttime)>=sec)
 		{
-			if((*i).m_pblock)
+			std::map<std::vector<unsigned char>,int64>::iterator b=m_sentworkbyblock.find((*i).second.m_block);
+			if(b!=m_sentworkbyblock.end() && (*b).second==(*i).first)
 			{
-				delete (*i).m_pblock;
+				m_sentworkbyblock.erase(b);
 			}
-			i=m_sentwork.erase(i);
+			m_sentwork.erase(i++);
 		}
 		else
 		{
@@ -81,19 +200,148 @@ void RemoteClientConnection::ClearOldSentWork(const int sec)
 	}
 }
 
+const time_t RemoteClientConnection::GetLastSentWorkTime() const
+{
+	// the newest work the server sent is the last one before the work the client rolled
+	std::map<int64,sentwork>::const_iterator i=m_sentwork.lower_bound(RemoteMinerMessage::ExtraNonceBlockID(0,1));
+	if(i!=m_sentwork.begin())
+	{
+		i--;
+		return (*i).second.m_senttime;
+	}
+	return 0;
+}
+
+// rebuilds work the client made from work it was sent, by rolling the extranonce or nTime, the first time the client reports on it
+const bool RemoteClientConnection::AddRolledWork(const int64 id)
+{
+	const unsigned int seconds=static_cast<unsigned int>(id>>52);
+	const unsigned int extranonce=static_cast<unsigned int>(id>>32) & RemoteMinerMessage::MAX_EXTRANONCE;
+
+	// nTime is rolled on the work the client was hashing, which can have a rolled extranonce itself
+	const int64 parentid=(seconds>0 ? id & ((static_cast<int64>(1)<<52)-1) : id & 0xffffffff);
+	sentwork *parent;
+	if(id<0 || m_sentwork.size()>=BITCOINMINERREMOTE_MAXSENTWORK || GetSentWorkByID(parentid,&parent)==false)
+	{
+		return false;
+	}
+	if((seconds>0 && seconds>parent->m_ntimewindow) || (seconds==0 && parent->m_rollsextranonce==false))
+	{
+		return false;
+	}
+
+	sentwork work;
+	work.m_blockid=id;
+	work.m_senttime=parent->m_senttime;
+	work.m_target=parent->m_target;
+	work.m_metahashsize=parent->m_metahashsize;
+	work.m_segmentsize=parent->m_segmentsize;
+	work.m_key=parent->m_key;
+	work.m_sharetarget=parent->m_sharetarget;
+	work.m_sharehashes=parent->m_sharehashes;
+	work.m_template=parent->m_template;
+	work.m_coinbase=parent->m_coinbase;
+	work.m_merklebranch=parent->m_merklebranch;
+	work.m_time=parent->m_time;
+	work.m_bits=parent->m_bits;
+	work.m_ntimewindow=parent->m_ntimewindow;
+	work.m_indexprev=parent->m_indexprev;
+	work.m_stale=parent->m_stale;
+
+	// the template may already be gone, late metahashes for work on an old tip still count as stale
+	if(seconds>0)
+	{
+		// nTime is in the second 64 bytes of the header, so the parent's midstate still holds
+		work.m_time+=seconds;
+		work.m_block=parent->m_block;
+		work.m_midstate=parent->m_midstate;
+		((unsigned int *)&work.m_block[0])[1]=CryptoPP::ByteReverse(work.m_time);
+	}
+	else
+	{
+		CScript &scriptsig=work.m_coinbase.vin[0].scriptSig;
+		for(int b=0; b<4; b++)
+		{
+			scriptsig[scriptsig.size()-4+b]=(extranonce >> (b*8)) & 0xff;
+		}
+
+		CBlock header;
+		header.hashPrevBlock=(work.m_indexprev ? work.m_indexprev->GetBlockHash() : 0);
+		header.hashMerkleRoot=CBlock::CheckMerkleBranch(work.m_coinbase.GetHash(),work.m_merklebranch,0);
+		header.nTime=work.m_time;
+		header.nBits=work.m_bits;
+		header.nNonce=0;
+		RemoteBlockTemplate::FormatWork(header,work.m_block,work.m_midstate);
+	}
+
+	m_sentwork[id]=work;
+	return true;
+}
+
+// work on an old tip can't become a block any more, but late metahashes for it are still accepted and counted as stale
+void RemoteClientConnection::InvalidateSentWork(const CBlockIndex *pindexbest)
+{
+	for(std::map<int64,sentwork>::iterator i=m_sentwork.begin(); i!=m_sentwork.end(); i++)
+	{
+		if((*i).second.m_indexprev!=pindexbest)
+		{
+			(*i).second.m_stale=true;
+			(*i).second.m_template.reset();
+		}
+	}
+}
+
+// only called by the server thread, a worker may still be handling the client's last messages
 const bool RemoteClientConnection::Disconnect()
 {
-	m_sendbuffer.clear();
-	m_receivebuffer.clear();
-	if(IsConnected())
+	m_receivebuffer.Clear();
+	CRITICAL_BLOCK(m_cssend)
 	{
-		myclosesocket(m_socket);
+		m_sendbuffer.clear();
+		m_sendbuffersize=0;
+		if(IsConnected())
+		{
+#ifdef _BITCOIN_REMOTE_EPOLL_
+			if(m_epollfd!=-1)
+			{
+				struct epoll_event ev;
+				epoll_ctl(m_epollfd,EPOLL_CTL_DEL,m_socket,&ev);
+				m_epollfd=-1;
+			}
+#endif
+			myclosesocket(m_socket);
+		}
+		m_socket=INVALID_SOCKET;
 	}
-	m_socket=INVALID_SOCKET;
-	m_gotclienthello=false;
 	return true;
 }
 
+void RemoteClientConnection::RequestDisconnect()
+{
+	CRITICAL_BLOCK(m_cssend)
+	{
+		m_disconnectrequested=true;
+	}
+}
+
+const bool RemoteClientConnection::DisconnectRequested()
+{
+	CRITICAL_BLOCK(m_cssend)
+	{
+		return (m_disconnectrequested==true || IsConnected()==false);
+	}
+	return true;
+}
+
+const std::vector<char>::size_type RemoteClientConnection::SendBufferSize()
+{
+	CRITICAL_BLOCK(m_cssend)
+	{
+		return m_sendbuffersize;
+	}
+	return 0;
+}
+
 const std::string RemoteClientConnection::GetAddress(const bool withport) const
 {
 	std::string address("");
@@ -136,310 +384,874 @@ const std::string RemoteClientConnection::GetAddress(const bool withport) const
 	return address;
 }
 
-const int64 RemoteClientConnection::GetCalculatedKHashRateFromBestHash(const int sec, const int minsec) const
+const int64 RemoteClientConnection::GetCalculatedKHashRateFromBestHash() const
 {
-	SCOPEDTIME("RemoteClientConnection::GetCalculatedKHashRateFromBestHash");
-	// we find how many hashes were necessary to get the best hash, and total this number for all best hashes reported in the time period
-	// then we divide by the time period to get khash/s
-	int64 hashes=0;
-	int64 bits=0;
+	// the average number of leading 0 bits of the best hashes tells how many hashes were necessary to find them
 	time_t now=time(0);
-	time_t earliest=now;
+	int64 hashes=m_besthashcount.GetTotal(now);
+	long double averagenbits=0;
+	if(hashes>0)
+	{
+		averagenbits=static_cast<long double>(m_besthashbits.GetTotal(now))/static_cast<long double>(hashes);
+	}
+	return static_cast<int64>(::pow(static_cast<long double>(2),averagenbits)/static_cast<long double>(1000));
+}
+
+const int64 RemoteClientConnection::GetCalculatedKHashRateFromMetaHash() const
+{
+	return m_metahashrate.GetTotal(time(0))/(static_cast<int64>(m_metahashrate.GetWindowSeconds())*1000);
+}
+
+void RemoteClientConnection::AddBestHash(const uint256 &besthash)
+{
+	// find number of 0 bits on the left
+	int64 bits=0;
+	for(int i=7; i>=0; i--)
+	{
+		unsigned int ch=((const unsigned int *)&besthash)[i];
+		if(ch==0)
+		{
+			bits+=32;
+			continue;
+		}
+		while((ch & 0x80000000)==0)
+		{
+			bits++;
+			ch<<=1;
+		}
+		break;
+	}
+	m_besthashbits.Add(time(0),bits);
+	m_besthashcount.Add(time(0),1);
+}
+
+// sizes the metahash so this client sends one about every interval seconds
+void RemoteClientConnection::AdjustMetaHashSize(const int interval)
+{
+	int64 khash=GetCalculatedKHashRateFromMetaHash();
+	if(khash>0 && interval>0)
+	{
+		int64 size=khash*1000*interval;
+		// don't grow more than 4 times at once while the rate is still being measured
+		size=(std::min)(size,static_cast<int64>(m_metahashsize)*4);
+		size=(std::max)(size,static_cast<int64>(BITCOINMINERREMOTE_MINHASHESPERMETA));
+		size=(std::min)(size,static_cast<int64>(BITCOINMINERREMOTE_MAXHASHESPERMETA));
+		m_metahashsize=static_cast<unsigned int>(size-(size%1000));
+	}
+}
 
-	for(std::vector<sentwork>::const_iterator i=m_sentwork.begin(); i!=m_sentwork.end(); i++)
+const bool RemoteClientConnection::GetNewestSentWorkWithMetaHash(sentwork &work) const
+{
+	SCOPEDTIME("RemoteClientConnection::GetNewestSentWorkWithMetaHash");
+	for(std::map<int64,sentwork>::const_reverse_iterator i=m_sentwork.rbegin(); i!=m_sentwork.rend(); i++)
 	{
-		for(std::vector<metahash>::const_iterator j=(*i).m_metahashes.begin(); j!=(*i).m_metahashes.end(); j++)
+		if((*i).second.m_metahashes.size()>0)
 		{
-			if(difftime(now,(*j).m_senttime)<=sec)
+			work=(*i).second;
+			return true;
+		}
+	}
+	return false;
+}
+
+const bool RemoteClientConnection::HasUnverifiedMetaHash() const
+{
+	for(std::map<int64,sentwork>::const_reverse_iterator i=m_sentwork.rbegin(); i!=m_sentwork.rend(); i++)
+	{
+		if((*i).second.m_metahashes.size()>0)
+		{
+			return ((*i).second.m_metahashes[(*i).second.m_metahashes.size()-1].m_verified==false);
+		}
+	}
+	return false;
+}
+
+const bool RemoteClientConnection::GetSentWorkByBlock(const std::vector<unsigned char> &block, sentwork **work)
+{
+	SCOPEDTIME("RemoteClientConnection::GetSentWorkByBlock");
+	std::map<std::vector<unsigned char>,int64>::const_iterator i=m_sentworkbyblock.find(block);
+	if(i!=m_sentworkbyblock.end())
+	{
+		return GetSentWorkByID((*i).second,work);
+	}
+
+	return false;
+}
+
+const bool RemoteClientConnection::GetSentWorkByID(const int64 id, sentwork **work)
+{
+	SCOPEDTIME("RemoteClientConnection::GetSentWorkByID");
+	std::map<int64,sentwork>::iterator i=m_sentwork.find(id);
+	if(i==m_sentwork.end() && (id>>32)!=0 && AddRolledWork(id))
+	{
+		i=m_sentwork.find(id);
+	}
+	if(i!=m_sentwork.end())
+	{
+		*work=&((*i).second);
+		return true;
+	}
+
+	return false;
+}
+
+const bool RemoteClientConnection::MessageReady() const
+{
+	SCOPEDTIME("RemoteClientConnection::MessageReady");
+	return RemoteMinerMessage::MessageReady(m_receivebuffer);
+}
+
+const bool RemoteClientConnection::ProtocolError() const
+{
+	SCOPEDTIME("RemoteClientConnection::ProtocolError");
+	return RemoteMinerMessage::ProtocolError(m_receivebuffer);
+}
+
+const bool RemoteClientConnection::ReceiveMessage(RemoteMinerMessage &message)
+{
+	SCOPEDTIME("RemoteClientConnection::ReceiveMessage");
+	return RemoteMinerMessage::ReceiveMessage(m_receivebuffer,message);
+}
+
+const bool RemoteClientConnection::ReceiveLine(std::string &line)
+{
+	const char *end=m_receivebuffer.Empty() ? 0 : (const char *)::memchr(m_receivebuffer.Data(),'\n',m_receivebuffer.Size());
+	if(end==0)
+	{
+		return false;
+	}
+	line.assign(m_receivebuffer.Data(),end);
+	m_receivebuffer.Consume((end-m_receivebuffer.Data())+1);
+	return true;
+}
+
+void RemoteClientConnection::SendMessage(const RemoteMinerMessage &message)
+{
+	SCOPEDTIME("RemoteClientConnection::SendMessage");
+	std::vector<char> wiredata;
+	std::vector<boost::shared_ptr<const std::string> > fragments;
+	message.PushWireData(wiredata,m_protocolversion);
+	fragments.push_back(boost::shared_ptr<const std::string>(new std::string(wiredata.begin(),wiredata.end())));
+	SendFragments(fragments);
+}
+
+void RemoteClientConnection::SendFragments(const std::vector<boost::shared_ptr<const std::string> > &fragments)
+{
+	CRITICAL_BLOCK(m_cssend)
+	{
+		for(std::vector<boost::shared_ptr<const std::string> >::const_iterator i=fragments.begin(); i!=fragments.end(); i++)
+		{
+			if((*i) && (*i)->size()>0)
 			{
-				if(earliest>(*j).m_senttime)
-				{
-					earliest=(*j).m_senttime;
-				}
-				// find number of 0 bits on the right
-				//bits=0;
-				for(int i=7; i>=0; i--)
-				{
-					unsigned int ch=((unsigned int *)&(*j).m_besthash)[i];
-					for(int j=31; j>=0; j--)
-					{
-						if(((ch >> j) & 0x1)!=0)
-						{
-							i=0;
-							j=0;
-							continue;
-						}
-						else
-						{
-							bits++;
-						}
-					}
-				}
-				//hashes+=static_cast<int64>(static_cast<int64>(2) << bits);
-				hashes++;
+				sendfragment fragment;
+				fragment.m_data=(*i);
+				m_sendbuffer.push_back(fragment);
+				m_sendbuffersize+=(*i)->size();
 			}
 		}
+#ifdef _BITCOIN_REMOTE_EPOLL_
+		if(m_sendbuffersize>0)
+		{
+			SetEpollOut(true);
+		}
+#endif
 	}
+}
 
-	long double averagenbits=0;
-	if(hashes>0)
+// the queued fragments are handed to the socket with a single gather write, returns what send would
+const int RemoteClientConnection::WriteFragments()
+{
+	const std::deque<sendfragment>::size_type maxfragments=64;
+	std::deque<sendfragment>::size_type count=(std::min)(m_sendbuffer.size(),maxfragments);
+#ifdef _WIN32
+	WSABUF buffers[64];
+	DWORD sent=0;
+	for(std::deque<sendfragment>::size_type i=0; i<count; i++)
 	{
-		averagenbits=static_cast<long double>(bits)/static_cast<long double>(hashes);
+		buffers[i].buf=const_cast<char *>(m_sendbuffer[i].m_data->data()+m_sendbuffer[i].m_offset);
+		buffers[i].len=m_sendbuffer[i].m_data->size()-m_sendbuffer[i].m_offset;
 	}
-	return static_cast<int64>(::pow(static_cast<long double>(2),averagenbits)/static_cast<long double>(1000));
+	if(WSASend(GetSocket(),buffers,count,&sent,0,0,0)!=0)
+	{
+		return -1;
+	}
+	return sent;
+#else
+	struct iovec buffers[64];
+	struct msghdr msg;
+	for(std::deque<sendfragment>::size_type i=0; i<count; i++)
+	{
+		buffers[i].iov_base=const_cast<char *>(m_sendbuffer[i].m_data->data()+m_sendbuffer[i].m_offset);
+		buffers[i].iov_len=m_sendbuffer[i].m_data->size()-m_sendbuffer[i].m_offset;
+	}
+	// writev with MSG_NOSIGNAL, a client that went away must not raise SIGPIPE
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov=buffers;
+	msg.msg_iovlen=count;
+	return ::sendmsg(GetSocket(),&msg,MSG_NOSIGNAL);
+#endif
 }
 
-const int64 RemoteClientConnection::GetCalculatedKHashRateFromMetaHash(const int sec, const int minsec) const
+void RemoteClientConnection::FragmentsSent(int bytes)
 {
-	SCOPEDTIME("RemoteClientConnection::GetCalculatedKHashRateFromMetaHash");
-	int64 hash=0;
-	time_t now=time(0);
-	time_t earliest=now;
-	for(std::vector<sentwork>::const_iterator i=m_sentwork.begin(); i!=m_sentwork.end(); i++)
+	m_sendbuffersize-=bytes;
+	while(bytes>0 && m_sendbuffer.size()>0)
+	{
+		sendfragment &fragment=m_sendbuffer.front();
+		std::string::size_type left=fragment.m_data->size()-fragment.m_offset;
+		if(static_cast<std::string::size_type>(bytes)>=left)
+		{
+			bytes-=left;
+			m_sendbuffer.pop_front();
+		}
+		else
+		{
+			fragment.m_offset+=bytes;
+			bytes=0;
+		}
+	}
+}
+
+void RemoteClientConnection::SetWorkVerified(const int64 id, const int64 mhindex, const bool valid)
+{
+	SCOPEDTIME("RemoteClientConnection::SetWorkVerified");
+	if(mhindex>=0)
 	{
-		for(std::vector<metahash>::const_iterator j=(*i).m_metahashes.begin(); j!=(*i).m_metahashes.end(); j++)
+		std::map<int64,sentwork>::iterator i=m_sentwork.find(id);
+		if(i!=m_sentwork.end() && (*i).second.m_metahashes.size()>mhindex)
 		{
-			if(difftime(now,(*j).m_senttime)<=sec)
+			(*i).second.m_metahashes[mhindex].m_verified=true;
+			if(valid)
 			{
-				if(earliest>(*j).m_senttime)
-				{
-					earliest=(*j).m_senttime;
-				}
-				hash+=BITCOINMINERREMOTE_HASHESPERMETA;
+				m_verifiedmetahashcount++;
+			}
+			else
+			{
+				m_failedmetahashcount++;
 			}
 		}
 	}
+}
+
+#ifdef _BITCOIN_REMOTE_EPOLL_
+
+const bool RemoteClientConnection::AddToEpoll(const int epollfd)
+{
+	struct epoll_event ev;
+	memset(&ev,0,sizeof(ev));
+	ev.events=EPOLLIN|EPOLLRDHUP|EPOLLET;
+	ev.data.ptr=this;
+	if(IsConnected() && fcntl(m_socket,F_SETFL,fcntl(m_socket,F_GETFL,0)|O_NONBLOCK)!=-1 && epoll_ctl(epollfd,EPOLL_CTL_ADD,m_socket,&ev)==0)
+	{
+		m_epollfd=epollfd;
+		m_epollout=false;
+		return true;
+	}
+	return false;
+}
 
-	int s=(std::min)(static_cast<int>(now-earliest),sec);
-	s=(std::max)(s,minsec);
-	int64 denom=(static_cast<int64>(s)*static_cast<int64>(1000));
-	if(denom!=0)
+void RemoteClientConnection::SetEpollOut(const bool wantout)
+{
+	if(IsConnected() && m_epollfd!=-1 && m_epollout!=wantout)
 	{
-		return hash/denom;
+		struct epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.events=EPOLLIN|EPOLLRDHUP|EPOLLET|(wantout ? EPOLLOUT : 0);
+		ev.data.ptr=this;
+		if(epoll_ctl(m_epollfd,EPOLL_CTL_MOD,m_socket,&ev)==0)
+		{
+			m_epollout=wantout;
+		}
 	}
-	else
+}
+
+// with edge-triggered notification the socket is drained until it would block
+const bool RemoteClientConnection::SocketReceive()
+{
+	SCOPEDTIME("RemoteClientConnection::SocketReceive");
+	bool received=false;
+	while(IsConnected() && m_receivebuffer.Size()<=(1024*1024))
 	{
-		return 0;
+		int rval=::recv(GetSocket(),m_receivebuffer.Reserve(8192),8192,0);
+		if(rval>0)
+		{
+			m_receivebuffer.Commit(rval);
+			received=true;
+			m_lastactive=time(0);
+		}
+		else if(rval<0 && errno==EINTR)
+		{
+			continue;
+		}
+		else if(rval<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+		{
+			break;
+		}
+		else
+		{
+			Disconnect();
+		}
+	}
+	return received;
+}
+
+const bool RemoteClientConnection::SocketSend()
+{
+	SCOPEDTIME("RemoteClientConnection::SocketSend");
+	bool sent=false;
+	CRITICAL_BLOCK(m_cssend)
+	{
+		while(IsConnected() && m_sendbuffersize>0)
+		{
+			int rval=WriteFragments();
+			if(rval>0)
+			{
+				FragmentsSent(rval);
+				m_lastactive=time(0);
+				sent=true;
+			}
+			else if(rval<0 && errno==EINTR)
+			{
+				continue;
+			}
+			else if(rval<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			{
+				break;
+			}
+			else
+			{
+				Disconnect();
+			}
+		}
+		SetEpollOut(m_sendbuffersize>0);
+	}
+	return sent;
+}
+
+#else
+
+const bool RemoteClientConnection::SocketReceive()
+{
+	SCOPEDTIME("RemoteClientConnection::SocketReceive");
+	bool received=false;
+	if(IsConnected())
+	{
+		int rval=::recv(GetSocket(),m_receivebuffer.Reserve(8192),8192,0);
+		if(rval>0)
+		{
+			m_receivebuffer.Commit(rval);
+			received=true;
+			m_lastactive=time(0);
+		}
+		else
+		{
+			Disconnect();
+		}
+	}
+	return received;
+}
+
+const bool RemoteClientConnection::SocketSend()
+{
+	SCOPEDTIME("RemoteClientConnection::SocketSend");
+	bool sent=false;
+	CRITICAL_BLOCK(m_cssend)
+	{
+		if(IsConnected() && m_sendbuffersize>0)
+		{
+			int rval=WriteFragments();
+			if(rval>0)
+			{
+				FragmentsSent(rval);
+				m_lastactive=time(0);
+			}
+			else
+			{
+				Disconnect();
+			}
+		}
+	}
+	return sent;
+}
+
+#endif	// _BITCOIN_REMOTE_EPOLL_
+
+
+
+
+
+MetaHashVerifier::MetaHashVerifier():m_kernel(0),m_threadcount(0),m_running(0),m_busy(0),m_stop(false)
+{
+
+}
+
+MetaHashVerifier::~MetaHashVerifier()
+{
+	Stop();
+}
+
+const bool MetaHashVerifier::Start(const int threads)
+{
+	m_kernel=SelectSHA256Kernel(GetArg("-kernel",""),false);
+	m_stop=false;
+	m_threadcount=0;
+	for(int i=0; i<threads; i++)
+	{
+		CRITICAL_BLOCK(m_cs)
+		{
+			m_running++;
+		}
+		if(CreateThread(MetaHashVerifier::ThreadVerifier,this))
+		{
+			m_threadcount++;
+		}
+		else
+		{
+			CRITICAL_BLOCK(m_cs)
+			{
+				m_running--;
+			}
+		}
+	}
+	printf("MetaHashVerifier started %d threads using %s SHA-256\n",m_threadcount,m_kernel->pszDescription);
+	return m_threadcount>0;
+}
+
+void MetaHashVerifier::Stop()
+{
+	int running=0;
+	CRITICAL_BLOCK(m_cs)
+	{
+		m_stop=true;
+		m_jobs.clear();
+		running=m_running;
+	}
+	while(running>0)
+	{
+		Sleep(10);
+		CRITICAL_BLOCK(m_cs)
+		{
+			running=m_running;
+		}
+	}
+	m_threadcount=0;
+}
+
+const int MetaHashVerifier::GetJobCount()
+{
+	CRITICAL_BLOCK(m_cs)
+	{
+		return m_jobs.size()+m_busy;
+	}
+	return 0;
+}
+
+void MetaHashVerifier::AddJob(const RemoteClientConnection *client, const RemoteClientConnection::sentwork &work)
+{
+	job j;
+	j.m_clientid=client->GetID();
+	j.m_workid=work.m_blockid;
+	j.m_mhindex=work.m_metahashes.size()-1;
+	j.m_block=work.m_block;
+	j.m_midstate=work.m_midstate;
+	j.m_digest=work.m_metahashes[j.m_mhindex].m_metahash;
+	j.m_startnonce=work.m_metahashes[j.m_mhindex].m_startnonce;
+	j.m_metahashsize=work.m_metahashsize;
+
+	CRITICAL_BLOCK(m_cs)
+	{
+		m_jobs.push_back(j);
+	}
+}
+
+void MetaHashVerifier::AddSegmentJob(const RemoteClientConnection *client, const RemoteClientConnection::sentwork &work, const int64 mhindex, const std::vector<unsigned int> &segments, const std::vector<unsigned char> &leaves)
+{
+	job j;
+	j.m_clientid=client->GetID();
+	j.m_workid=work.m_blockid;
+	j.m_mhindex=mhindex;
+	j.m_block=work.m_block;
+	j.m_midstate=work.m_midstate;
+	j.m_digest=work.m_metahashes[mhindex].m_metahash;
+	j.m_startnonce=work.m_metahashes[mhindex].m_startnonce;
+	j.m_metahashsize=work.m_metahashsize;
+	j.m_segmentsize=work.m_segmentsize;
+	j.m_segments=segments;
+	j.m_leaves=leaves;
+
+	CRITICAL_BLOCK(m_cs)
+	{
+		m_jobs.push_back(j);
+	}
+}
+
+const bool MetaHashVerifier::GetResult(job &result)
+{
+	CRITICAL_BLOCK(m_cs)
+	{
+		if(m_results.size()>0)
+		{
+			result=m_results[0];
+			m_results.erase(m_results.begin());
+			return true;
+		}
+	}
+	return false;
+}
+
+void MetaHashVerifier::ThreadVerifier(void *arg)
+{
+	MetaHashVerifier *verifier=(MetaHashVerifier *)arg;
+	bool stop=false;
+
+	SetThreadPriority(THREAD_PRIORITY_LOWEST);
+
+	while(stop==false)
+	{
+		job j;
+		bool havejob=false;
+		CRITICAL_BLOCK(verifier->m_cs)
+		{
+			stop=verifier->m_stop;
+			if(stop==false && verifier->m_jobs.size()>0)
+			{
+				j=verifier->m_jobs.front();
+				verifier->m_jobs.pop_front();
+				verifier->m_busy++;
+				havejob=true;
+			}
+		}
+
+		if(havejob)
+		{
+			Verify(j,verifier->m_kernel);
+			CRITICAL_BLOCK(verifier->m_cs)
+			{
+				verifier->m_busy--;
+				verifier->m_results.push_back(j);
+			}
+		}
+		else if(stop==false)
+		{
+			Sleep(100);
+		}
+	}
+
+	CRITICAL_BLOCK(verifier->m_cs)
+	{
+		verifier->m_running--;
+	}
+}
+
+void MetaHashVerifier::Verify(job &j, const SHA256Kernel *kernel)
+{
+	static const unsigned int SHA256InitState[8] ={0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	uint256 tempbuff[4];
+	uint256 &temphash=*alignup<16>(tempbuff);
+	uint256 hashbuff[4];
+	uint256 &hash=*alignup<16>(hashbuff);
+	unsigned char midbuff[256];
+	unsigned char blockbuff[256];
+	unsigned char *midbuffptr=alignup<16>(midbuff);
+	unsigned char *blockbuffptr=alignup<16>(blockbuff);
+	unsigned int *nonce=(unsigned int *)(blockbuffptr+12);
+	unsigned int thash[9][NPAR];
+	MetaHashDigest metahash;
+	std::vector<unsigned char> digest;
+	// nonce ranges to hash again and the digest each must have
+	std::vector<std::pair<unsigned int,unsigned int> > ranges;
+	std::vector<std::vector<unsigned char> > expected;
+
+	if(j.m_block.size()!=64 || j.m_midstate.size()!=32 || j.m_leaves.size()!=j.m_segments.size()*32)
+	{
+		j.m_verified=false;
+		return;
 	}
-}
 
-const bool RemoteClientConnection::GetNewestSentWorkWithMetaHash(sentwork &work) const
-{
-	SCOPEDTIME("RemoteClientConnection::GetNewestSentWorkWithMetaHash");
-	bool found=false;
-	time_t newest=0;
-	for(std::vector<sentwork>::const_iterator i=m_sentwork.begin(); i!=m_sentwork.end(); i++)
+	if(j.m_segmentsize==0)
 	{
-		if((*i).m_senttime>=newest && (*i).m_metahashes.size()>0)
+		ranges.push_back(std::pair<unsigned int,unsigned int>(j.m_startnonce,j.m_metahashsize));
+		expected.push_back(j.m_digest);
+	}
+	else
+	{
+		for(std::vector<unsigned int>::size_type i=0; i<j.m_segments.size(); i++)
 		{
-			work=(*i);
-			newest=(*i).m_senttime;
-			found=true;
+			unsigned int offset=j.m_segments[i]*j.m_segmentsize;
+			if(offset>=j.m_metahashsize)
+			{
+				j.m_verified=false;
+				return;
+			}
+			ranges.push_back(std::pair<unsigned int,unsigned int>(j.m_startnonce+offset,(std::min)(j.m_segmentsize,j.m_metahashsize-offset)));
+			expected.push_back(std::vector<unsigned char>(j.m_leaves.begin()+i*32,j.m_leaves.begin()+(i+1)*32));
 		}
 	}
-	return found;
-}
 
-const bool RemoteClientConnection::GetSentWorkByBlock(const std::vector<unsigned char> &block, sentwork **work)
-{
-	SCOPEDTIME("RemoteClientConnection::GetSentWorkByBlock");
-	for(std::vector<sentwork>::reverse_iterator i=m_sentwork.rbegin(); i!=m_sentwork.rend(); i++)
+	temphash=0;
+	FormatHashBlocks(&temphash,sizeof(uint256));
+	for(int i=0; i<64/4; i++)
 	{
-		if((*i).m_block==block)
-		{
-			*work=&(*i);
-			return true;
-		}
+		((unsigned int*)&temphash)[i] = CryptoPP::ByteReverse(((unsigned int*)&temphash)[i]);
 	}
 
-	return false;
-}
+	::memcpy(blockbuffptr,&j.m_block[0],64);
+	::memcpy(midbuffptr,&j.m_midstate[0],32);
 
-const bool RemoteClientConnection::GetSentWorkByID(const int64 id, sentwork **work)
-{
-	SCOPEDTIME("RemoteClientConnection::GetSentWorkByID");
-	for(std::vector<sentwork>::reverse_iterator i=m_sentwork.rbegin(); i!=m_sentwork.rend(); i++)
+	j.m_verified=true;
+	for(std::vector<std::pair<unsigned int,unsigned int> >::size_type r=0; r<ranges.size() && j.m_verified==true; r++)
 	{
-		if((*i).m_blockid==id)
+		(*nonce)=ranges[r].first;
+		for(unsigned int pos=0; pos<ranges[r].second; )
 		{
-			*work=&(*i);
-			return true;
+			if(pos+NPAR<=ranges[r].second)
+			{
+				kernel->pDoubleBlock(blockbuffptr,&temphash,midbuffptr,thash,SHA256InitState);
+				for(int k=0; k<NPAR; k++)
+				{
+					metahash.Add(((unsigned char *)&thash[0][k])[0]);
+				}
+				(*nonce)+=NPAR;
+				pos+=NPAR;
+			}
+			else
+			{
+				SHA256Transform(&temphash,blockbuffptr,midbuffptr);
+				SHA256Transform(&hash,&temphash,SHA256InitState);
+				metahash.Add(((unsigned char *)&hash)[0]);
+				(*nonce)++;
+				pos++;
+			}
 		}
-	}
 
-	return false;
+		metahash.Final(digest);
+		j.m_verified=(digest==expected[r]);
+	}
 }
 
-const bool RemoteClientConnection::MessageReady() const
-{
-	SCOPEDTIME("RemoteClientConnection::MessageReady");
-	return RemoteMinerMessage::MessageReady(m_receivebuffer);
-}
 
-const bool RemoteClientConnection::ProtocolError() const
+RemoteMessageWorkers::RemoteMessageWorkers():m_server(0),m_threadcount(0),m_running(0),m_stop(false)
 {
-	SCOPEDTIME("RemoteClientConnection::ProtocolError");
-	return RemoteMinerMessage::ProtocolError(m_receivebuffer);
-}
 
-const bool RemoteClientConnection::ReceiveMessage(RemoteMinerMessage &message)
-{
-	SCOPEDTIME("RemoteClientConnection::ReceiveMessage");
-	return RemoteMinerMessage::ReceiveMessage(m_receivebuffer,message);
 }
 
-void RemoteClientConnection::SendMessage(const RemoteMinerMessage &message)
+RemoteMessageWorkers::~RemoteMessageWorkers()
 {
-	SCOPEDTIME("RemoteClientConnection::SendMessage");
-	message.PushWireData(m_sendbuffer);
+	Stop();
 }
 
-void RemoteClientConnection::SetWorkVerified(const int64 id, const int64 mhindex, const bool valid)
+const bool RemoteMessageWorkers::Start(BitcoinMinerRemoteServer *server, const int threads)
 {
-	SCOPEDTIME("RemoteClientConnection::SetWorkVerified");
-	if(mhindex>=0)
+	m_server=server;
+	m_stop=false;
+	m_threadcount=0;
+	for(int i=0; i<threads+1; i++)
 	{
-		for(std::vector<sentwork>::reverse_iterator i=m_sentwork.rbegin(); i!=m_sentwork.rend(); i++)
+		CRITICAL_BLOCK(m_cs)
+		{
+			m_running++;
+		}
+		// the first thread is the found hash lane
+		if(CreateThread(i==0 ? RemoteMessageWorkers::ThreadFoundHash : RemoteMessageWorkers::ThreadWorker,this))
 		{
-			if((*i).m_blockid==id && (*i).m_metahashes.size()>mhindex)
+			if(i>0)
 			{
-				(*i).m_metahashes[mhindex].m_verified=true;
-				if(valid)
-				{
-					m_verifiedmetahashcount++;
-				}
-				return;
+				m_threadcount++;
+			}
+		}
+		else
+		{
+			CRITICAL_BLOCK(m_cs)
+			{
+				m_running--;
 			}
 		}
 	}
+	printf("RemoteMessageWorkers started %d threads\n",m_threadcount);
+	return m_threadcount>0;
 }
 
-const bool RemoteClientConnection::SocketReceive()
+void RemoteMessageWorkers::Stop()
 {
-	SCOPEDTIME("RemoteClientConnection::SocketReceive");
-	bool received=false;
-	if(IsConnected())
+	int running=0;
+	CRITICAL_BLOCK(m_cs)
 	{
-		int rval=::recv(GetSocket(),&m_tempbuffer[0],m_tempbuffer.size(),0);
-		if(rval>0)
+		m_stop=true;
+		running=m_running;
+	}
+	while(running>0)
+	{
+		Sleep(10);
+		CRITICAL_BLOCK(m_cs)
 		{
-			m_receivebuffer.insert(m_receivebuffer.end(),m_tempbuffer.begin(),m_tempbuffer.begin()+rval);
-			received=true;
-			m_lastactive=time(0);
+			running=m_running;
 		}
-		else
+	}
+	CRITICAL_BLOCK(m_cs)
+	{
+		m_queues.clear();
+		m_ready.clear();
+		m_foundhashes.clear();
+	}
+	m_threadcount=0;
+}
+
+void RemoteMessageWorkers::AddMessage(RemoteClientConnection *client, const RemoteMinerMessage &message, const bool foundhash)
+{
+	job j(JOB_MESSAGE);
+	j.m_message=message;
+	if(foundhash)
+	{
+		CRITICAL_BLOCK(m_cs)
 		{
-			Disconnect();
+			m_queues[client].m_pending++;
+			m_foundhashes.push_back(std::pair<RemoteClientConnection *,job>(client,j));
 		}
 	}
-	return received;
+	else
+	{
+		AddJob(client,j);
+	}
 }
 
-const bool RemoteClientConnection::SocketSend()
+void RemoteMessageWorkers::AddJob(RemoteClientConnection *client, const job &j)
 {
-	SCOPEDTIME("RemoteClientConnection::SocketSend");
-	bool sent=false;
-	if(IsConnected() && m_sendbuffer.size()>0)
+	CRITICAL_BLOCK(m_cs)
 	{
-		int rval=::send(GetSocket(),&m_sendbuffer[0],m_sendbuffer.size(),0);
-		if(rval>0)
+		clientqueue &queue=m_queues[client];
+		if(j.m_type!=JOB_MESSAGE && j.m_type!=JOB_VERIFIED)
 		{
-			m_sendbuffer.erase(m_sendbuffer.begin(),m_sendbuffer.begin()+rval);
-			m_lastactive=time(0);
+			for(std::deque<job>::const_iterator i=queue.m_jobs.begin(); i!=queue.m_jobs.end(); i++)
+			{
+				if((*i).m_type==j.m_type)
+				{
+					return;
+				}
+			}
 		}
-		else
+		queue.m_jobs.push_back(j);
+		queue.m_pending++;
+		if(queue.m_scheduled==false)
 		{
-			Disconnect();
+			queue.m_scheduled=true;
+			m_ready.push_back(client);
 		}
 	}
-	return sent;
-}
-
-
-
-
-
-MetaHashVerifier::MetaHashVerifier():m_done(false),m_client(0)
-{
-
 }
 
-MetaHashVerifier::~MetaHashVerifier()
+const bool RemoteMessageWorkers::Release(RemoteClientConnection *client)
 {
-	
+	CRITICAL_BLOCK(m_cs)
+	{
+		std::map<RemoteClientConnection *,clientqueue>::iterator i=m_queues.find(client);
+		if(i!=m_queues.end())
+		{
+			if((*i).second.m_pending>0)
+			{
+				return false;
+			}
+			m_queues.erase(i);
+		}
+	}
+	return true;
 }
 
-void MetaHashVerifier::Start(RemoteClientConnection *client, const RemoteClientConnection::sentwork &work)
+void RemoteMessageWorkers::ThreadWorker(void *arg)
 {
-	SCOPEDTIME("MetaHashVerifier::Start");
-	m_temphash=alignup<16>(m_tempbuff);
-	m_hash=alignup<16>(m_hashbuff);
-	m_midbuffptr=alignup<16>(m_midbuff);
-	m_blockbuffptr=alignup<16>(m_blockbuff);
-	m_nonce=(unsigned int *)(m_blockbuffptr+12);
-	m_metahash.clear();
-	m_metahash.resize(BITCOINMINERREMOTE_HASHESPERMETA,0);
-	m_metahashpos=0;
+	RemoteMessageWorkers *workers=(RemoteMessageWorkers *)arg;
+	bool stop=false;
 
-	m_client=client;
-	m_workid=work.m_blockid;
+	SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
-	for(int i=0; i<3; i++)
+	while(stop==false)
 	{
-		m_tempbuff[i]=0;
-		m_hashbuff[i]=0;
-	}
-	*m_temphash=0;
-	*m_hash=0;
+		RemoteClientConnection *client=0;
+		job j;
+		CRITICAL_BLOCK(workers->m_cs)
+		{
+			stop=workers->m_stop;
+			if(stop==false && workers->m_ready.size()>0)
+			{
+				client=workers->m_ready.front();
+				workers->m_ready.pop_front();
+				clientqueue &queue=workers->m_queues[client];
+				j=queue.m_jobs.front();
+				queue.m_jobs.pop_front();
+			}
+		}
 
-	m_mhindex=work.m_metahashes.size()-1;
+		if(client!=0)
+		{
+			workers->m_server->HandleJob(client,j);
+			CRITICAL_BLOCK(workers->m_cs)
+			{
+				clientqueue &queue=workers->m_queues[client];
+				queue.m_pending--;
+				// one job at a time, so a client that sends a lot doesn't hold up the others
+				if(queue.m_jobs.size()>0)
+				{
+					workers->m_ready.push_back(client);
+				}
+				else
+				{
+					queue.m_scheduled=false;
+				}
+			}
+		}
+		else if(stop==false)
+		{
+			Sleep(10);
+		}
+	}
 
-	FormatHashBlocks(m_temphash,sizeof(uint256));
-	for(int i=0; i<64/4; i++)
+	CRITICAL_BLOCK(workers->m_cs)
 	{
-		((unsigned int*)m_temphash)[i] = CryptoPP::ByteReverse(((unsigned int*)m_temphash)[i]);
+		workers->m_running--;
 	}
-
-	::memcpy(m_blockbuffptr,&(work.m_block[0]),work.m_block.size());
-	::memcpy(m_midbuffptr,&(work.m_midstate[0]),work.m_midstate.size());
-
-	m_startnonce=work.m_metahashes[m_mhindex].m_startnonce;
-	m_digest=work.m_metahashes[m_mhindex].m_metahash;
-
-	m_done=false;
-
 }
 
-
-
-void MetaHashVerifier::Step(const int hashes)
+void RemoteMessageWorkers::ThreadFoundHash(void *arg)
 {
-	SCOPEDTIME("MetaHashVerifier::Step");
-	const unsigned int SHA256InitState[8] ={0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
-	const unsigned int startpos=m_metahashpos;
+	RemoteMessageWorkers *workers=(RemoteMessageWorkers *)arg;
+	bool stop=false;
+
+	SetThreadPriority(THREAD_PRIORITY_NORMAL);
 
-	for((*m_nonce)=m_startnonce+m_metahashpos; (*m_nonce)<(m_startnonce+startpos+hashes) && (*m_nonce)<m_startnonce+BITCOINMINERREMOTE_HASHESPERMETA; (*m_nonce)++,m_metahashpos++)
+	while(stop==false)
 	{
-		SHA256Transform(m_temphash,m_blockbuffptr,m_midbuffptr);
-		SHA256Transform(m_hash,m_temphash,SHA256InitState);
-		
-		m_metahash[m_metahashpos]=((unsigned char *)m_hash)[0];
+		std::pair<RemoteClientConnection *,job> found(0,job());
+		CRITICAL_BLOCK(workers->m_cs)
+		{
+			stop=workers->m_stop;
+			if(stop==false && workers->m_foundhashes.size()>0)
+			{
+				found=workers->m_foundhashes.front();
+				workers->m_foundhashes.pop_front();
+			}
+		}
+
+		if(found.first!=0)
+		{
+			// waits for a worker that is busy with the same client
+			workers->m_server->HandleJob(found.first,found.second);
+			CRITICAL_BLOCK(workers->m_cs)
+			{
+				workers->m_queues[found.first].m_pending--;
+			}
+		}
+		else if(stop==false)
+		{
+			Sleep(10);
+		}
 	}
 
-	if(m_metahashpos>=m_metahash.size())
+	CRITICAL_BLOCK(workers->m_cs)
 	{
-		std::vector<unsigned char> digest(SHA256_DIGEST_LENGTH,0);
-		SHA256(&m_metahash[0],m_metahash.size(),&digest[0]);
-		
-		m_verified=(digest==m_digest);
-		m_done=true;
+		workers->m_running--;
 	}
 }
 
-
-
-
-BitcoinMinerRemoteServer::BitcoinMinerRemoteServer():m_bnExtraNonce(0),m_startuptime(0),m_generatedcount(0),m_distributiontype("connected")
+BitcoinMinerRemoteServer::BitcoinMinerRemoteServer():m_bnExtraNonce(0),m_templatefilled(false),m_templatebuilderrunning(false),m_stoptemplatebuilder(false),m_lasttipchanges(GetRemoteTipChanges()),m_metahashcount(0),m_stalemetahashcount(0),m_totalmetahashcount(0),m_totalstalemetahashcount(0),m_startuptime(0),m_generatedcount(0),m_distributiontype("connected"),m_password(""),m_accounting("metahash"),m_sendworktoall(false),m_allkhashmeta(0),m_allkhashbest(0),m_allclients(0),m_allkhashtime(0)
 {
 #ifdef _WIN32
 	if(m_wsastartup==false)
@@ -448,6 +1260,10 @@ BitcoinMinerRemoteServer::BitcoinMinerRemoteServer():m_bnExtraNonce(0),m_startup
 		WSAStartup(MAKEWORD(2,2),&wsadata);
 		m_wsastartup=true;
 	}
+#endif
+#ifdef _BITCOIN_REMOTE_EPOLL_
+	m_epollfd=epoll_create(1024);
+	m_epollevents.resize(1024);
 #endif
 	ReadBanned("banned.txt");
 
@@ -461,6 +1277,32 @@ BitcoinMinerRemoteServer::BitcoinMinerRemoteServer():m_bnExtraNonce(0),m_startup
 	}
 	printf("BitcoinMinerRemoteServer distribution method %s\n",m_distributiontype.c_str());
 
+	m_metahashinterval=GetArg("-remotemetahashinterval",10);
+
+	// a client that skips a fraction f of its nonces is caught with probability 1-(1-f)^challenges
+	m_metahashchallenges=(std::max)((std::min)(static_cast<int>(GetArg("-remotemetahashchallenges",4)),static_cast<int>(RemoteMinerMessage::MAX_CHALLENGES)),0);
+	printf("BitcoinMinerRemoteServer checks %d metahash segments per verification\n",m_metahashchallenges);
+
+	m_maxverifyinterval=GetArg("-remotemaxverifyinterval",600);
+
+	// the seconds a client rolled nTime on are part of the ids of its work, so the window can't be larger than they allow
+	m_ntimewindow=(std::max)((std::min)(static_cast<int>(GetArg("-remotentimewindow",300)),static_cast<int>(RemoteMinerMessage::MAX_ROLLEDTIME)),0);
+
+	if(mapArgs.count("-remoteaccounting")>0)
+	{
+		m_accounting=mapArgs["-remoteaccounting"];
+		if(m_accounting!="metahash" && m_accounting!="shares")
+		{
+			m_accounting="metahash";
+		}
+	}
+	printf("BitcoinMinerRemoteServer accounting method %s\n",m_accounting.c_str());
+
+	if(mapArgs.count("-remotepassword")>0)
+	{
+		m_password=mapArgs["-remotepassword"];
+	}
+
 	LoadContributedHashes();
 
 	if(mapArgs.count("-resethashescontributed")>0)
@@ -475,6 +1317,10 @@ BitcoinMinerRemoteServer::~BitcoinMinerRemoteServer()
 {
 	printf("BitcoinMinerRemoteServer::~BitcoinMinerRemoteServer()\n");
 
+	// the workers hold pointers to the clients
+	m_workers.Stop();
+	StopTemplateBuilder();
+
 	// stop listening
 	for(std::vector<SOCKET>::iterator i=m_listensockets.begin(); i!=m_listensockets.end(); i++)
 	{
@@ -488,33 +1334,46 @@ BitcoinMinerRemoteServer::~BitcoinMinerRemoteServer()
 		delete (*i);
 	}
 
+#ifdef _BITCOIN_REMOTE_EPOLL_
+	if(m_epollfd!=-1)
+	{
+		close(m_epollfd);
+	}
+#endif
+
 	SaveContributedHashes();
 };
 
-void BitcoinMinerRemoteServer::AddDistributionFromConnected(CBlock *pblock, CBlockIndex *pindexPrev, int64 nFees)
+void BitcoinMinerRemoteServer::AddDistributionFromConnected(CTransaction &txCoinbase, CBlockIndex *pindexPrev, int64 nFees)
 {
 	SCOPEDTIME("BitcoinMinerRemoteServer::AddDistributionFromConnected");
 	std::map<uint160,int64> addressamountmap;
+	std::map<uint160,int64> connectedkhash;
+	int64 allkhash=0;
 
-	// add output for each connected client proportional to their khash
-	for(std::vector<RemoteClientConnection *>::const_iterator i=m_clients.begin(); i!=m_clients.end(); i++)
+	// the rates are taken from the last sum over the clients, the other clients may be busy on other threads
+	CRITICAL_BLOCK(m_cs)
+	{
+		connectedkhash=m_connectedkhash;
+		allkhash=m_allkhashmeta;
+	}
+
+	// add output for each connected address proportional to their khash
+	for(std::map<uint160,int64>::const_iterator i=connectedkhash.begin(); i!=connectedkhash.end(); i++)
 	{
-		uint160 ch=0;
-		if((*i)->GetRequestedRecipientAddress(ch))
+		const int64 khash=(*i).second;
+		if(khash>0 && allkhash>0)
 		{
-			if((*i)->GetCalculatedKHashRateFromMetaHash()>0 && GetAllClientsCalculatedKHashFromMeta()>0)
+			double khashfrac=static_cast<double>(khash)/static_cast<double>(allkhash);
+			int64 thisvalue=GetBlockValue(pindexPrev->nHeight+1, nFees)*khashfrac;
+			if(thisvalue>txCoinbase.vout[0].nValue)
 			{
-				double khashfrac=static_cast<double>((*i)->GetCalculatedKHashRateFromMetaHash())/static_cast<double>(GetAllClientsCalculatedKHashFromMeta());
-				int64 thisvalue=GetBlockValue(pindexPrev->nHeight+1, nFees)*khashfrac;
-				if(thisvalue>pblock->vtx[0].vout[0].nValue)
-				{
-					thisvalue=pblock->vtx[0].vout[0].nValue;
-				}
-				addressamountmap[ch]+=thisvalue;
-
-				pblock->vtx[0].vout[0].nValue-=thisvalue;
-				
+				thisvalue=txCoinbase.vout[0].nValue;
 			}
+			addressamountmap[(*i).first]+=thisvalue;
+
+			txCoinbase.vout[0].nValue-=thisvalue;
+			
 		}
 	}
 
@@ -523,11 +1382,11 @@ void BitcoinMinerRemoteServer::AddDistributionFromConnected(CBlock *pblock, CBlo
 		CTxOut out;
 		out.scriptPubKey << OP_DUP << OP_HASH160 << (*i).first << OP_EQUALVERIFY << OP_CHECKSIG;
 		out.nValue=(*i).second;
-		pblock->vtx[0].vout.push_back(out);
+		txCoinbase.vout.push_back(out);
 	}
 }
 
-void BitcoinMinerRemoteServer::AddDistributionFromContributed(CBlock *pblock, CBlockIndex *pindexPrev, int64 nFees)
+void BitcoinMinerRemoteServer::AddDistributionFromContributed(CTransaction &txCoinbase, CBlockIndex *pindexPrev, int64 nFees)
 {
 	SCOPEDTIME("BitcoinMinerRemoteServer::AddDistributionFromContributed");
 	CBigNum numerator=0;
@@ -535,8 +1394,14 @@ void BitcoinMinerRemoteServer::AddDistributionFromContributed(CBlock *pblock, CB
 	std::map<uint160,uint256> hashes;
 	std::map<uint160,uint256> addressamountmap;
 
+	std::map<uint160,uint256> previoushashes;
+
 	// add up all contributing hashes
-	hashes=m_currenthashescontributed;
+	CRITICAL_BLOCK(m_cs)
+	{
+		hashes=m_currenthashescontributed;
+		previoushashes=m_previoushashescontributed;
+	}
 	for(std::map<uint160,uint256>::const_iterator i=hashes.begin(); i!=hashes.end(); i++)
 	{
 		denominator+=CBigNum((*i).second);
@@ -545,7 +1410,7 @@ void BitcoinMinerRemoteServer::AddDistributionFromContributed(CBlock *pblock, CB
 	// if we just solved the current block, the current hashes contributed will be empty, so we need to look at the old hashes contributed
 	if(denominator<=0)
 	{
-		hashes=m_previoushashescontributed;
+		hashes=previoushashes;
 		for(std::map<uint160,uint256>::const_iterator i=hashes.begin(); i!=hashes.end(); i++)
 		{
 			denominator+=CBigNum((*i).second);
@@ -569,17 +1434,17 @@ void BitcoinMinerRemoteServer::AddDistributionFromContributed(CBlock *pblock, CB
 				int64 thisvalue;
 				std::istringstream istr(thisvaluebn.ToString());
 				istr >> thisvalue;
-				if(thisvalue>pblock->vtx[0].vout[0].nValue)
+				if(thisvalue>txCoinbase.vout[0].nValue)
 				{
-					thisvalue=pblock->vtx[0].vout[0].nValue;
+					thisvalue=txCoinbase.vout[0].nValue;
 				}
 
-				pblock->vtx[0].vout[0].nValue-=thisvalue;
+				txCoinbase.vout[0].nValue-=thisvalue;
 
 				CTxOut out;
 				out.scriptPubKey << OP_DUP << OP_HASH160 << (*i).first << OP_EQUALVERIFY << OP_CHECKSIG;
 				out.nValue=thisvalue;
-				pblock->vtx[0].vout.push_back(out);
+				txCoinbase.vout.push_back(out);
 
 			}
 		}
@@ -587,9 +1452,12 @@ void BitcoinMinerRemoteServer::AddDistributionFromContributed(CBlock *pblock, CB
 
 }
 
-void BitcoinMinerRemoteServer::BlockToJson(const CBlock *block, json_spirit::Object &obj)
+// block holds the header and coinbase, the rest of the transactions come from the template
+// the fullblock JSON up to and including the coinbase, the template's m_fullblocktail completes it
+const std::string BitcoinMinerRemoteServer::FullBlockHead(const CBlock *block, const RemoteBlockTemplate &blocktemplate)
 {
-	SCOPEDTIME("BitcoinMinerRemoteServer::BlockToJson");
+	SCOPEDTIME("BitcoinMinerRemoteServer::FullBlockHead");
+	json_spirit::Object obj;
 	obj.push_back(json_spirit::Pair("hash", block->GetHash().ToString().c_str()));
 	obj.push_back(json_spirit::Pair("ver", block->nVersion));
 	obj.push_back(json_spirit::Pair("prev_block", block->hashPrevBlock.ToString().c_str()));
@@ -597,68 +1465,65 @@ void BitcoinMinerRemoteServer::BlockToJson(const CBlock *block, json_spirit::Obj
 	obj.push_back(json_spirit::Pair("time", (uint64_t)block->nTime));
 	obj.push_back(json_spirit::Pair("bits", (uint64_t)block->nBits));
 	obj.push_back(json_spirit::Pair("nonce", (uint64_t)block->nNonce));
-	obj.push_back(json_spirit::Pair("n_tx", (int)block->vtx.size()));
-
-	json_spirit::Array tx;
-	for (int i = 0; i < block->vtx.size(); i++) {
-		json_spirit::Object txobj;
+	obj.push_back(json_spirit::Pair("n_tx", (int)(block->vtx.size()+blocktemplate.m_vtx.size())));
+
+	// the block only holds the coinbase, the object is reopened for the transaction list
+	json_spirit::Object coinbase;
+	TxToJson(block->vtx[0],coinbase);
+	std::string head=json_spirit::write(obj);
+	head.erase(head.size()-1);
+	head+=",\"tx\":[";
+	head+=json_spirit::write(coinbase);
+	return head;
+}
 
-	txobj.push_back(json_spirit::Pair("hash", block->vtx[i].GetHash().ToString().c_str()));
-	txobj.push_back(json_spirit::Pair("ver", block->vtx[i].nVersion));
-	txobj.push_back(json_spirit::Pair("vin_sz", (int)block->vtx[i].vin.size()));
-	txobj.push_back(json_spirit::Pair("vout_sz", (int)block->vtx[i].vout.size()));
-	txobj.push_back(json_spirit::Pair("lock_time", (uint64_t)block->vtx[i].nLockTime));
+void BitcoinMinerRemoteServer::TxToJson(const CTransaction &tx, json_spirit::Object &txobj)
+{
+	txobj.push_back(json_spirit::Pair("hash", tx.GetHash().ToString().c_str()));
+	txobj.push_back(json_spirit::Pair("ver", tx.nVersion));
+	txobj.push_back(json_spirit::Pair("vin_sz", (int)tx.vin.size()));
+	txobj.push_back(json_spirit::Pair("vout_sz", (int)tx.vout.size()));
+	txobj.push_back(json_spirit::Pair("lock_time", (uint64_t)tx.nLockTime));
 
 	json_spirit::Array tx_vin;
-	for (int j = 0; j < block->vtx[i].vin.size(); j++) {
+	for (int j = 0; j < tx.vin.size(); j++) {
 		json_spirit::Object vino;
 
 		json_spirit::Object vino_outpt;
 
 		vino_outpt.push_back(json_spirit::Pair("hash",
-    		block->vtx[i].vin[j].prevout.hash.ToString().c_str()));
-		vino_outpt.push_back(json_spirit::Pair("n", (uint64_t)block->vtx[i].vin[j].prevout.n));
+    		tx.vin[j].prevout.hash.ToString().c_str()));
+		vino_outpt.push_back(json_spirit::Pair("n", (uint64_t)tx.vin[j].prevout.n));
 
 		vino.push_back(json_spirit::Pair("prev_out", vino_outpt));
 
-		if (block->vtx[i].vin[j].prevout.IsNull())
+		if (tx.vin[j].prevout.IsNull())
     		vino.push_back(json_spirit::Pair("coinbase", HexStr(
-			block->vtx[i].vin[j].scriptSig.begin(),
-			block->vtx[i].vin[j].scriptSig.end(), false).c_str()));
+			tx.vin[j].scriptSig.begin(),
+			tx.vin[j].scriptSig.end(), false).c_str()));
 		else
     		vino.push_back(json_spirit::Pair("scriptSig", 
-			block->vtx[i].vin[j].scriptSig.ToString().c_str()));
-		if (block->vtx[i].vin[j].nSequence != UINT_MAX)
-    		vino.push_back(json_spirit::Pair("sequence", (uint64_t)block->vtx[i].vin[j].nSequence));
+			tx.vin[j].scriptSig.ToString().c_str()));
+		if (tx.vin[j].nSequence != UINT_MAX)
+    		vino.push_back(json_spirit::Pair("sequence", (uint64_t)tx.vin[j].nSequence));
 
 		tx_vin.push_back(vino);
 	}
 
 	json_spirit::Array tx_vout;
-	for (int j = 0; j < block->vtx[i].vout.size(); j++) {
+	for (int j = 0; j < tx.vout.size(); j++) {
 		json_spirit::Object vouto;
 
 		vouto.push_back(json_spirit::Pair("value",
-    		(double)block->vtx[i].vout[j].nValue / (double)COIN));
+    		(double)tx.vout[j].nValue / (double)COIN));
 		vouto.push_back(json_spirit::Pair("scriptPubKey", 
-		block->vtx[i].vout[j].scriptPubKey.ToString().c_str()));
+		tx.vout[j].scriptPubKey.ToString().c_str()));
 
 		tx_vout.push_back(vouto);
 	}
 
 	txobj.push_back(json_spirit::Pair("in", tx_vin));
 	txobj.push_back(json_spirit::Pair("out", tx_vout));
-
-	tx.push_back(txobj);
-	}
-
-	obj.push_back(json_spirit::Pair("tx", tx));
-
-	json_spirit::Array mrkl;
-	for (int i = 0; i < block->vMerkleTree.size(); i++)
-		mrkl.push_back(block->vMerkleTree[i].ToString().c_str());
-
-	obj.push_back(json_spirit::Pair("mrkl_tree", mrkl));
 }
 
 const bool BitcoinMinerRemoteServer::DecodeBase64(const std::string &encoded, std::vector<unsigned char> &decoded)
@@ -713,40 +1578,164 @@ const bool BitcoinMinerRemoteServer::EncodeBase64(const std::vector<unsigned cha
 
 const int64 BitcoinMinerRemoteServer::GetAllClientsCalculatedKHashFromBest() const
 {
-	SCOPEDTIME("BitcoinMinerRemoteServer::GetAllClientsCalculatedKHashFromBest");
-	int64 rval=0;
-	for(std::vector<RemoteClientConnection *>::const_iterator i=m_clients.begin(); i!=m_clients.end(); i++)
+	CRITICAL_BLOCK(m_cs)
 	{
-		rval+=(*i)->GetCalculatedKHashRateFromBestHash(600);
+		return m_allkhashbest;
 	}
-	return rval;
+	return 0;
 }
 
 const int64 BitcoinMinerRemoteServer::GetAllClientsCalculatedKHashFromMeta() const
 {
-	SCOPEDTIME("BitcoinMinerRemoteServer::GetAllClientsCalculatedKHashFromMeta");
-	int64 rval=0;
+	CRITICAL_BLOCK(m_cs)
+	{
+		return m_allkhashmeta;
+	}
+	return 0;
+}
+
+/*
+	The per client rates only change with time, so the sums are made by the
+	server thread once a second and kept for the workers.  A client that a
+	worker is busy with isn't waited for, the rates read from it last time
+	are counted instead.
+*/
+void BitcoinMinerRemoteServer::UpdateAllClientsCalculatedKHash()
+{
+	if(m_allkhashtime!=time(0))
+	{
+		SCOPEDTIME("BitcoinMinerRemoteServer::UpdateAllClientsCalculatedKHash");
+		int64 khashmeta=0;
+		int64 khashbest=0;
+		std::map<uint160,int64> connectedkhash;
+		for(std::vector<RemoteClientConnection *>::const_iterator i=m_clients.begin(); i!=m_clients.end(); i++)
+		{
+			clientkhash &ck=m_clientkhash[(*i)->GetID()];
+			TRY_CRITICAL_BLOCK((*i)->GetCS())
+			{
+				ck.m_meta=(*i)->GetCalculatedKHashRateFromMetaHash();
+				ck.m_best=(*i)->GetCalculatedKHashRateFromBestHash();
+				ck.m_hasaddress=(*i)->GetRequestedRecipientAddress(ck.m_address);
+			}
+			khashmeta+=ck.m_meta;
+			khashbest+=ck.m_best;
+			if(ck.m_hasaddress)
+			{
+				connectedkhash[ck.m_address]+=ck.m_meta;
+			}
+		}
+		CRITICAL_BLOCK(m_cs)
+		{
+			// miners on the stratum frontend count like clients of the address they authorized with
+			for(std::map<uint160,int64>::const_iterator i=m_stratumkhash.begin(); i!=m_stratumkhash.end(); i++)
+			{
+				connectedkhash[(*i).first]+=(*i).second;
+				khashmeta+=(*i).second;
+			}
+			m_allkhashmeta=khashmeta;
+			m_allkhashbest=khashbest;
+			m_allclients=m_clients.size();
+			m_connectedkhash.swap(connectedkhash);
+		}
+		m_allkhashtime=time(0);
+	}
+}
+
+// the client whose newest metahash is the most overdue for verification, relative to how much it is trusted
+RemoteClientConnection *BitcoinMinerRemoteServer::GetMetaHashClientToVerify()
+{
+	SCOPEDTIME("BitcoinMinerRemoteServer::GetMetaHashClientToVerify");
+	RemoteClientConnection *client=0;
+	double mostoverdue=1.0;
+	time_t now=time(0);
 	for(std::vector<RemoteClientConnection *>::const_iterator i=m_clients.begin(); i!=m_clients.end(); i++)
 	{
-		rval+=(*i)->GetCalculatedKHashRateFromMetaHash();
+		// a client a worker is busy with is looked at again next time
+		TRY_CRITICAL_BLOCK((*i)->GetCS())
+		{
+			if((*i)->VerifyingMetaHash()==false && (*i)->HasUnverifiedMetaHash())
+			{
+				double overdue=difftime(now,(*i)->GetLastVerifiedMetaHash())/static_cast<double>((std::max)(GetVerificationInterval(*i),1));
+				if(overdue>=mostoverdue)
+				{
+					client=(*i);
+					mostoverdue=overdue;
+				}
+			}
+		}
+	}
+	return client;
+}
+
+/*
+	Seconds a client may go between verifications.  Every passed metahash of
+	the client and its recipient address earns BITCOINMINERREMOTE_SECONDSPERTRUST
+	and every failure takes away BITCOINMINERREMOTE_TRUSTPERFAILURE passes, so
+	new and failing clients are checked on every metahash and trusted ones
+	only now and then.  A hash rate that more than doubled since the last
+	verification isn't covered by the earlier passes.
+*/
+const int BitcoinMinerRemoteServer::GetVerificationInterval(const RemoteClientConnection *client) const
+{
+	int64 passed=client->GetVerifiedMetaHashCount();
+	int64 failed=client->GetFailedMetaHashCount();
+	CRITICAL_BLOCK(m_cs)
+	{
+		std::map<uint160,addresstrust>::const_iterator trust=m_addresstrust.find(client->GetRecipientAddress());
+		if(client->GetRecipientAddress()!=0 && trust!=m_addresstrust.end())
+		{
+			passed+=(*trust).second.m_passed;
+			failed+=(*trust).second.m_failed;
+		}
+	}
+
+	if(client->GetLastVerifiedKHash()>0 && client->GetCalculatedKHashRateFromMetaHash()>client->GetLastVerifiedKHash()*2)
+	{
+		return 0;
+	}
+
+	int64 score=passed-(failed*BITCOINMINERREMOTE_TRUSTPERFAILURE);
+	if(score<=0)
+	{
+		return 0;
+	}
+	return static_cast<int>((std::min)(score*BITCOINMINERREMOTE_SECONDSPERTRUST,static_cast<int64>(m_maxverifyinterval)));
+}
+
+void BitcoinMinerRemoteServer::MetaHashVerified(RemoteClientConnection *client, const int64 workid, const int64 mhindex, const bool valid)
+{
+	client->SetWorkVerified(workid,mhindex,valid);
+	client->SetVerifyingMetaHash(false);
+	client->SetLastVerifiedMetaHash(time(0));
+	client->SetLastVerifiedKHash(client->GetCalculatedKHashRateFromMetaHash());
+	if(client->GetRecipientAddress()!=0)
+	{
+		CRITICAL_BLOCK(m_cs)
+		{
+			if(valid)
+			{
+				m_addresstrust[client->GetRecipientAddress()].m_passed++;
+			}
+			else
+			{
+				m_addresstrust[client->GetRecipientAddress()].m_failed++;
+			}
+		}
 	}
-	return rval;
+
+	printf("Client %s %s metahash verification, %"PRI64d" of %"PRI64d" metahashes checked, next check in %d seconds\n",client->GetAddress().c_str(),valid ? "passed" : "failed",client->GetVerifiedMetaHashCount()+client->GetFailedMetaHashCount(),client->GetReceivedMetaHashCount(),GetVerificationInterval(client));
 }
 
-RemoteClientConnection *BitcoinMinerRemoteServer::GetOldestNonVerifiedMetaHashClient()
+RemoteClientConnection *BitcoinMinerRemoteServer::GetClientByID(const int64 id)
 {
-	SCOPEDTIME("BitcoinMinerRemoteServer::GetOldestNonVerifiedMetaHashClient");
-	RemoteClientConnection *client=0;
-	time_t oldest=time(0);
 	for(std::vector<RemoteClientConnection *>::const_iterator i=m_clients.begin(); i!=m_clients.end(); i++)
 	{
-		if((*i)->GetLastVerifiedMetaHash()<=oldest)
+		if((*i)->GetID()==id)
 		{
-			client=(*i);
-			oldest=(*i)->GetLastVerifiedMetaHash();	
+			return (*i);
 		}
 	}
-	return client;
+	return 0;
 }
 
 void BitcoinMinerRemoteServer::LoadContributedHashes()
@@ -862,11 +1851,19 @@ void BitcoinMinerRemoteServer::ReadBanned(const std::string &filename)
 void BitcoinMinerRemoteServer::SaveContributedHashes()
 {
 	CWalletDB walletdb;
+	std::map<uint160,uint256> previoushashes;
+	std::map<uint160,uint256> currenthashes;
+
+	CRITICAL_BLOCK(m_cs)
+	{
+		previoushashes=m_previoushashescontributed;
+		currenthashes=m_currenthashescontributed;
+	}
 
 	std::string saveval("");
-	for(std::map<uint160,uint256>::const_iterator i=m_previoushashescontributed.begin(); i!=m_previoushashescontributed.end(); i++)
+	for(std::map<uint160,uint256>::const_iterator i=previoushashes.begin(); i!=previoushashes.end(); i++)
 	{
-		if(i!=m_previoushashescontributed.begin())
+		if(i!=previoushashes.begin())
 		{
 			saveval+="|";
 		}
@@ -876,9 +1873,9 @@ void BitcoinMinerRemoteServer::SaveContributedHashes()
 	walletdb.WriteSetting("rs_previoushashes",saveval);
 
 	saveval="";
-	for(std::map<uint160,uint256>::const_iterator i=m_currenthashescontributed.begin(); i!=m_currenthashescontributed.end(); i++)
+	for(std::map<uint160,uint256>::const_iterator i=currenthashes.begin(); i!=currenthashes.end(); i++)
 	{
-		if(i!=m_currenthashescontributed.begin())
+		if(i!=currenthashes.begin())
 		{
 			saveval+="|";
 		}
@@ -916,9 +1913,18 @@ const bool BitcoinMinerRemoteServer::StartListen(const std::string &bindaddr, co
 				#endif
 				if(::bind(sock,current->ai_addr,current->ai_addrlen)==0)
 				{
-					if(listen(sock,10)==0)
+					if(listen(sock,SOMAXCONN)==0)
 					{
 						m_listensockets.push_back(sock);
+#ifdef _BITCOIN_REMOTE_EPOLL_
+						// listen sockets are registered with a null pointer, clients with their connection
+						struct epoll_event ev;
+						memset(&ev,0,sizeof(ev));
+						ev.events=EPOLLIN|EPOLLET;
+						ev.data.ptr=0;
+						fcntl(sock,F_SETFL,fcntl(sock,F_GETFL,0)|O_NONBLOCK);
+						epoll_ctl(m_epollfd,EPOLL_CTL_ADD,sock,&ev);
+#endif
 					}
 					else
 					{
@@ -956,198 +1962,484 @@ void BitcoinMinerRemoteServer::SendServerHello(RemoteClientConnection *client, c
 	obj.push_back(json_spirit::Pair("type",static_cast<int>(RemoteMinerMessage::MESSAGE_TYPE_SERVERHELLO)));
 	obj.push_back(json_spirit::Pair("serverversion",BITCOINMINERREMOTE_SERVERVERSIONSTR));
 	obj.push_back(json_spirit::Pair("metahashrate",static_cast<int>(metahashrate)));
+	obj.push_back(json_spirit::Pair("protocolversion",client->GetProtocolVersion()));
 	obj.push_back(json_spirit::Pair("distributiontype",m_distributiontype));
+	obj.push_back(json_spirit::Pair("accounting",std::string(client->UsesShares() ? "shares" : "metahash")));
 	client->SendMessage(RemoteMinerMessage(obj));
 }
 
+void BitcoinMinerRemoteServer::SendMetaHashChallenge(RemoteClientConnection *client, const RemoteClientConnection::sentwork &work)
+{
+	RemoteClientConnection::metahashchallenge challenge;
+	RemoteMinerMessage::challengerecord record;
+	std::vector<unsigned char> recorddata;
+	unsigned int segmentcount=(work.m_metahashsize+work.m_segmentsize-1)/work.m_segmentsize;
+
+	challenge.m_workid=work.m_blockid;
+	challenge.m_mhindex=work.m_metahashes.size()-1;
+	challenge.m_startnonce=work.m_metahashes[challenge.m_mhindex].m_startnonce;
+	challenge.m_senttime=time(0);
+
+	// distinct segments picked at random, so the client can't know which ones it has to compute
+	while(challenge.m_segments.size()<(std::min)(static_cast<unsigned int>(m_metahashchallenges),segmentcount))
+	{
+		unsigned int segment=GetRand(segmentcount);
+		if(std::find(challenge.m_segments.begin(),challenge.m_segments.end(),segment)==challenge.m_segments.end())
+		{
+			challenge.m_segments.push_back(segment);
+		}
+	}
+
+	record.m_blockid=challenge.m_workid;
+	record.m_startnonce=challenge.m_startnonce;
+	record.m_segments=challenge.m_segments;
+	record.Write(recorddata);
+	client->SendMessage(RemoteMinerMessage(recorddata));
+	client->SetChallenge(challenge);
+}
+
 void BitcoinMinerRemoteServer::SendServerStatus()
 {
-	json_spirit::Object obj;
-	obj.push_back(json_spirit::Pair("type",static_cast<int>(RemoteMinerMessage::MESSAGE_TYPE_SERVERSTATUS)));
-	obj.push_back(json_spirit::Pair("time",static_cast<int64>(time(0))));
-	obj.push_back(json_spirit::Pair("clients",static_cast<int64>(m_clients.size())));
-	obj.push_back(json_spirit::Pair("khashmeta",static_cast<int64>(GetAllClientsCalculatedKHashFromMeta())));
-	obj.push_back(json_spirit::Pair("khashbest",static_cast<int64>(GetAllClientsCalculatedKHashFromBest())));
-	obj.push_back(json_spirit::Pair("sessionstartuptime",static_cast<int64>(m_startuptime)));
-	obj.push_back(json_spirit::Pair("sessionblocksgenerated",static_cast<int64>(m_generatedcount)));
 	for(std::vector<RemoteClientConnection *>::iterator i=m_clients.begin(); i!=m_clients.end(); i++)
 	{
-		json_spirit::Object messobj(obj);
-		messobj.push_back(json_spirit::Pair("yourkhashmeta",(*i)->GetCalculatedKHashRateFromMetaHash()));
-		messobj.push_back(json_spirit::Pair("yourkhashbest",(*i)->GetCalculatedKHashRateFromBestHash()));
-		(*i)->SendMessage(RemoteMinerMessage(messobj));
+		m_workers.AddJob((*i),RemoteMessageWorkers::job(RemoteMessageWorkers::JOB_STATUS));
 	}
 }
 
-void BitcoinMinerRemoteServer::SendWork(RemoteClientConnection *client)
+void BitcoinMinerRemoteServer::SendServerStatus(RemoteClientConnection *client)
 {
-	SCOPEDTIME("BitcoinMinerRemoteServer::SendWork");
-	const unsigned int SHA256InitState[8] ={0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
-	// we don't use CReserveKey for now because it removes the reservation when the key goes out of scope
-	CKey key;
-	key.MakeNewKey();
+	RemoteMinerMessage::statusrecord status;
+	status.m_time=time(0);
+	status.m_sessionstartuptime=m_startuptime;
+	CRITICAL_BLOCK(m_cs)
+	{
+		status.m_clients=m_allclients;
+		status.m_khashmeta=m_allkhashmeta;
+		status.m_khashbest=m_allkhashbest;
+		status.m_sessionblocksgenerated=m_generatedcount;
+	}
 
-	CBlockIndex* pindexPrev = pindexBest;
-	unsigned int nBits = GetNextWorkRequired(pindexPrev);
-	CTransaction txNew;
+	if(client->GetProtocolVersion()>=REMOTEMINER_PROTOCOL_VERSION)
+	{
+		std::vector<unsigned char> record;
+		status.m_yourkhashmeta=client->GetCalculatedKHashRateFromMetaHash();
+		status.m_yourkhashbest=client->GetCalculatedKHashRateFromBestHash();
+		status.Write(record);
+		client->SendMessage(RemoteMinerMessage(record));
+	}
+	else
+	{
+		json_spirit::Object obj;
+		obj.push_back(json_spirit::Pair("type",static_cast<int>(RemoteMinerMessage::MESSAGE_TYPE_SERVERSTATUS)));
+		obj.push_back(json_spirit::Pair("time",static_cast<int64>(status.m_time)));
+		obj.push_back(json_spirit::Pair("clients",static_cast<int64>(status.m_clients)));
+		obj.push_back(json_spirit::Pair("khashmeta",static_cast<int64>(status.m_khashmeta)));
+		obj.push_back(json_spirit::Pair("khashbest",static_cast<int64>(status.m_khashbest)));
+		obj.push_back(json_spirit::Pair("sessionstartuptime",static_cast<int64>(status.m_sessionstartuptime)));
+		obj.push_back(json_spirit::Pair("sessionblocksgenerated",static_cast<int64>(status.m_sessionblocksgenerated)));
+		obj.push_back(json_spirit::Pair("yourkhashmeta",client->GetCalculatedKHashRateFromMetaHash()));
+		obj.push_back(json_spirit::Pair("yourkhashbest",client->GetCalculatedKHashRateFromBestHash()));
+		client->SendMessage(RemoteMinerMessage(obj));
+	}
+}
 
-	txNew.vin.resize(1);
-	txNew.vin[0].prevout.SetNull();
-	txNew.vin[0].scriptSig << nBits << ++m_bnExtraNonce;
-	txNew.vout.resize(1);
-	txNew.vout[0].scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
-
-    //
-    // Create new block
-    //
-    CBlock *pblock=new CBlock();
-    if(!pblock)
-    {
-		return;
+// returns the newest published template, or publishes an empty one if the builder hasn't seen the new tip yet
+const boost::shared_ptr<const RemoteBlockTemplate> BitcoinMinerRemoteServer::GetBlockTemplate()
+{
+	SCOPEDTIME("BitcoinMinerRemoteServer::GetBlockTemplate");
+	boost::shared_ptr<const RemoteBlockTemplate> current;
+	CRITICAL_BLOCK(m_cstemplate)
+	{
+		current=m_blocktemplate;
+	}
+	if(current && current->m_indexprev==pindexBest)
+	{
+		return current;
+	}
+
+	boost::shared_ptr<RemoteBlockTemplate> blocktemplate(new RemoteBlockTemplate());
+	BuildBlockTemplate(*blocktemplate,false);
+	PublishBlockTemplate(blocktemplate);
+	return blocktemplate;
+}
+
+const bool BitcoinMinerRemoteServer::PublishBlockTemplate(const boost::shared_ptr<const RemoteBlockTemplate> &blocktemplate)
+{
+	bool published=false;
+	CRITICAL_BLOCK(m_cstemplate)
+	{
+		// a template built for a tip that has since been replaced is thrown away
+		if(blocktemplate->m_indexprev==pindexBest)
+		{
+			if(m_blocktemplate && m_blocktemplate->m_indexprev==blocktemplate->m_indexprev && m_blocktemplate->m_withtransactions==false && blocktemplate->m_withtransactions==true)
+			{
+				m_templatefilled=true;
+			}
+			m_blocktemplate=blocktemplate;
+			published=true;
+		}
+	}
+	return published;
+}
+
+const bool BitcoinMinerRemoteServer::TemplateFilled()
+{
+	bool filled=false;
+	CRITICAL_BLOCK(m_cstemplate)
+	{
+		filled=m_templatefilled;
+		m_templatefilled=false;
 	}
+	return filled;
+}
+
+void BitcoinMinerRemoteServer::BuildBlockTemplate(RemoteBlockTemplate &blocktemplate, const bool withtransactions)
+{
+	SCOPEDTIME("BitcoinMinerRemoteServer::BuildBlockTemplate");
+	blocktemplate.m_transactionsupdated=nTransactionsUpdated;
+	CBlockIndex* pindexPrev = pindexBest;
+	blocktemplate.m_indexprev=pindexPrev;
+	blocktemplate.m_bits=GetNextWorkRequired(pindexPrev);
+	blocktemplate.m_withtransactions=withtransactions;
 
-    // Add our coinbase tx as first transaction
-    pblock->vtx.push_back(txNew);
+	// an empty coinbase stands in for each client's own, it is never part of the coinbase branch
+	CBlock block;
+	block.vtx.push_back(CTransaction());
 
 	// Collect memory pool transactions into the block
 	int64 nFees = 0;
-	CRITICAL_BLOCK(cs_main)
-	CRITICAL_BLOCK(cs_mapTransactions)
-	{
-		CTxDB txdb("r");
-		map<uint256, CTxIndex> mapTestPool;
-		vector<char> vfAlreadyAdded(mapTransactions.size());
-		uint64 nBlockSize = 1000;
-		int nBlockSigOps = 100;
-		bool fFoundSomething = true;
-		while (fFoundSomething)
-		{
-			fFoundSomething = false;
-			unsigned int n = 0;
-			for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi, ++n)
-			{
-				if (vfAlreadyAdded[n])
-					continue;
-				CTransaction& tx = (*mi).second;
-				if (tx.IsCoinBase() || !tx.IsFinal())
-					continue;
-				unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK);
-				if (nBlockSize + nTxSize >= MAX_BLOCK_SIZE_GEN)
-					continue;
-				int nTxSigOps = tx.GetSigOpCount();
-				if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-					continue;
-
-				// Transaction fee based on block size
-				int64 nMinFee = tx.GetMinFee(nBlockSize);
-
-				map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-				if (!tx.ConnectInputs(txdb, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, nFees, false, true, nMinFee))
-					continue;
-				swap(mapTestPool, mapTestPoolTmp);
-
-				pblock->vtx.push_back(tx);
-				nBlockSize += nTxSize;
-				nBlockSigOps += nTxSigOps;
-				vfAlreadyAdded[n] = true;
-				fFoundSomething = true;
+	if(withtransactions)
+	{
+		CRITICAL_BLOCK(cs_main)
+		CRITICAL_BLOCK(cs_mapTransactions)
+		{
+			CTxDB txdb("r");
+			map<uint256, CTxIndex> mapTestPool;
+			vector<char> vfAlreadyAdded(mapTransactions.size());
+			uint64 nBlockSize = 1000;
+			int nBlockSigOps = 100;
+			bool fFoundSomething = true;
+			while (fFoundSomething)
+			{
+				fFoundSomething = false;
+				unsigned int n = 0;
+				for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi, ++n)
+				{
+					if (vfAlreadyAdded[n])
+						continue;
+					CTransaction& tx = (*mi).second;
+					if (tx.IsCoinBase() || !tx.IsFinal())
+						continue;
+					unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK);
+					if (nBlockSize + nTxSize >= MAX_BLOCK_SIZE_GEN)
+						continue;
+					int nTxSigOps = tx.GetSigOpCount();
+					if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+						continue;
+
+					// Transaction fee based on block size
+					int64 nMinFee = tx.GetMinFee(nBlockSize);
+
+					map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+					if (!tx.ConnectInputs(txdb, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, nFees, false, true, nMinFee))
+						continue;
+					swap(mapTestPool, mapTestPoolTmp);
+
+					block.vtx.push_back(tx);
+					nBlockSize += nTxSize;
+					nBlockSigOps += nTxSigOps;
+					vfAlreadyAdded[n] = true;
+					fFoundSomething = true;
+				}
 			}
 		}
 	}
-	pblock->nBits = nBits;
-	pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
+	blocktemplate.m_fees=nFees;
 
-	if(m_distributiontype=="connected")
+	block.BuildMerkleTree();
+	blocktemplate.m_merklebranch=block.GetMerkleBranch(0);
+	blocktemplate.m_vtx.assign(block.vtx.begin()+1,block.vtx.end());
+
+	// serialized once here, SendWork only adds the header and coinbase in front of it
+	boost::shared_ptr<std::string> tail(new std::string(""));
+	for(std::vector<CTransaction>::const_iterator i=blocktemplate.m_vtx.begin(); i!=blocktemplate.m_vtx.end(); i++)
 	{
-		AddDistributionFromConnected(pblock,pindexPrev,nFees);
+		json_spirit::Object txobj;
+		TxToJson((*i),txobj);
+		(*tail)+=",";
+		(*tail)+=json_spirit::write(txobj);
+		blocktemplate.m_size+=::GetSerializeSize((*i),SER_NETWORK);
 	}
-	else
+	json_spirit::Array mrkl;
+	for(std::vector<uint256>::const_iterator i=blocktemplate.m_merklebranch.begin(); i!=blocktemplate.m_merklebranch.end(); i++)
 	{
-		AddDistributionFromContributed(pblock,pindexPrev,nFees);
+		mrkl.push_back((*i).ToString().c_str());
 	}
+	(*tail)+="],\"mrkl_branch\":";
+	(*tail)+=json_spirit::write(mrkl);
+	(*tail)+="}";
+	blocktemplate.m_fullblocktail=tail;
 
-	printf("Sending block to remote client  nBits=%u\n",pblock->nBits);
-	pblock->print();
+	// compact blocks end the tx array after the coinbase and list the other transactions by id
+	json_spirit::Array txids;
+	for(std::vector<CTransaction>::const_iterator i=blocktemplate.m_vtx.begin(); i!=blocktemplate.m_vtx.end(); i++)
+	{
+		txids.push_back((*i).GetHash().ToString().c_str());
+	}
+	boost::shared_ptr<std::string> compacttail(new std::string("],\"txids\":"));
+	(*compacttail)+=json_spirit::write(txids);
+	(*compacttail)+=",\"mrkl_branch\":";
+	(*compacttail)+=json_spirit::write(mrkl);
+	(*compacttail)+="}";
+	blocktemplate.m_compactblocktail=compacttail;
 
-	unsigned int blocksize=::GetSerializeSize(*pblock, SER_NETWORK);
-	if(blocksize > MAX_BLOCK_SIZE)
+	if(withtransactions)
 	{
-		printf("ERROR - this block is too big to be accepted!\n");
+		printf("Built block template with %u transactions  nBits=%u\n",blocktemplate.m_vtx.size(),blocktemplate.m_bits);
 	}
-	else
+}
+
+void BitcoinMinerRemoteServer::StartTemplateBuilder()
+{
+	m_stoptemplatebuilder=false;
+	m_templatebuilderrunning=true;
+	if(!CreateThread(BitcoinMinerRemoteServer::ThreadTemplateBuilder,this))
 	{
-		printf("Serialized block is %u bytes\n",blocksize);
+		printf("Error: CreateThread(ThreadTemplateBuilder) failed\n");
+		m_templatebuilderrunning=false;
 	}
+}
 
-	//
-	// Prebuild hash buffer
-	//
-	struct tmpworkspace
+void BitcoinMinerRemoteServer::StopTemplateBuilder()
+{
+	m_stoptemplatebuilder=true;
+	while(m_templatebuilderrunning)
 	{
-		struct unnamed2
+		Sleep(10);
+	}
+}
+
+/*
+	Keeps a template for the current tip ready so SendWork never has to
+	collect the memory pool itself.  A new tip gets an empty template first,
+	so clients can be moved to it before the memory pool has been scanned.
+*/
+void BitcoinMinerRemoteServer::ThreadTemplateBuilder(void *arg)
+{
+	BitcoinMinerRemoteServer *serv=(BitcoinMinerRemoteServer *)arg;
+
+	SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+
+	while(serv->m_stoptemplatebuilder==false && !fShutdown)
+	{
+		boost::shared_ptr<const RemoteBlockTemplate> current;
+		CRITICAL_BLOCK(serv->m_cstemplate)
 		{
-			int nVersion;
-			uint256 hashPrevBlock;
-			uint256 hashMerkleRoot;
-			unsigned int nTime;
-			unsigned int nBits;
-			unsigned int nNonce;
+			current=serv->m_blocktemplate;
 		}
-		block;
-		unsigned char pchPadding0[64];
-		uint256 hash1;
-		unsigned char pchPadding1[64];
-	};
-	char tmpbuf[sizeof(tmpworkspace)+64];
-	tmpworkspace& tmp = *(tmpworkspace*)alignup<16>(tmpbuf);
 
-	tmp.block.nVersion       = pblock->nVersion;
-	tmp.block.hashPrevBlock  = pblock->hashPrevBlock  = (pindexPrev ? pindexPrev->GetBlockHash() : 0);
-	tmp.block.hashMerkleRoot = pblock->hashMerkleRoot = pblock->BuildMerkleTree();
-	tmp.block.nTime          = pblock->nTime          = max((pindexPrev ? pindexPrev->GetMedianTimePast()+1 : 0), GetAdjustedTime());
-	tmp.block.nBits          = pblock->nBits          = nBits;
-	tmp.block.nNonce         = pblock->nNonce         = 0;
+		if(!current || current->m_indexprev!=pindexBest)
+		{
+			boost::shared_ptr<RemoteBlockTemplate> emptytemplate(new RemoteBlockTemplate());
+			BuildBlockTemplate(*emptytemplate,false);
+			serv->PublishBlockTemplate(emptytemplate);
+			current=emptytemplate;
+		}
+
+		if(current->m_withtransactions==false || current->IsCurrent()==false)
+		{
+			boost::shared_ptr<RemoteBlockTemplate> fulltemplate(new RemoteBlockTemplate());
+			BuildBlockTemplate(*fulltemplate,true);
+			serv->PublishBlockTemplate(fulltemplate);
+		}
+		else
+		{
+			Sleep(100);
+		}
+	}
+
+	serv->m_templatebuilderrunning=false;
+}
 
-	unsigned int nBlocks0 = FormatHashBlocks(&tmp.block, sizeof(tmp.block));
-	unsigned int nBlocks1 = FormatHashBlocks(&tmp.hash1, sizeof(tmp.hash1));
+void BitcoinMinerRemoteServer::CreateCoinbase(const RemoteBlockTemplate &blocktemplate, const CKey &key, const unsigned int extrabytes, CTransaction &coinbase)
+{
+	CBlockIndex* pindexPrev = blocktemplate.m_indexprev;
+	CBigNum extranonce;
 
-	// Byte swap all the input buffer
-	for (int i = 0; i < sizeof(tmp)/4; i++)
-		((unsigned int*)&tmp)[i] = CryptoPP::ByteReverse(((unsigned int*)&tmp)[i]);
+	CRITICAL_BLOCK(m_cs)
+	{
+		extranonce=++m_bnExtraNonce;
+	}
 
-	// Precalc the first half of the first hash, which stays constant
-	uint256 midstatebuf[2];
-	uint256& midstate = *alignup<16>(midstatebuf);
-	SHA256Transform(&midstate, &tmp.block, SHA256InitState);
+	coinbase.vin.resize(1);
+	coinbase.vin[0].prevout.SetNull();
+	coinbase.vin[0].scriptSig << blocktemplate.m_bits << extranonce;
+	if(extrabytes>0)
+	{
+		coinbase.vin[0].scriptSig << std::vector<unsigned char>(extrabytes,0);
+	}
+	coinbase.vout.resize(1);
+	coinbase.vout[0].scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+	coinbase.vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, blocktemplate.m_fees);
+
+	if(m_distributiontype=="connected")
+	{
+		AddDistributionFromConnected(coinbase,pindexPrev,blocktemplate.m_fees);
+	}
+	else
+	{
+		AddDistributionFromContributed(coinbase,pindexPrev,blocktemplate.m_fees);
+	}
+}
+
+void BitcoinMinerRemoteServer::SendWork(RemoteClientConnection *client)
+{
+	SCOPEDTIME("BitcoinMinerRemoteServer::SendWork");
+	// we don't use CReserveKey for now because it removes the reservation when the key goes out of scope
+	CKey key;
+	key.MakeNewKey();
+
+	// the transactions are shared with every other client working on the same tip
+	boost::shared_ptr<const RemoteBlockTemplate> blocktemplate=GetBlockTemplate();
+	CBlockIndex* pindexPrev = blocktemplate->m_indexprev;
+	unsigned int nBits = blocktemplate->m_bits;
+	CTransaction txNew;
+
+	// room for the extranonce the client rolls itself
+	CreateCoinbase(*blocktemplate,key,(client->RollsExtraNonce() ? 4 : 0),txNew);
+
+	// only the header and coinbase are kept for this client
+	CBlock block;
+	CBlock *pblock=&block;
+	pblock->vtx.push_back(txNew);
+	pblock->nBits = nBits;
+
+	printf("Sending block to remote client  nBits=%u\n",pblock->nBits);
+	txNew.print();
+
+	unsigned int blocksize=::GetSerializeSize(*pblock, SER_NETWORK)+blocktemplate->m_size;
+	if(blocksize > MAX_BLOCK_SIZE)
+	{
+		printf("ERROR - this block is too big to be accepted!\n");
+	}
+	else
+	{
+		printf("Serialized block is %u bytes\n",blocksize);
+	}
+
+	pblock->hashPrevBlock  = (pindexPrev ? pindexPrev->GetBlockHash() : 0);
+	pblock->hashMerkleRoot = blocktemplate->GetMerkleRoot(txNew);
+	pblock->nTime          = max((pindexPrev ? pindexPrev->GetMedianTimePast()+1 : 0), GetAdjustedTime());
+	pblock->nNonce         = 0;
 
 	uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
 
 	// create and send the message to the client
-	std::string blockstr("");
-	std::string midstatestr("");
-	std::string targetstr(hashTarget.GetHex());
+	std::vector<unsigned char> blockbuff;
+	std::vector<unsigned char> midbuff;
+	RemoteBlockTemplate::FormatWork(*pblock,blockbuff,midbuff);
 
-	std::vector<unsigned char> blockbuff(64,0);
-	::memcpy(&blockbuff[0],((char *)&tmp.block)+64,64);
-	std::vector<unsigned char> midbuff(32,0);
-	::memcpy(&midbuff[0],(char *)&midstate,32);
+	// send complete block with transactions so client can verify
+	// only the part up to the coinbase is made for this client, the rest is the template's and shared with every other client
+	std::string fullblockhead=FullBlockHead(pblock,*blocktemplate);
+	const boost::shared_ptr<const std::string> &fullblocktail=(client->UsesCompactBlock() ? blocktemplate->m_compactblocktail : blocktemplate->m_fullblocktail);
+	const std::string::size_type fullblocksize=fullblockhead.size()+fullblocktail->size();
+	std::vector<char> wiredata;
+	std::vector<boost::shared_ptr<const std::string> > fragments;
+
+	// clients that take the metahash size from each work get one sized for their hash rate
+	unsigned int metahashsize=BITCOINMINERREMOTE_HASHESPERMETA;
+	if(client->GetProtocolVersion()>=REMOTEMINER_PROTOCOL_VERSION)
+	{
+		client->AdjustMetaHashSize(m_metahashinterval);
+		metahashsize=client->GetMetaHashSize();
+	}
+
+	unsigned int segmentsize=0;
+	if(client->UsesMetaHashTree())
+	{
+		segmentsize=(metahashsize+BITCOINMINERREMOTE_SEGMENTSPERMETA-1)/BITCOINMINERREMOTE_SEGMENTSPERMETA;
+	}
+
+	// the share target is set so the client finds about BITCOINMINERREMOTE_SHARESPERMETA shares per metahash it would have sent
+	uint256 sharetarget=0;
+	int64 sharehashes=0;
+	if(client->UsesShares())
+	{
+		sharehashes=(std::max)(static_cast<int64>(metahashsize/BITCOINMINERREMOTE_SHARESPERMETA),static_cast<int64>(BITCOINMINERREMOTE_MINHASHESPERSHARE));
+		CBigNum bnsharetarget=CBigNum(~uint256(0))/CBigNum(sharehashes);
+		sharetarget=bnsharetarget.getuint256();
+	}
+
+	if(client->GetProtocolVersion()>=REMOTEMINER_PROTOCOL_VERSION)
+	{
+		RemoteMinerMessage::workrecord work;
+		std::vector<unsigned char> record;
+		work.m_blockid=client->NextBlockID();
+		::memcpy(work.m_block,&blockbuff[0],64);
+		::memcpy(work.m_midstate,&midbuff[0],32);
+		::memcpy(work.m_target,hashTarget.begin(),32);
+		work.m_metahashsize=metahashsize;
+		::memcpy(work.m_sharetarget,sharetarget.begin(),32);
+		work.m_segmentsize=segmentsize;
+		work.m_ntimewindow=m_ntimewindow;
+		work.WriteFixed(record,fullblocksize);
+		RemoteMinerMessage::PushWireHeader(wiredata,record.size()+fullblocksize,true,client->GetProtocolVersion());
+		wiredata.insert(wiredata.end(),record.begin(),record.end());
+		wiredata.insert(wiredata.end(),fullblockhead.begin(),fullblockhead.end());
+		fragments.push_back(boost::shared_ptr<const std::string>(new std::string(wiredata.begin(),wiredata.end())));
+		fragments.push_back(fullblocktail);
+		client->SendFragments(fragments);
+
+		if(client->RollsExtraNonce())
+		{
+			RemoteMinerMessage::extranoncerecord en;
+			en.m_blockid=work.m_blockid;
 
-	EncodeBase64(blockbuff,blockstr);
-	EncodeBase64(midbuff,midstatestr);
+			CDataStream ssheader(SER_NETWORK|SER_BLOCKHEADERONLY);
+			ssheader << *pblock;
+			ssheader.read((char *)en.m_header,80);
 
-	json_spirit::Object obj;
-	obj.push_back(json_spirit::Pair("blockid",client->NextBlockID()));
-	obj.push_back(json_spirit::Pair("type",RemoteMinerMessage::MESSAGE_TYPE_SERVERSENDWORK));
-	obj.push_back(json_spirit::Pair("block",blockstr));
-	obj.push_back(json_spirit::Pair("midstate",midstatestr));
-	obj.push_back(json_spirit::Pair("target",targetstr));
+			// the extranonce is the last 4 bytes of the scriptSig of the only input
+			RemoteBlockTemplate::SplitCoinbase(txNew,4,en.m_coinbase1,en.m_coinbase2);
 
-	// send complete block with transactions so client can verify
-	json_spirit::Object fullblock;
-	BlockToJson(pblock,fullblock);
-	obj.push_back(json_spirit::Pair("fullblock",fullblock));
+			for(std::vector<uint256>::const_iterator i=blocktemplate->m_merklebranch.begin(); i!=blocktemplate->m_merklebranch.end(); i++)
+			{
+				en.m_merklebranch.insert(en.m_merklebranch.end(),(const unsigned char *)&(*i),((const unsigned char *)&(*i))+32);
+			}
 
-	client->SendMessage(RemoteMinerMessage(obj));
+			en.Write(record);
+			client->SendMessage(RemoteMinerMessage(record));
+		}
+	}
+	else
+	{
+		std::string blockstr("");
+		std::string midstatestr("");
+		std::string targetstr(hashTarget.GetHex());
+
+		EncodeBase64(blockbuff,blockstr);
+		EncodeBase64(midbuff,midstatestr);
+
+		json_spirit::Object obj;
+		obj.push_back(json_spirit::Pair("blockid",client->NextBlockID()));
+		obj.push_back(json_spirit::Pair("type",RemoteMinerMessage::MESSAGE_TYPE_SERVERSENDWORK));
+		obj.push_back(json_spirit::Pair("block",blockstr));
+		obj.push_back(json_spirit::Pair("midstate",midstatestr));
+		obj.push_back(json_spirit::Pair("target",targetstr));
+
+		// fullblock is the last member, so the object is reopened for it and closed after the template's part
+		std::string jsonstr=json_spirit::write(obj);
+		jsonstr.erase(jsonstr.size()-1);
+		jsonstr+=",\"fullblock\":";
+		RemoteMinerMessage::PushWireHeader(wiredata,jsonstr.size()+fullblocksize+1,false,client->GetProtocolVersion());
+		wiredata.insert(wiredata.end(),jsonstr.begin(),jsonstr.end());
+		wiredata.insert(wiredata.end(),fullblockhead.begin(),fullblockhead.end());
+		fragments.push_back(boost::shared_ptr<const std::string>(new std::string(wiredata.begin(),wiredata.end())));
+		fragments.push_back(fullblocktail);
+		fragments.push_back(boost::shared_ptr<const std::string>(new std::string("}")));
+		client->SendFragments(fragments);
+	}
 
 	// save this block with the client connection so we can verify the metahashes generated by the client
 	RemoteClientConnection::sentwork sw;
@@ -1156,10 +2448,23 @@ void BitcoinMinerRemoteServer::SendWork(RemoteClientConnection *client)
 	sw.m_block=blockbuff;
 	sw.m_midstate=midbuff;
 	sw.m_target=hashTarget;
+	sw.m_metahashsize=metahashsize;
+	sw.m_segmentsize=segmentsize;
+	sw.m_sharetarget=sharetarget;
+	sw.m_sharehashes=sharehashes;
 	sw.m_senttime=time(0);
-	sw.m_pblock=pblock;
+	sw.m_template=blocktemplate;
+	sw.m_coinbase=txNew;
+	if(client->RollsExtraNonce())
+	{
+		sw.m_merklebranch=blocktemplate->m_merklebranch;
+	}
+	sw.m_time=pblock->nTime;
+	sw.m_bits=pblock->nBits;
 	sw.m_indexprev=pindexPrev;
-	client->GetSentWork().push_back(sw);
+	sw.m_rollsextranonce=client->RollsExtraNonce();
+	sw.m_ntimewindow=(client->GetProtocolVersion()>=REMOTEMINER_PROTOCOL_VERSION ? m_ntimewindow : 0);
+	client->AddSentWork(sw);
 
 	// clear out old work sent to client (sent 15 minutes or older)
 	client->ClearOldSentWork(900);
@@ -1167,15 +2472,191 @@ void BitcoinMinerRemoteServer::SendWork(RemoteClientConnection *client)
 	client->NextBlockID()++;
 }
 
+// answers a compact block client that wants every transaction of work it was sent
+void BitcoinMinerRemoteServer::SendFullBlock(RemoteClientConnection *client, const int64 blockid)
+{
+	SCOPEDTIME("BitcoinMinerRemoteServer::SendFullBlock");
+	RemoteClientConnection::sentwork *work;
+	if(client->GetSentWorkByID(blockid,&work)==false || !work->m_template)
+	{
+		printf("Client %s asked for the full block of unknown work %"PRI64d"\n",client->GetAddress().c_str(),blockid);
+		return;
+	}
+
+	// only the header and coinbase are needed for the head, the transactions come from the template's tail
+	CBlock block;
+	block.vtx.push_back(work->m_coinbase);
+	block.hashPrevBlock=(work->m_template->m_indexprev ? work->m_template->m_indexprev->GetBlockHash() : 0);
+	block.hashMerkleRoot=work->m_template->GetMerkleRoot(work->m_coinbase);
+	block.nTime=work->m_time;
+	block.nBits=work->m_template->m_bits;
+	block.nNonce=0;
+
+	std::string fullblockhead=FullBlockHead(&block,*work->m_template);
+	json_spirit::Object obj;
+	obj.push_back(json_spirit::Pair("type",RemoteMinerMessage::MESSAGE_TYPE_SERVERFULLBLOCK));
+	obj.push_back(json_spirit::Pair("blockid",static_cast<boost::int64_t>(blockid)));
+
+	std::string jsonstr=json_spirit::write(obj);
+	jsonstr.erase(jsonstr.size()-1);
+	jsonstr+=",\"fullblock\":";
+	jsonstr+=fullblockhead;
+
+	std::vector<char> wiredata;
+	std::vector<boost::shared_ptr<const std::string> > fragments;
+	RemoteMinerMessage::PushWireHeader(wiredata,jsonstr.size()+work->m_template->m_fullblocktail->size()+1,false,client->GetProtocolVersion());
+	wiredata.insert(wiredata.end(),jsonstr.begin(),jsonstr.end());
+	fragments.push_back(boost::shared_ptr<const std::string>(new std::string(wiredata.begin(),wiredata.end())));
+	fragments.push_back(work->m_template->m_fullblocktail);
+	fragments.push_back(boost::shared_ptr<const std::string>(new std::string("}")));
+	client->SendFragments(fragments);
+}
+
+// the work itself is made by the message workers
 void BitcoinMinerRemoteServer::SendWorkToAllClients()
 {
 	SCOPEDTIME("BitcoinMinerRemoteServer::SendWorkToAllClients");
+	CRITICAL_BLOCK(m_cs)
+	{
+		m_sendworktoall=false;
+	}
+	for(std::vector<RemoteClientConnection *>::iterator i=m_clients.begin(); i!=m_clients.end(); i++)
+	{
+		m_workers.AddJob((*i),RemoteMessageWorkers::job(RemoteMessageWorkers::JOB_SENDWORK));
+	}
+}
+
+// returns true if the tip changed and new work was queued for every client
+const bool BitcoinMinerRemoteServer::CheckTipChanged()
+{
+	SCOPEDTIME("BitcoinMinerRemoteServer::CheckTipChanged");
+	const unsigned int tipchanges=GetRemoteTipChanges();
+	if(m_lasttipchanges==tipchanges)
+	{
+		return false;
+	}
+	m_lasttipchanges=tipchanges;
+
+	CRITICAL_BLOCK(m_cs)
+	{
+		m_totalmetahashcount+=m_metahashcount;
+		m_totalstalemetahashcount+=m_stalemetahashcount;
+		printf("Tip changed, %"PRI64d" of %"PRI64d" metahashes since the last tip were stale (%"PRI64d" of %"PRI64d" this session)\n",m_stalemetahashcount,m_metahashcount,m_totalstalemetahashcount,m_totalmetahashcount);
+		m_metahashcount=0;
+		m_stalemetahashcount=0;
+		m_sendworktoall=false;
+	}
+
 	for(std::vector<RemoteClientConnection *>::iterator i=m_clients.begin(); i!=m_clients.end(); i++)
 	{
-		SendWork((*i));
+		m_workers.AddJob((*i),RemoteMessageWorkers::job(RemoteMessageWorkers::JOB_NEWTIP));
+	}
+	return true;
+}
+
+const bool BitcoinMinerRemoteServer::AcceptClient(const SOCKET listensocket)
+{
+	SOCKET newsock;
+	struct sockaddr_storage addr;
+	socklen_t addrlen=sizeof(addr);
+	newsock=accept(listensocket,(struct sockaddr *)&addr,&addrlen);
+	if(newsock!=INVALID_SOCKET)
+	{
+		RemoteClientConnection *newclient=new RemoteClientConnection(newsock,addr,addrlen);
+		if(m_banned.find(newclient->GetAddress(false))!=m_banned.end())
+		{
+			printf("Banned client %s connected.  Disconnecting.\n",newclient->GetAddress().c_str());
+			newclient->Disconnect();
+			delete newclient;
+		}
+#ifdef _BITCOIN_REMOTE_EPOLL_
+		else if(newclient->AddToEpoll(m_epollfd)==false)
+		{
+			printf("Couldn't add remote client %s to epoll.  Disconnecting.\n",newclient->GetAddress().c_str());
+			newclient->Disconnect();
+			delete newclient;
+		}
+#endif
+		else
+		{
+			m_clients.push_back(newclient);
+			printf("Remote client %s connected\n",newclient->GetAddress().c_str());
+		}
+		return true;
+	}
+	return false;
+}
+
+#ifdef _BITCOIN_REMOTE_EPOLL_
+
+const bool BitcoinMinerRemoteServer::Step()
+{
+	SCOPEDTIME("BitcoinMinerRemoteServer::Step");
+
+	int rval=epoll_wait(m_epollfd,&m_epollevents[0],m_epollevents.size(),1);
+
+	for(int e=0; e<rval; e++)
+	{
+		RemoteClientConnection *client=(RemoteClientConnection *)m_epollevents[e].data.ptr;
+		if(client==0)
+		{
+			// edge-triggered, so accept everything that is waiting
+			for(std::vector<SOCKET>::iterator listeni=m_listensockets.begin(); listeni!=m_listensockets.end(); listeni++)
+			{
+				while(AcceptClient((*listeni)))
+				{
+				}
+			}
+		}
+		else
+		{
+			// a client disconnected earlier in this loop is still allocated until the cleanup below
+			if(client->IsConnected() && (m_epollevents[e].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR)))
+			{
+				client->SocketReceive();
+			}
+			if(client->IsConnected() && (m_epollevents[e].events & EPOLLOUT))
+			{
+				client->SocketSend();
+			}
+		}
+	}
+
+	// grow the event array when it was filled, so a busy server picks up every ready socket each step
+	if(rval==(int)m_epollevents.size())
+	{
+		m_epollevents.resize(m_epollevents.size()*2);
+	}
+
+	// remove any disconnected clients, or clients with too much data in the receive buffer, once the workers are done with them
+	for(std::vector<RemoteClientConnection *>::iterator i=m_clients.begin(); i!=m_clients.end(); )
+	{
+		if((*i)->DisconnectRequested() || (*i)->ReceiveBufferSize()>(1024*1024))
+		{
+			if((*i)->IsConnected())
+			{
+				(*i)->Disconnect();
+			}
+		}
+		if((*i)->IsConnected()==false && m_workers.Release((*i)))
+		{
+			printf("Remote client %s disconnected\n",(*i)->GetAddress().c_str());
+			m_clientkhash.erase((*i)->GetID());
+			delete (*i);
+			i=m_clients.erase(i);
+		}
+		else
+		{
+			i++;
+		}
 	}
+
+	return true;
+
 }
 
+#else
+
 const bool BitcoinMinerRemoteServer::Step()
 {
 	SCOPEDTIME("BitcoinMinerRemoteServer::Step");
@@ -1214,25 +2695,7 @@ const bool BitcoinMinerRemoteServer::Step()
 		{
 			if(FD_ISSET((*listeni),&readfs))
 			{
-				SOCKET newsock;
-				struct sockaddr_storage addr;
-				socklen_t addrlen=sizeof(addr);
-				newsock=accept((*listeni),(struct sockaddr *)&addr,&addrlen);
-				if(newsock!=INVALID_SOCKET)
-				{
-					RemoteClientConnection *newclient=new RemoteClientConnection(newsock,addr,addrlen);
-					if(m_banned.find(newclient->GetAddress(false))!=m_banned.end())
-					{
-						printf("Banned client %s connected.  Disconnecting.\n",newclient->GetAddress().c_str());
-						newclient->Disconnect();
-						delete newclient;
-					}
-					else
-					{
-						m_clients.push_back(newclient);
-						printf("Remote client %s connected\n",newclient->GetAddress().c_str());
-					}
-				}
+				AcceptClient((*listeni));
 			}
 		}
 	}
@@ -1276,12 +2739,20 @@ const bool BitcoinMinerRemoteServer::Step()
 		}
 	}
 
-	// remove any disconnected clients, or clients with too much data in the receive buffer
+	// remove any disconnected clients, or clients with too much data in the receive buffer, once the workers are done with them
 	for(std::vector<RemoteClientConnection *>::iterator i=m_clients.begin(); i!=m_clients.end(); )
 	{
-		if((*i)->IsConnected()==false || (*i)->ReceiveBufferSize()>(1024*1024))
+		if((*i)->DisconnectRequested() || (*i)->ReceiveBufferSize()>(1024*1024))
+		{
+			if((*i)->IsConnected())
+			{
+				(*i)->Disconnect();
+			}
+		}
+		if((*i)->IsConnected()==false && m_workers.Release((*i)))
 		{
 			printf("Remote client %s disconnected\n",(*i)->GetAddress().c_str());
+			m_clientkhash.erase((*i)->GetID());
 			delete (*i);
 			i=m_clients.erase(i);
 		}
@@ -1295,9 +2766,11 @@ const bool BitcoinMinerRemoteServer::Step()
 
 }
 
-const bool VerifyBestHash(const RemoteClientConnection::sentwork &work, const uint256 &besthash, const unsigned int besthashnonce)
+#endif	// _BITCOIN_REMOTE_EPOLL_
+
+const uint256 HashSentWork(const RemoteClientConnection::sentwork &work, const unsigned int hashnonce)
 {
-	SCOPEDTIME("VerifyBestHash");
+	SCOPEDTIME("HashSentWork");
 	const unsigned int SHA256InitState[8] ={0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
 	
 	uint256 tempbuff[4];
@@ -1327,7 +2800,7 @@ const bool VerifyBestHash(const RemoteClientConnection::sentwork &work, const ui
 	::memcpy(blockbuffptr,&(work.m_block[0]),work.m_block.size());
 	::memcpy(midbuffptr,&(work.m_midstate[0]),work.m_midstate.size());
 
-	(*nonce)=besthashnonce;
+	(*nonce)=hashnonce;
 
 	SHA256Transform(&temphash,blockbuffptr,midbuffptr);
 	SHA256Transform(&hash,&temphash,SHA256InitState);
@@ -1337,7 +2810,12 @@ const bool VerifyBestHash(const RemoteClientConnection::sentwork &work, const ui
 		((unsigned int*)&hash)[i] = CryptoPP::ByteReverse(((unsigned int*)&hash)[i]);
 	}
 
-	return (hash==besthash);
+	return hash;
+}
+
+const bool VerifyBestHash(const RemoteClientConnection::sentwork &work, const uint256 &besthash, const unsigned int besthashnonce)
+{
+	return (HashSentWork(work,besthashnonce)==besthash);
 }
 
 const bool VerifyFoundHash(RemoteClientConnection *client, const int64 blockid, const std::vector<unsigned char> &block, const unsigned int foundnonce, bool &accepted)
@@ -1387,8 +2865,12 @@ const bool VerifyFoundHash(RemoteClientConnection *client, const int64 blockid,
 	if(foundwork==true)
 	{
 		
-		if(work->m_pblock)
+		if(work->m_template)
 		{
+			CBlock block;
+			work->m_template->GetBlock(work->m_coinbase,block);
+			block.nTime=work->m_time;
+
 			::memset(blockbuffptr,0,64);
 			::memset(midbuffptr,0,32);
 			::memcpy(blockbuffptr,&work->m_block[0],work->m_block.size());
@@ -1404,9 +2886,9 @@ const bool VerifyFoundHash(RemoteClientConnection *client, const int64 blockid,
 				((unsigned int*)&hash)[i] = CryptoPP::ByteReverse(((unsigned int*)&hash)[i]);
 			}
 
-			work->m_pblock->nNonce=CryptoPP::ByteReverse(foundnonce);
+			block.nNonce=CryptoPP::ByteReverse(foundnonce);
 
-			if(hash==work->m_pblock->GetHash() && hash<=work->m_target)
+			if(hash==block.GetHash() && hash<=work->m_target)
 			{
                 CRITICAL_BLOCK(cs_main)
                 {
@@ -1417,10 +2899,10 @@ const bool VerifyFoundHash(RemoteClientConnection *client, const int64 blockid,
 
                         // Track how many getdata requests this block gets
                         CRITICAL_BLOCK(cs_mapRequestCount)
-                            mapRequestCount[work->m_pblock->GetHash()] = 0;
+                            mapRequestCount[block.GetHash()] = 0;
 
                         // Process this block the same as if we had received it from another node
-                        if (!ProcessBlock(NULL, work->m_pblock))
+                        if (!ProcessBlock(NULL, &block))
 						{
                             printf("ERROR in VerifyFoundHash, ProcessBlock, block not accepted\n");
 						}
@@ -1429,8 +2911,8 @@ const bool VerifyFoundHash(RemoteClientConnection *client, const int64 blockid,
 							accepted=true;
 						}
                     	
-						// pblock is deleted by ProcessBlock, so we need to zero the pointer in work so it won't be deleted twice
-						work->m_pblock=0;
+						// the block can only be submitted once
+						work->m_template.reset();
 
                     }
                 }
@@ -1447,6 +2929,404 @@ const bool VerifyFoundHash(RemoteClientConnection *client, const int64 blockid,
 	return false;
 }
 
+void BitcoinMinerRemoteServer::HandleJob(RemoteClientConnection *client, const RemoteMessageWorkers::job &j)
+{
+	CRITICAL_BLOCK(client->GetCS())
+	{
+		// jobs that were queued before the client went away are dropped
+		if(client->DisconnectRequested())
+		{
+		}
+		else if(j.m_type==RemoteMessageWorkers::JOB_MESSAGE)
+		{
+			HandleMessage(client,j.m_message);
+		}
+		else if(j.m_type==RemoteMessageWorkers::JOB_SENDWORK)
+		{
+			SendWork(client);
+		}
+		else if(j.m_type==RemoteMessageWorkers::JOB_NEWTIP)
+		{
+			client->InvalidateSentWork(pindexBest);
+			SendWork(client);
+		}
+		else if(j.m_type==RemoteMessageWorkers::JOB_VERIFIED)
+		{
+			MetaHashVerified(client,j.m_workid,j.m_mhindex,j.m_verified);
+		}
+		else if(j.m_type==RemoteMessageWorkers::JOB_TICK)
+		{
+			// a challenge that isn't answered within a minute counts as a failed verification
+			if(client->HasChallenge() && difftime(time(0),client->GetChallenge().m_senttime)>=60)
+			{
+				const RemoteClientConnection::metahashchallenge challenge=client->GetChallenge();
+				printf("Client %s didn't answer metahash challenge\n",client->GetAddress().c_str());
+				client->ClearChallenge();
+				MetaHashVerified(client,challenge.m_workid,challenge.m_mhindex,false);
+			}
+
+			// send new block every 2 minutes
+			if(client->HasSentWork() && difftime(time(0),client->GetLastSentWorkTime())>=120)
+			{
+				SendWork(client);
+			}
+		}
+		else if(j.m_type==RemoteMessageWorkers::JOB_STATUS)
+		{
+			SendServerStatus(client);
+		}
+	}
+}
+
+void BitcoinMinerRemoteServer::HandleMessage(RemoteClientConnection *client, const RemoteMinerMessage &message)
+{
+	SCOPEDTIME("BitcoinMinerRemoteServer::HandleMessage");
+	int type=RemoteMinerMessage::MESSAGE_TYPE_NONE;
+	bool blockaccepted=false;
+
+	message.GetType(type);
+
+	if(message.IsBinary() && type!=RemoteMinerMessage::MESSAGE_TYPE_CLIENTMETAHASH && type!=RemoteMinerMessage::MESSAGE_TYPE_CLIENTFOUNDHASH && type!=RemoteMinerMessage::MESSAGE_TYPE_CLIENTSHARE && type!=RemoteMinerMessage::MESSAGE_TYPE_CLIENTPROOF)
+	{
+		printf("Client %s sent binary message of type %d.  Disconnecting.\n",client->GetAddress().c_str(),type);
+		client->RequestDisconnect();
+	}
+	else if(client->GotClientHello()==false && type!=RemoteMinerMessage::MESSAGE_TYPE_CLIENTHELLO)
+	{
+		printf("Client sent first message other than clienthello\n");
+		client->RequestDisconnect();
+	}
+	else if(client->GotClientHello()==false && type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTHELLO)
+	{
+
+		json_spirit::Value pval=json_spirit::find_value(message.GetValue().get_obj(),"address");
+		if(pval.type()==json_spirit::str_type)
+		{
+			uint160 address;
+			address.SetHex(pval.get_str());
+			client->SetRequestedRecipientAddress(address);
+		}
+
+		// clients that can use the binary records say so in their hello
+		pval=json_spirit::find_value(message.GetValue().get_obj(),"protocolversion");
+		if(pval.type()==json_spirit::int_type && pval.get_int()>=REMOTEMINER_PROTOCOL_VERSION)
+		{
+			client->SetProtocolVersion(REMOTEMINER_PROTOCOL_VERSION);
+		}
+
+		// shares are sent as binary records, so only version 3 clients that can report them get share accounting
+		pval=json_spirit::find_value(message.GetValue().get_obj(),"shares");
+		if(ShareAccounting() && client->GetProtocolVersion()>=REMOTEMINER_PROTOCOL_VERSION && pval.type()==json_spirit::bool_type && pval.get_bool()==true)
+		{
+			client->SetUsesShares(true);
+		}
+
+		// metahash trees are only used when the server challenges segments of them
+		pval=json_spirit::find_value(message.GetValue().get_obj(),"metahashtree");
+		if(GetMetaHashChallenges()>0 && client->GetProtocolVersion()>=REMOTEMINER_PROTOCOL_VERSION && pval.type()==json_spirit::bool_type && pval.get_bool()==true)
+		{
+			client->SetUsesMetaHashTree(true);
+		}
+
+		// compact block clients get transaction ids in the fullblock and ask for the rest when they want it
+		pval=json_spirit::find_value(message.GetValue().get_obj(),"compactblock");
+		if(pval.type()==json_spirit::bool_type && pval.get_bool()==true)
+		{
+			client->SetUsesCompactBlock(true);
+		}
+
+		// the extranonce is sent in a binary record, so only version 3 clients can roll it
+		pval=json_spirit::find_value(message.GetValue().get_obj(),"extranonce");
+		if(client->GetProtocolVersion()>=REMOTEMINER_PROTOCOL_VERSION && pval.type()==json_spirit::bool_type && pval.get_bool()==true)
+		{
+			client->SetRollsExtraNonce(true);
+		}
+
+		pval=json_spirit::find_value(message.GetValue().get_obj(),"password");
+		if(pval.type()==json_spirit::str_type && pval.get_str()==m_password)
+		{
+			printf("Got clienthello from client %s\n",client->GetAddress().c_str());
+			client->SetGotClientHello(true);
+			SendServerHello(client,BITCOINMINERREMOTE_HASHESPERMETA);
+			// also send work right away
+			SendWork(client);
+		}
+		else
+		{
+			printf("Client %s didn't send correct password.  Disconnecting.\n",client->GetAddress().c_str());
+			client->RequestDisconnect();
+		}
+
+	}
+	else if(type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTGETWORK)
+	{
+		// only send new work if it has been at least 5 seconds since the last work
+		if(client->HasSentWork()==false || difftime(time(0),client->GetLastSentWorkTime())>=5)
+		{
+			SendWork(client);
+		}
+	}
+	else if(type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTGETFULLBLOCK)
+	{
+		json_spirit::Value pval=json_spirit::find_value(message.GetValue().get_obj(),"blockid");
+		if(pval.type()==json_spirit::int_type)
+		{
+			SendFullBlock(client,pval.get_int64());
+		}
+	}
+	else if(type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTMETAHASH)
+	{
+		int64 blockid=0;
+		std::vector<unsigned char> block;
+		std::vector<unsigned char> digest;
+		unsigned int nonce=0;
+		uint256 besthash=~0;
+		unsigned int besthashnonce=0;
+		bool foundwork=false;
+
+		if(message.IsBinary())
+		{
+			RemoteMinerMessage::metahashrecord mhrecord;
+			if(mhrecord.Read(message.GetRecord()))
+			{
+				blockid=mhrecord.m_blockid;
+				nonce=mhrecord.m_startnonce;
+				digest.assign(mhrecord.m_digest,mhrecord.m_digest+32);
+				::memcpy(besthash.begin(),mhrecord.m_besthash,32);
+				besthashnonce=mhrecord.m_besthashnonce;
+			}
+			else
+			{
+				printf("Client %s sent malformed binary record.  Disconnecting.\n",client->GetAddress().c_str());
+				client->RequestDisconnect();
+			}
+		}
+		else
+		{
+			json_spirit::Value val=json_spirit::find_value(message.GetValue().get_obj(),"blockid");
+			if(val.type()==json_spirit::int_type)
+			{
+				blockid=val.get_int();
+			}
+			val=json_spirit::find_value(message.GetValue().get_obj(),"block");
+			if(val.type()==json_spirit::str_type)
+			{
+				BitcoinMinerRemoteServer::DecodeBase64(val.get_str(),block);
+			}
+			val=json_spirit::find_value(message.GetValue().get_obj(),"digest");
+			if(val.type()==json_spirit::str_type)
+			{
+				BitcoinMinerRemoteServer::DecodeBase64(val.get_str(),digest);
+			}
+			val=json_spirit::find_value(message.GetValue().get_obj(),"nonce");
+			if(val.type()==json_spirit::int_type)
+			{
+				nonce=val.get_int64();
+			}
+			val=json_spirit::find_value(message.GetValue().get_obj(),"besthash");
+			if(val.type()==json_spirit::str_type)
+			{
+				besthash.SetHex(val.get_str());
+			}
+			val=json_spirit::find_value(message.GetValue().get_obj(),"besthashnonce");
+			if(val.type()==json_spirit::int_type)
+			{
+				besthashnonce=val.get_int64();
+			}
+		}
+		RemoteClientConnection::sentwork *work;
+
+		// use GetSentWorkByID when blockid is not 0
+		if(blockid!=0)
+		{
+			foundwork=client->GetSentWorkByID(blockid,&work);
+		}
+		else
+		{
+			foundwork=client->GetSentWorkByBlock(block,&work);
+		}
+
+		if(foundwork==true)
+		{
+			if(work->CheckNonceOverlap(nonce,work->m_metahashsize)==false && besthashnonce>=nonce && besthashnonce<nonce+work->m_metahashsize)
+			{
+				if(VerifyBestHash(*work,besthash,besthashnonce)==true)
+				{
+					CountMetaHash(work->m_stale);
+
+					RemoteClientConnection::metahash mh;
+					//mh.m_metahash=digest;
+					mh.m_metahash.swap(digest);
+					mh.m_senttime=time(0);
+					mh.m_startnonce=nonce;
+					mh.m_verified=false;
+					mh.m_besthash=besthash;
+					mh.m_besthashnonce=besthashnonce;
+					work->m_metahashes.push_back(mh);
+					work->AddNonceRange(nonce,work->m_metahashsize);
+					client->CountReceivedMetaHash();
+					client->AddMetaHashRate(work->m_metahashsize);
+					client->AddBestHash(besthash);
+
+					// only accumulate hashes if client specified address to send to and we have successfully verified at least 1 metahash
+					// this will prevent a client from connecting and disconnecting rapidly to increase their hash count
+					if(client->GetRecipientAddress()!=0 && client->GetVerifiedMetaHashCount()>0)
+					{
+						AddContributedHashes(client->GetRecipientAddress(),work->m_metahashsize);
+					}
+				}
+				else
+				{
+					printf("Couldn't verify best hash from client %s\n",client->GetAddress().c_str());
+				}
+			}
+			else
+			{
+				printf("Detected nonce overlap from client %s\n",client->GetAddress().c_str());
+			}
+		}
+		else
+		{
+			printf("Client %s sent metahash for block we don't know about!\n",client->GetAddress().c_str());
+		}
+	}
+	else if(type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTSHARE)
+	{
+		// each share is checked with a single hash and credited with the hashes expected to find it
+		RemoteMinerMessage::sharerecord shrecord;
+		RemoteClientConnection::sentwork *work;
+		if(shrecord.Read(message.GetRecord())==false)
+		{
+			printf("Client %s sent malformed binary record.  Disconnecting.\n",client->GetAddress().c_str());
+			client->RequestDisconnect();
+		}
+		else if(client->GetSentWorkByID(shrecord.m_blockid,&work)==false)
+		{
+			printf("Client %s sent share for block we don't know about!\n",client->GetAddress().c_str());
+		}
+		else if(work->m_sharetarget==0)
+		{
+			printf("Client %s sent share for work without a share target\n",client->GetAddress().c_str());
+		}
+		else if(work->CheckShareDuplicate(shrecord.m_nonce)==true)
+		{
+			printf("Detected duplicate share from client %s\n",client->GetAddress().c_str());
+		}
+		else if(HashSentWork(*work,shrecord.m_nonce)>work->m_sharetarget)
+		{
+			printf("Couldn't verify share from client %s\n",client->GetAddress().c_str());
+		}
+		else
+		{
+			work->m_sharenonces.insert(shrecord.m_nonce);
+			client->AddMetaHashRate(work->m_sharehashes);
+
+			if(client->GetRecipientAddress()!=0)
+			{
+				AddContributedHashes(client->GetRecipientAddress(),work->m_sharehashes);
+			}
+		}
+	}
+	else if(type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTPROOF)
+	{
+		// the proven leaves must hang off the root the client sent, then only those segments are hashed again
+		RemoteMinerMessage::proofrecord proof;
+		RemoteClientConnection::sentwork *work;
+		if(proof.Read(message.GetRecord())==false)
+		{
+			printf("Client %s sent malformed binary record.  Disconnecting.\n",client->GetAddress().c_str());
+			client->RequestDisconnect();
+		}
+		else if(client->HasChallenge()==false || client->GetChallenge().m_workid!=proof.m_blockid || client->GetChallenge().m_startnonce!=proof.m_startnonce)
+		{
+			printf("Client %s sent proof for a metahash that wasn't challenged\n",client->GetAddress().c_str());
+		}
+		else
+		{
+			const RemoteClientConnection::metahashchallenge challenge=client->GetChallenge();
+			bool proven=false;
+			std::vector<unsigned char> leaves;
+			client->ClearChallenge();
+
+			if(client->GetSentWorkByID(challenge.m_workid,&work) && challenge.m_mhindex<work->m_metahashes.size() && proof.m_proofs.size()==challenge.m_segments.size())
+			{
+				const std::vector<unsigned char> &root=work->m_metahashes[challenge.m_mhindex].m_metahash;
+				unsigned int depth=MetaHashTree::GetDepth((work->m_metahashsize+work->m_segmentsize-1)/work->m_segmentsize);
+				proven=(root.size()==32);
+				for(std::vector<RemoteMinerMessage::proofrecord::segmentproof>::size_type p=0; p<proof.m_proofs.size() && proven==true; p++)
+				{
+					const RemoteMinerMessage::proofrecord::segmentproof &segment=proof.m_proofs[p];
+					proven=(segment.m_index==challenge.m_segments[p] && segment.m_branch.size()==depth*32 && MetaHashTree::CheckBranch(segment.m_digest,segment.m_index,segment.m_branch,&root[0]));
+					leaves.insert(leaves.end(),segment.m_digest,segment.m_digest+32);
+				}
+			}
+
+			if(proven==true)
+			{
+				m_metahashverifier.AddSegmentJob(client,*work,challenge.m_mhindex,challenge.m_segments,leaves);
+			}
+			else
+			{
+				MetaHashVerified(client,challenge.m_workid,challenge.m_mhindex,false);
+			}
+		}
+	}
+	else if(type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTFOUNDHASH)
+	{
+		int64 blockid=0;
+		std::vector<unsigned char> block;
+		int64 nonce=0;
+		bool foundwork=false;
+
+		if(message.IsBinary())
+		{
+			RemoteMinerMessage::foundhashrecord fhrecord;
+			if(fhrecord.Read(message.GetRecord()))
+			{
+				blockid=fhrecord.m_blockid;
+				nonce=fhrecord.m_nonce;
+			}
+			else
+			{
+				printf("Client %s sent malformed binary record.  Disconnecting.\n",client->GetAddress().c_str());
+				client->RequestDisconnect();
+			}
+		}
+		else
+		{
+			json_spirit::Value val=json_spirit::find_value(message.GetValue().get_obj(),"blockid");
+			if(val.type()==json_spirit::int_type)
+			{
+				blockid=val.get_int();
+			}
+			val=json_spirit::find_value(message.GetValue().get_obj(),"block");
+			if(val.type()==json_spirit::str_type)
+			{
+				BitcoinMinerRemoteServer::DecodeBase64(val.get_str(),block);
+			}
+			val=json_spirit::find_value(message.GetValue().get_obj(),"nonce");
+			if(val.type()==json_spirit::int_type)
+			{
+				nonce=val.get_int();
+			}
+		}
+		
+		if(VerifyFoundHash(client,blockid,block,nonce,blockaccepted)==true)
+		{
+			if(blockaccepted==true)
+			{
+				BlockGenerated();
+			}
+			// the server thread sends ALL clients new block to work on, unless accepting the block changed the tip and it already did
+			RequestWorkForAllClients();
+		}
+	}
+	else
+	{
+		printf("Unhandled message type (%d) from client %s\n",type,client->GetAddress().c_str());
+	}
+}
+
 void ThreadBitcoinMinerRemote(void* parg)
 {
     try
@@ -1475,13 +3355,12 @@ void BitcoinMinerRemote()
 
 	std::string bindaddr("127.0.0.1");
 	std::string bindport("8335");
-	std::string remotepassword("");
 	BitcoinMinerRemoteServer serv;
+	// declared after the server, so it is stopped before the server goes away
+	BitcoinMinerStratumServer stratum(&serv);
 	time_t laststatusbarupdate=time(0);
-	time_t lastverified=time(0);
 	time_t lastserverstatus=time(0);
-	bool blockaccepted=false;
-	MetaHashVerifier metahashverifier;
+	time_t lasttick=time(0);
 
 	if(mapArgs.count("-remotebindaddr"))
 	{
@@ -1491,12 +3370,36 @@ void BitcoinMinerRemote()
 	{
 		bindport=mapArgs["-remotebindport"];
 	}
-	if(mapArgs.count("-remotepassword"))
+
+	int verifythreads=GetArg("-remoteverifythreads",boost::thread::hardware_concurrency());
+	if(verifythreads<1)
+	{
+		verifythreads=1;
+	}
+	serv.Verifier().Start(verifythreads);
+
+	int workerthreads=GetArg("-remoteworkerthreads",boost::thread::hardware_concurrency());
+	if(workerthreads<1)
 	{
-		remotepassword=mapArgs["-remotepassword"];
+		workerthreads=1;
 	}
+	serv.Workers().Start(&serv,workerthreads);
 
 	serv.StartListen(bindaddr,bindport);
+	serv.StartTemplateBuilder();
+
+	if(mapArgs.count("-stratumbindport"))
+	{
+		std::string stratumbindaddr(bindaddr);
+		if(mapArgs.count("-stratumbindaddr"))
+		{
+			stratumbindaddr=mapArgs["-stratumbindaddr"];
+		}
+		if(stratum.StartListen(stratumbindaddr,mapArgs["-stratumbindport"]))
+		{
+			stratum.Start();
+		}
+	}
 
 	SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
@@ -1504,192 +3407,21 @@ void BitcoinMinerRemote()
 	{
 		serv.Step();
 
-		// handle messages
+		// decode messages and hand them to the workers
 		{
-			SCOPEDTIME("BitcoinMinerRemote Handling Messages");
+			SCOPEDTIME("BitcoinMinerRemote Dispatching Messages");
 			for(std::vector<RemoteClientConnection *>::iterator i=serv.Clients().begin(); i!=serv.Clients().end(); i++)
 			{
 				while((*i)->MessageReady() && !(*i)->ProtocolError())
 				{
 					RemoteMinerMessage message;
 					int type=RemoteMinerMessage::MESSAGE_TYPE_NONE;
-					if((*i)->ReceiveMessage(message) && message.GetValue().type()==json_spirit::obj_type)
+					if((*i)->ReceiveMessage(message) && (message.IsBinary() || message.GetValue().type()==json_spirit::obj_type))
 					{
-						json_spirit::Value val=json_spirit::find_value(message.GetValue().get_obj(),"type");
-						if(val.type()==json_spirit::int_type)
+						if(message.GetType(type))
 						{
-							type=val.get_int();
-							if((*i)->GotClientHello()==false && type!=RemoteMinerMessage::MESSAGE_TYPE_CLIENTHELLO)
-							{
-								printf("Client sent first message other than clienthello\n");
-								(*i)->Disconnect();
-							}
-							else if((*i)->GotClientHello()==false && type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTHELLO)
-							{
-
-								json_spirit::Value pval=json_spirit::find_value(message.GetValue().get_obj(),"address");
-								if(pval.type()==json_spirit::str_type)
-								{
-									uint160 address;
-									address.SetHex(pval.get_str());
-									(*i)->SetRequestedRecipientAddress(address);
-								}
-
-								pval=json_spirit::find_value(message.GetValue().get_obj(),"password");
-								if(pval.type()==json_spirit::str_type && pval.get_str()==remotepassword)
-								{
-									printf("Got clienthello from client %s\n",(*i)->GetAddress().c_str());
-									(*i)->SetGotClientHello(true);
-									serv.SendServerHello((*i),BITCOINMINERREMOTE_HASHESPERMETA);
-									// also send work right away
-									serv.SendWork((*i));
-								}
-								else
-								{
-									printf("Client %s didn't send correct password.  Disconnecting.\n",(*i)->GetAddress().c_str());
-									(*i)->Disconnect();
-								}
-
-							}
-							else if(type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTGETWORK)
-							{
-								// only send new work if it has been at least 5 seconds since the last work
-								if((*i)->GetSentWork().size()==0 || difftime(time(0),(*i)->GetSentWork()[(*i)->GetSentWork().size()-1].m_senttime)>=5)
-								{
-									serv.SendWork((*i));
-								}
-							}
-							else if(type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTMETAHASH)
-							{
-								int64 blockid=0;
-								std::vector<unsigned char> block;
-								std::vector<unsigned char> digest;
-								unsigned int nonce=0;
-								uint256 besthash=~0;
-								unsigned int besthashnonce=0;
-								bool foundwork=false;
-
-								json_spirit::Value val=json_spirit::find_value(message.GetValue().get_obj(),"blockid");
-								if(val.type()==json_spirit::int_type)
-								{
-									blockid=val.get_int();
-								}
-								val=json_spirit::find_value(message.GetValue().get_obj(),"block");
-								if(val.type()==json_spirit::str_type)
-								{
-									BitcoinMinerRemoteServer::DecodeBase64(val.get_str(),block);
-								}
-								val=json_spirit::find_value(message.GetValue().get_obj(),"digest");
-								if(val.type()==json_spirit::str_type)
-								{
-									BitcoinMinerRemoteServer::DecodeBase64(val.get_str(),digest);
-								}
-								val=json_spirit::find_value(message.GetValue().get_obj(),"nonce");
-								if(val.type()==json_spirit::int_type)
-								{
-									nonce=val.get_int64();
-								}
-								val=json_spirit::find_value(message.GetValue().get_obj(),"besthash");
-								if(val.type()==json_spirit::str_type)
-								{
-									besthash.SetHex(val.get_str());
-								}
-								val=json_spirit::find_value(message.GetValue().get_obj(),"besthashnonce");
-								if(val.type()==json_spirit::int_type)
-								{
-									besthashnonce=val.get_int64();
-								}
-								RemoteClientConnection::sentwork *work;
-
-								// use GetSentWorkByID when blockid is not 0
-								if(blockid!=0)
-								{
-									foundwork=(*i)->GetSentWorkByID(blockid,&work);
-								}
-								else
-								{
-									foundwork=(*i)->GetSentWorkByBlock(block,&work);
-								}
-
-								if(foundwork==true)
-								{
-									if(work->CheckNonceOverlap(nonce,BITCOINMINERREMOTE_HASHESPERMETA)==false && besthashnonce>=nonce && besthashnonce<nonce+BITCOINMINERREMOTE_HASHESPERMETA)
-									{
-										if(VerifyBestHash(*work,besthash,besthashnonce)==true)
-										{
-											RemoteClientConnection::metahash mh;
-											//mh.m_metahash=digest;
-											mh.m_metahash.swap(digest);
-											mh.m_senttime=time(0);
-											mh.m_startnonce=nonce;
-											mh.m_verified=false;
-											mh.m_besthash=besthash;
-											mh.m_besthashnonce=besthashnonce;
-											work->m_metahashes.push_back(mh);
-
-											// only accumulate hashes if client specified address to send to and we have successfully verified at least 1 metahash
-											// this will prevent a client from connecting and disconnecting rapidly to increase their hash count
-											if((*i)->GetRecipientAddress()!=0 && (*i)->GetVerifiedMetaHashCount()>0)
-											{
-												serv.AddContributedHashes((*i)->GetRecipientAddress(),BITCOINMINERREMOTE_HASHESPERMETA);
-											}
-										}
-										else
-										{
-											printf("Couldn't verify best hash from client %s\n",(*i)->GetAddress().c_str());
-										}
-									}
-									else
-									{
-										printf("Detected nonce overlap from client %s\n",(*i)->GetAddress().c_str());
-									}
-								}
-								else
-								{
-									printf("Client %s sent metahash for block we don't know about!\n",(*i)->GetAddress().c_str());
-								}
-							}
-							else if(type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTFOUNDHASH)
-							{
-								SetThreadPriority(THREAD_PRIORITY_NORMAL);
-
-								int64 blockid=0;
-								std::vector<unsigned char> block;
-								int64 nonce=0;
-								bool foundwork=false;
-
-								json_spirit::Value val=json_spirit::find_value(message.GetValue().get_obj(),"blockid");
-								if(val.type()==json_spirit::int_type)
-								{
-									blockid=val.get_int();
-								}
-								val=json_spirit::find_value(message.GetValue().get_obj(),"block");
-								if(val.type()==json_spirit::str_type)
-								{
-									BitcoinMinerRemoteServer::DecodeBase64(val.get_str(),block);
-								}
-								val=json_spirit::find_value(message.GetValue().get_obj(),"nonce");
-								if(val.type()==json_spirit::int_type)
-								{
-									nonce=val.get_int();
-								}
-								
-								if(VerifyFoundHash((*i),blockid,block,nonce,blockaccepted)==true)
-								{
-									if(blockaccepted==true)
-									{
-										serv.GeneratedCount()++;
-										serv.ClearCurrentHashesContributed();
-									}
-									// send ALL clients new block to work on
-									serv.SendWorkToAllClients();
-								}
-								SetThreadPriority(THREAD_PRIORITY_LOWEST);
-							}
-							else
-							{
-								printf("Unhandled message type (%d) from client %s\n",type,(*i)->GetAddress().c_str());
-							}
+							// found hashes go ahead of the other messages on a lane of their own
+							serv.Workers().AddMessage((*i),message,type==RemoteMinerMessage::MESSAGE_TYPE_CLIENTFOUNDHASH);
 						}
 						else
 						{
@@ -1710,19 +3442,31 @@ void BitcoinMinerRemote()
 					printf("There was protcol error from client %s.  Disconnecting.\n",(*i)->GetAddress().c_str());
 					(*i)->Disconnect();
 				}
-
-				// send new block every 2 minutes
-				if((*i)->GetSentWork().size()>0)
-				{
-					if(difftime(time(0),(*i)->GetSentWork()[(*i)->GetSentWork().size()-1].m_senttime)>=120)
-					{
-						serv.SendWork((*i));
-					}
-				}
 			}
 
 		}
 
+		serv.UpdateAllClientsCalculatedKHash();
+
+		// a block from the network or one of our clients makes all outstanding work stale
+		serv.CheckTipChanged();
+
+		// move everyone off the coinbase only block once the transactions are in, or onto new work after a found hash
+		if(serv.TemplateFilled() || serv.WorkForAllClientsRequested())
+		{
+			serv.SendWorkToAllClients();
+		}
+
+		// challenges that weren't answered and work that is getting old are checked by the workers
+		if(difftime(time(0),lasttick)>=1)
+		{
+			for(std::vector<RemoteClientConnection *>::iterator i=serv.Clients().begin(); i!=serv.Clients().end(); i++)
+			{
+				serv.Workers().AddJob((*i),RemoteMessageWorkers::job(RemoteMessageWorkers::JOB_TICK));
+			}
+			lasttick=time(0);
+		}
+
 		if(serv.Clients().size()==0)
 		{
 			Sleep(100);
@@ -1739,45 +3483,47 @@ void BitcoinMinerRemote()
 			laststatusbarupdate=time(0);
 		}
 
-		// check metahash of a client every 10 seconds
-		if(serv.Clients().size()>0 && difftime(time(0),lastverified)>=10)
+		// keep each verifier thread busy with the newest metahash of the client most overdue for verification
+		if(serv.Clients().size()>0 && serv.Verifier().GetJobCount()<serv.Verifier().GetThreadCount())
 		{
-			RemoteClientConnection *client=serv.GetOldestNonVerifiedMetaHashClient();
+			RemoteClientConnection *client=serv.GetMetaHashClientToVerify();
+			RemoteClientConnection::sentwork work;
 
-			if(metahashverifier.GetClient()!=client || (client!=0 && metahashverifier.GetClient()==0))
+			if(client!=0)
 			{
-				RemoteClientConnection::sentwork work;
-				if(client->GetNewestSentWorkWithMetaHash(work))
+				TRY_CRITICAL_BLOCK(client->GetCS())
 				{
-					metahashverifier.Start(client,work);
+					if(client->GetNewestSentWorkWithMetaHash(work))
+					{
+						if(work.m_segmentsize>0)
+						{
+							serv.SendMetaHashChallenge(client,work);
+						}
+						else
+						{
+							serv.Verifier().AddJob(client,work);
+						}
+						client->SetVerifyingMetaHash(true);
+					}
 				}
 			}
+		}
 
-			if(client!=0 && metahashverifier.GetClient()==client && metahashverifier.Done()==false)
-			{
-				metahashverifier.Step();
-			}
-
-			if(client!=0 && metahashverifier.GetClient()==client && metahashverifier.Done()==true)
+		// results for clients that have since disconnected are dropped
+		{
+			MetaHashVerifier::job result;
+			while(serv.Verifier().GetResult(result))
 			{
-				if(metahashverifier.Verified()==true)
-				{
-					client->SetWorkVerified(metahashverifier.GetWorkID(),metahashverifier.GetMetaHashIndex(),true);
-					printf("Client %s passed metahash verification\n",client->GetAddress().c_str());
-				}
-				else
+				RemoteClientConnection *client=serv.GetClientByID(result.m_clientid);
+				if(client!=0)
 				{
-					client->SetWorkVerified(metahashverifier.GetWorkID(),metahashverifier.GetMetaHashIndex(),false);
-					printf("Client %s failed metahash verification\n",client->GetAddress().c_str());
+					RemoteMessageWorkers::job verified(RemoteMessageWorkers::JOB_VERIFIED);
+					verified.m_workid=result.m_workid;
+					verified.m_mhindex=result.m_mhindex;
+					verified.m_verified=result.m_verified;
+					serv.Workers().AddJob(client,verified);
 				}
-
-				metahashverifier.ClearClient();
-				lastverified=time(0);
-
-				client->SetLastVerifiedMetaHash(lastverified);
-				
 			}
-
 		}
 		
 		// send server status to all connected clients every minute
@@ -21,18 +21,39 @@
 
 #include "../headers.h"
 #include "remoteminermessage.h"
+#include "remoteminermetahash.h"
+#include "remoteminerhashrate.h"
 #include "../cryptopp/sha.h"
 #include "timestats.h"
+#include <boost/shared_ptr.hpp>
 #include <vector>
 #include <map>
+#include <set>
+#include <deque>
 #include <string>
 
+// edge-triggered epoll instead of select, which is limited to FD_SETSIZE sockets
+#ifdef __linux__
+	#define _BITCOIN_REMOTE_EPOLL_
+	#include <sys/epoll.h>
+#endif
+
 extern const int BITCOINMINERREMOTE_THREADINDEX;
 extern const int BITCOINMINERREMOTE_HASHESPERMETA;
+extern const int BITCOINMINERREMOTE_MINHASHESPERMETA;
+extern const int BITCOINMINERREMOTE_MAXHASHESPERMETA;
+extern const int BITCOINMINERREMOTE_SHARESPERMETA;
+extern const int BITCOINMINERREMOTE_MINHASHESPERSHARE;
+extern const int BITCOINMINERREMOTE_SEGMENTSPERMETA;
+extern const int BITCOINMINERREMOTE_SECONDSPERTRUST;
+extern const int BITCOINMINERREMOTE_TRUSTPERFAILURE;
+extern const int BITCOINMINERREMOTE_MAXSENTWORK;
+extern const int BITCOINMINERREMOTE_STRATUMJOBINTERVAL;
 #define BITCOINMINERREMOTE_SERVERVERSIONSTR "1.2.2"
 
 void ThreadBitcoinMinerRemote(void* parg);
 void BitcoinMinerRemote();
+void BitcoinMinerRemoteTipChanged();
 
 extern CCriticalSection cs_mapTransactions;
 unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast);
@@ -43,6 +64,36 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 extern TimeStats timestats;
 #define SCOPEDTIME(section)	ScopedTimer scopedtimer(timestats,section);
 
+/*
+	Memory pool transactions and coinbase merkle branch for a block on top of
+	m_indexprev.  It is built once per tip and memory pool update and shared
+	by the work sent to every client, only the coinbase and with it the
+	merkle root is different for each client.
+*/
+struct RemoteBlockTemplate
+{
+	RemoteBlockTemplate():m_indexprev(0),m_transactionsupdated(0),m_bits(0),m_fees(0),m_size(0),m_withtransactions(false)	{ }
+
+	const bool IsCurrent() const;
+	const uint256 GetMerkleRoot(const CTransaction &coinbase) const		{ return CBlock::CheckMerkleBranch(coinbase.GetHash(),m_merklebranch,0); }
+	void GetBlock(const CTransaction &coinbase, CBlock &block) const;
+	// second 64 bytes of the header as the miner hashes them, and the midstate of the first 64
+	static void FormatWork(const CBlock &header, std::vector<unsigned char> &block, std::vector<unsigned char> &midstate);
+	// serialized coinbase before and after the last extrabytes of its scriptSig, where miners put their extranonce
+	static void SplitCoinbase(const CTransaction &coinbase, const unsigned int extrabytes, std::vector<unsigned char> &coinbase1, std::vector<unsigned char> &coinbase2);
+
+	CBlockIndex *m_indexprev;
+	unsigned int m_transactionsupdated;
+	unsigned int m_bits;
+	int64 m_fees;
+	unsigned int m_size;					// serialized size without the coinbase
+	std::vector<CTransaction> m_vtx;		// everything except the coinbase
+	std::vector<uint256> m_merklebranch;	// branch of the coinbase at index 0
+	boost::shared_ptr<const std::string> m_fullblocktail;	// JSON of the fullblock after the coinbase, sent as is to every client
+	boost::shared_ptr<const std::string> m_compactblocktail;	// the same with only the ids of the transactions, for clients that asked for compact blocks
+	bool m_withtransactions;				// false for the coinbase only template published right after a new tip
+};
+
 class RemoteClientConnection
 {
 public:
@@ -50,39 +101,77 @@ public:
 	~RemoteClientConnection();
 
 	const SOCKET GetSocket() const		{ return m_socket; }
+	const int64 GetID() const			{ return m_id; }
 
 	const bool IsConnected() const		{ return m_socket!=INVALID_SOCKET; }
 	const bool Disconnect();
+	// the message workers leave closing the socket to the server thread
+	void RequestDisconnect();
+	const bool DisconnectRequested();
+
+	// held by the thread working on the client, the socket and send buffer have their own lock
+	CCriticalSection &GetCS()			{ return m_cs; }
 
 	void SendMessage(const RemoteMinerMessage &message);
+	// queues wire data that was put together by the caller, fragments may be shared with other clients
+	void SendFragments(const std::vector<boost::shared_ptr<const std::string> > &fragments);
 	const bool MessageReady() const;
 	const bool ProtocolError() const;
 	const bool ReceiveMessage(RemoteMinerMessage &message);
+	// newline terminated lines for the stratum frontend, which only uses the connection for its socket and buffers
+	const bool ReceiveLine(std::string &line);
 
 	void SetRequestedRecipientAddress(const uint160 &recipient)		{ m_recipientaddress=recipient; }
 	const bool GetRequestedRecipientAddress(uint160 &recipient)		{ recipient=m_recipientaddress; return m_recipientaddress!=0; }
-	const int64 GetCalculatedKHashRateFromBestHash(const int sec=60, const int minsec=60) const;
-	const int64 GetCalculatedKHashRateFromMetaHash(const int sec=60, const int minsec=60) const;
+	const int64 GetCalculatedKHashRateFromBestHash() const;
+	const int64 GetCalculatedKHashRateFromMetaHash() const;
+	void AddMetaHashRate(const int64 hashes)						{ m_metahashrate.Add(time(0),hashes); }
+	void AddBestHash(const uint256 &besthash);
 	const bool GotClientHello() const								{ return m_gotclienthello; }
+	const int GetProtocolVersion() const							{ return m_protocolversion; }
+	void SetProtocolVersion(const int version)						{ m_protocolversion=version; }
 	void SetGotClientHello(bool got)								{ m_gotclienthello=got; }
+	const bool UsesShares() const									{ return m_useshares; }
+	void SetUsesShares(const bool useshares)						{ m_useshares=useshares; }
+	const bool UsesMetaHashTree() const								{ return m_usesmetahashtree; }
+	void SetUsesMetaHashTree(const bool usestree)					{ m_usesmetahashtree=usestree; }
+	const bool UsesCompactBlock() const								{ return m_usescompactblock; }
+	void SetUsesCompactBlock(const bool compact)					{ m_usescompactblock=compact; }
+	const bool RollsExtraNonce() const								{ return m_rollsextranonce; }
+	void SetRollsExtraNonce(const bool rolls)						{ m_rollsextranonce=rolls; }
 
 	const time_t GetLastVerifiedMetaHash() const					{ return m_lastverifiedmetahash; }
 	void SetLastVerifiedMetaHash(const time_t t)					{ m_lastverifiedmetahash=t; }
 	const int64 GetVerifiedMetaHashCount() const					{ return m_verifiedmetahashcount; }
+	const int64 GetFailedMetaHashCount() const						{ return m_failedmetahashcount; }
+	const int64 GetReceivedMetaHashCount() const					{ return m_receivedmetahashcount; }
+	void CountReceivedMetaHash()									{ m_receivedmetahashcount++; }
+	const int64 GetLastVerifiedKHash() const						{ return m_lastverifiedkhash; }
+	void SetLastVerifiedKHash(const int64 khash)					{ m_lastverifiedkhash=khash; }
+	const bool VerifyingMetaHash() const							{ return m_verifyingmetahash; }
+	void SetVerifyingMetaHash(const bool verifying)					{ m_verifyingmetahash=verifying; }
 
-	const std::vector<char>::size_type ReceiveBufferSize() const	{ return m_receivebuffer.size(); }
-	const std::vector<char>::size_type SendBufferSize() const		{ return m_sendbuffer.size(); }
+	const std::vector<char>::size_type ReceiveBufferSize() const	{ return m_receivebuffer.Size(); }
+	const std::vector<char>::size_type SendBufferSize();
 
 	const bool SocketReceive();
 	const bool SocketSend();
 
+#ifdef _BITCOIN_REMOTE_EPOLL_
+	const bool AddToEpoll(const int epollfd);
+#endif
+
 	const std::string GetAddress(const bool withport=true) const;
 
 	const uint160 GetRecipientAddress() const						{ return m_recipientaddress; }
 
 	int64 &NextBlockID()											{ return m_nextblockid; }
 
+	const unsigned int GetMetaHashSize() const						{ return m_metahashsize; }
+	void AdjustMetaHashSize(const int interval);
+
 	void ClearOldSentWork(const int sec);
+	void InvalidateSentWork(const CBlockIndex *pindexbest);
 
 	struct metahash
 	{
@@ -95,102 +184,282 @@ public:
 		unsigned int m_besthashnonce;
 	};
 
+	// segments of a metahash tree the client was asked to prove, only one is outstanding at a time
+	struct metahashchallenge
+	{
+		metahashchallenge():m_workid(0),m_mhindex(-1),m_startnonce(0),m_senttime(0)	{ }
+		int64 m_workid;
+		int64 m_mhindex;
+		unsigned int m_startnonce;
+		std::vector<unsigned int> m_segments;
+		time_t m_senttime;
+	};
+
+	const bool HasChallenge() const									{ return m_challenge.m_mhindex>=0; }
+	const metahashchallenge &GetChallenge() const					{ return m_challenge; }
+	void SetChallenge(const metahashchallenge &challenge)			{ m_challenge=challenge; }
+	void ClearChallenge()											{ m_challenge=metahashchallenge(); }
+
 	struct sentwork
 	{
-		sentwork():m_pblock(0)			{ }
+		sentwork():m_metahashsize(BITCOINMINERREMOTE_HASHESPERMETA),m_segmentsize(0),m_sharetarget(0),m_sharehashes(0),m_time(0),m_bits(0),m_ntimewindow(0),m_stale(false),m_rollsextranonce(false)			{ }
 		
 		int64 m_blockid;
 		time_t m_senttime;
 		std::vector<unsigned char> m_block;
 		std::vector<unsigned char> m_midstate;
 		uint256 m_target;
+		unsigned int m_metahashsize;
+		unsigned int m_segmentsize;		// nonces per metahash tree segment, 0 when the client sends plain metahash digests
 		CKey m_key;
 		std::vector<metahash> m_metahashes;
-		CBlock *m_pblock;
+		std::map<unsigned int,int64> m_nonceranges;	// start and end nonce of every accepted metahash
+		uint256 m_sharetarget;			// 0 when the work is accounted with metahashes
+		int64 m_sharehashes;			// expected hashes behind each share
+		std::set<unsigned int> m_sharenonces;
+		boost::shared_ptr<const RemoteBlockTemplate> m_template;	// reset once the block has been submitted or the tip moved on
+		CTransaction m_coinbase;
+		std::vector<uint256> m_merklebranch;	// the template's coinbase branch when the client rolls the extranonce, so that work is rebuilt without m_template
+		unsigned int m_time;
+		unsigned int m_bits;
+		unsigned int m_ntimewindow;		// seconds the client may roll m_time on
 		CBlockIndex *m_indexprev;
+		bool m_stale;					// the tip moved on after this work was sent
+		bool m_rollsextranonce;			// the last 4 bytes of the coinbase scriptSig are the client's extranonce
 
-		const bool CheckNonceOverlap(const unsigned int nonce, const unsigned int hashespermetahash)
+		// true when any nonce of [nonce,nonce+count) is already covered by an accepted metahash
+		const bool CheckNonceOverlap(const unsigned int nonce, const unsigned int count) const
 		{
-			for(std::vector<metahash>::const_iterator i=m_metahashes.begin(); i!=m_metahashes.end(); i++)
+			std::map<unsigned int,int64>::const_iterator i=m_nonceranges.lower_bound(nonce);
+			if(i!=m_nonceranges.end() && static_cast<int64>((*i).first)<static_cast<int64>(nonce)+count)
+			{
+				return true;
+			}
+			if(i!=m_nonceranges.begin())
 			{
-				if((*i).m_startnonce<=nonce && (*i).m_startnonce+hashespermetahash>nonce)
+				i--;
+				if((*i).second>nonce)
 				{
 					return true;
 				}
 			}
 			return false;
 		}
+
+		void AddNonceRange(const unsigned int nonce, const unsigned int count)
+		{
+			m_nonceranges[nonce]=static_cast<int64>(nonce)+count;
+		}
+
+		const bool CheckShareDuplicate(const unsigned int nonce) const
+		{
+			return (m_sharenonces.find(nonce)!=m_sharenonces.end());
+		}
 	};
 
-	const std::vector<sentwork> &GetSentWork() const		{ return m_sentwork; }
-	std::vector<sentwork> &GetSentWork()					{ return m_sentwork; }
+	void AddSentWork(const sentwork &work);
+	const bool HasSentWork() const							{ return (m_sentwork.size()>0); }
+	const time_t GetLastSentWorkTime() const;
 	const bool GetSentWorkByBlock(const std::vector<unsigned char> &block, sentwork **work);
 	const bool GetSentWorkByID(const int64 id, sentwork **work);
 	const bool GetNewestSentWorkWithMetaHash(sentwork &work) const;
+	const bool HasUnverifiedMetaHash() const;
 	void SetWorkVerified(const int64 id, const int64 mhindex, const bool valid);
 
-	const std::vector<char>::size_type GetReceiveBufferSize() const	{ return m_receivebuffer.size(); }
-	const std::vector<char>::size_type GetSendBufferSize() const	{ return m_sendbuffer.size(); }
+	const std::vector<char>::size_type GetReceiveBufferSize() const	{ return m_receivebuffer.Size(); }
+	const std::vector<char>::size_type GetSendBufferSize()			{ return SendBufferSize(); }
 
 private:
+	// a piece of a message waiting to be sent and how much of it went out already
+	struct sendfragment
+	{
+		sendfragment():m_offset(0)		{ }
+		boost::shared_ptr<const std::string> m_data;
+		std::string::size_type m_offset;
+	};
+
+	const int WriteFragments();
+	void FragmentsSent(int bytes);
+
+	const bool AddRolledWork(const int64 id);
+
+	static int64 m_lastid;
+
+	int64 m_id;
 	SOCKET m_socket;
 	struct sockaddr_storage m_addr;
 	int m_addrlen;
 
-	std::vector<char> m_tempbuffer;
-	std::vector<char> m_receivebuffer;
-	std::vector<char> m_sendbuffer;
+	CCriticalSection m_cs;
+	CCriticalSection m_cssend;		// m_socket changes, m_sendbuffer and m_disconnectrequested
+	RemoteMinerBuffer m_receivebuffer;
+	std::deque<sendfragment> m_sendbuffer;
+	std::vector<char>::size_type m_sendbuffersize;
+	bool m_disconnectrequested;
 
-	std::vector<sentwork> m_sentwork;
+	std::map<int64,sentwork> m_sentwork;								// keyed by block id, which grows with every work sent, work the client rolled sorts after all of it
+	std::map<std::vector<unsigned char>,int64> m_sentworkbyblock;		// block data to block id for clients that don't send ids
 
 	time_t m_connecttime;
 	time_t m_lastactive;
 	time_t m_lastverifiedmetahash;
+	bool m_verifyingmetahash;
 	bool m_gotclienthello;
+	int m_protocolversion;
+	bool m_useshares;
+	bool m_usesmetahashtree;
+	bool m_usescompactblock;
+	bool m_rollsextranonce;
+	metahashchallenge m_challenge;
 	uint160 m_recipientaddress;
 
 	int64 m_nextblockid;
 	int64 m_verifiedmetahashcount;
+	int64 m_failedmetahashcount;
+	int64 m_receivedmetahashcount;
+	int64 m_lastverifiedkhash;		// hash rate when the last verification finished
+	HashRateWindow m_metahashrate;	// hashes of the metahashes and shares accepted in the last minute
+	HashRateWindow m_besthashbits;	// leading 0 bits of the best hashes of the last 10 minutes
+	HashRateWindow m_besthashcount;
+	unsigned int m_metahashsize;	// hashes per metahash for the next work sent
+
+#ifdef _BITCOIN_REMOTE_EPOLL_
+	void SetEpollOut(const bool wantout);
+
+	int m_epollfd;
+	bool m_epollout;		// EPOLLOUT is only registered while m_sendbuffer has data
+#endif
 
 };
 
+struct SHA256Kernel;
+
+/*
+	Pool of threads that recompute client metahashes.  Jobs carry copies of
+	the work and refer to the client by ID, so a client may disconnect while
+	its metahash is being checked.  Results are collected by the server
+	thread, which is the only one that touches the client connections.
+*/
 class MetaHashVerifier
 {
 public:
 	MetaHashVerifier();
 	~MetaHashVerifier();
 
-	void Start(RemoteClientConnection *client, const RemoteClientConnection::sentwork &work);
-	void Step(const int hashes=10000);
+	struct job
+	{
+		job():m_clientid(0),m_workid(0),m_mhindex(-1),m_startnonce(0),m_metahashsize(0),m_segmentsize(0),m_verified(false)	{ }
+
+		int64 m_clientid;
+		int64 m_workid;
+		int64 m_mhindex;
+		std::vector<unsigned char> m_block;
+		std::vector<unsigned char> m_midstate;
+		std::vector<unsigned char> m_digest;
+		unsigned int m_startnonce;
+		unsigned int m_metahashsize;
+		unsigned int m_segmentsize;
+		std::vector<unsigned int> m_segments;		// challenged segments of a metahash tree
+		std::vector<unsigned char> m_leaves;		// digests the client proved for those segments
+		bool m_verified;
+	};
+
+	const bool Start(const int threads);
+	void Stop();
+
+	const int GetThreadCount() const				{ return m_threadcount; }
+	const int GetJobCount();
+
+	// queues the newest metahash of the work
+	void AddJob(const RemoteClientConnection *client, const RemoteClientConnection::sentwork &work);
+	// queues the proven segments of a metahash tree, only those nonces are hashed again
+	void AddSegmentJob(const RemoteClientConnection *client, const RemoteClientConnection::sentwork &work, const int64 mhindex, const std::vector<unsigned int> &segments, const std::vector<unsigned char> &leaves);
+	const bool GetResult(job &result);
+
+private:
+	static void ThreadVerifier(void *arg);
+	static void Verify(job &j, const SHA256Kernel *kernel);
+
+	CCriticalSection m_cs;
+	std::deque<job> m_jobs;
+	std::vector<job> m_results;
+	const SHA256Kernel *m_kernel;
+	int m_threadcount;
+	int m_running;
+	int m_busy;
+	bool m_stop;
+
+};
+
+class BitcoinMinerRemoteServer;
+
+/*
+	Pool of threads that handle the decoded messages of the clients.  Every
+	client has its own queue and is worked on by one thread at a time, which
+	holds the client's lock, so the messages of a client are handled in the
+	order they arrived while different clients are handled in parallel.
+	Found hashes skip the queues and go to a thread of their own that runs at
+	normal priority.  The server thread keeps the socket IO, hands out the
+	jobs and only deletes a client once it has no jobs left.
+*/
+class RemoteMessageWorkers
+{
+public:
+	RemoteMessageWorkers();
+	~RemoteMessageWorkers();
+
+	enum jobtype
+	{
+		JOB_MESSAGE=0,
+		JOB_SENDWORK,		// new work for the client
+		JOB_NEWTIP,			// the tip changed, outstanding work is stale and new work is sent
+		JOB_VERIFIED,		// a metahash verification finished
+		JOB_TICK,			// once a second housekeeping
+		JOB_STATUS			// server status
+	};
+
+	struct job
+	{
+		job(const int type=JOB_MESSAGE):m_type(type),m_workid(0),m_mhindex(-1),m_verified(false)	{ }
+
+		int m_type;
+		RemoteMinerMessage m_message;
+		int64 m_workid;			// result of JOB_VERIFIED
+		int64 m_mhindex;
+		bool m_verified;
+	};
 
-	RemoteClientConnection *GetClient()				{ return m_client; }
-	void ClearClient()								{ m_client=0; }
+	const bool Start(BitcoinMinerRemoteServer *server, const int threads);
+	void Stop();
 
-	const bool Done() const							{ return m_done; }
-	const bool Verified() const						{ return m_verified; }
-	const int64 GetWorkID() const					{ return m_workid; }
-	const int64 GetMetaHashIndex() const			{ return m_mhindex; }
+	const int GetThreadCount() const				{ return m_threadcount; }
+
+	void AddMessage(RemoteClientConnection *client, const RemoteMinerMessage &message, const bool foundhash);
+	// jobs other than messages and verification results are dropped when one of the same type is still waiting
+	void AddJob(RemoteClientConnection *client, const job &j);
+	// true when the client has no jobs waiting or running, it may then be deleted
+	const bool Release(RemoteClientConnection *client);
 
 private:
+	static void ThreadWorker(void *arg);
+	static void ThreadFoundHash(void *arg);
+
+	struct clientqueue
+	{
+		clientqueue():m_pending(0),m_scheduled(false)	{ }
+		std::deque<job> m_jobs;
+		int m_pending;			// jobs in m_jobs, in the found hash lane or running
+		bool m_scheduled;		// in m_ready or worked on by a thread
+	};
 
-	int64 m_workid;
-	int64 m_mhindex;
-	bool m_done;
-	bool m_verified;
-	uint256 m_tempbuff[3];
-	uint256 m_hashbuff[3];
-	uint256 *m_temphash;
-	uint256 *m_hash;
-	unsigned char m_midbuff[256];
-	unsigned char m_blockbuff[256];
-	unsigned char *m_midbuffptr;
-	unsigned char *m_blockbuffptr;
-	unsigned int *m_nonce;
-	unsigned int m_startnonce;
-	std::vector<unsigned char> m_digest;
-	std::vector<unsigned char> m_metahash;
-	std::vector<unsigned char>::size_type m_metahashpos;
-	RemoteClientConnection *m_client;
+	CCriticalSection m_cs;
+	BitcoinMinerRemoteServer *m_server;
+	std::map<RemoteClientConnection *,clientqueue> m_queues;
+	std::deque<RemoteClientConnection *> m_ready;
+	std::deque<std::pair<RemoteClientConnection *,job> > m_foundhashes;
+	int m_threadcount;
+	int m_running;
+	bool m_stop;
 
 };
 
@@ -204,48 +473,136 @@ public:
 	const bool Step();
 
 	std::vector<RemoteClientConnection *> &Clients()		{ return m_clients; }
+	RemoteMessageWorkers &Workers()							{ return m_workers; }
+	MetaHashVerifier &Verifier()							{ return m_metahashverifier; }
+
+	// called by the message workers with the client's lock held
+	void HandleJob(RemoteClientConnection *client, const RemoteMessageWorkers::job &j);
 
 	void SendServerHello(RemoteClientConnection *client, const int metahashrate);
+	const bool ShareAccounting() const										{ return m_accounting=="shares"; }
 	void SendWork(RemoteClientConnection *client);
+	// coinbase paying key and the distribution, with extrabytes zeros at the end of the scriptSig for the extranonce of the miner
+	void CreateCoinbase(const RemoteBlockTemplate &blocktemplate, const CKey &key, const unsigned int extrabytes, CTransaction &coinbase);
+	const boost::shared_ptr<const RemoteBlockTemplate> GetBlockTemplate();
+	void SendFullBlock(RemoteClientConnection *client, const int64 blockid);
 	void SendServerStatus();
+	void SendServerStatus(RemoteClientConnection *client);
+	void SendMetaHashChallenge(RemoteClientConnection *client, const RemoteClientConnection::sentwork &work);
+	const int GetMetaHashChallenges() const									{ return m_metahashchallenges; }
 	void SendWorkToAllClients();
+	void RequestWorkForAllClients()											{ CRITICAL_BLOCK(m_cs) { m_sendworktoall=true; } }
+	const bool WorkForAllClientsRequested()									{ CRITICAL_BLOCK(m_cs) { return m_sendworktoall; } return false; }
+	const bool CheckTipChanged();
+	void CountMetaHash(const bool stale)									{ CRITICAL_BLOCK(m_cs) { m_metahashcount++; if(stale) { m_stalemetahashcount++; } } }
+
+	void StartTemplateBuilder();
+	void StopTemplateBuilder();
+	const bool TemplateFilled();
 
 	static const bool EncodeBase64(const std::vector<unsigned char> &data, std::string &encoded);
 	static const bool DecodeBase64(const std::string &encoded, std::vector<unsigned char> &decoded);
 
 	const int64 GetAllClientsCalculatedKHashFromMeta() const;
 	const int64 GetAllClientsCalculatedKHashFromBest() const;
+	void UpdateAllClientsCalculatedKHash();
 	
-	RemoteClientConnection *GetOldestNonVerifiedMetaHashClient();
+	RemoteClientConnection *GetMetaHashClientToVerify();
+	const int GetVerificationInterval(const RemoteClientConnection *client) const;
+	void MetaHashVerified(RemoteClientConnection *client, const int64 workid, const int64 mhindex, const bool valid);
+	RemoteClientConnection *GetClientByID(const int64 id);
 
-	int64 &GeneratedCount()													{ return m_generatedcount; }
+	void BlockGenerated()													{ CRITICAL_BLOCK(m_cs) { m_generatedcount++; ClearCurrentHashesContributed(); } }
 
 	void LoadContributedHashes();
 	void SaveContributedHashes();
 
-	void AddContributedHashes(const uint160 address, const int64 hashes)	{ m_currenthashescontributed[address]+=hashes; }
-	void ClearCurrentHashesContributed()									{ m_previoushashescontributed=m_currenthashescontributed; m_currenthashescontributed.clear(); }
+	void AddContributedHashes(const uint160 address, const int64 hashes)	{ CRITICAL_BLOCK(m_cs) { m_currenthashescontributed[address]+=hashes; } }
+	// hash rate of each address mining on the stratum frontend, counted with the clients of the address
+	void SetStratumKHash(const std::map<uint160,int64> &khash)				{ CRITICAL_BLOCK(m_cs) { m_stratumkhash=khash; } }
+
+	const bool CheckPassword(const std::string &password) const				{ return password==m_password; }
+	const bool IsBanned(const std::string &address) const					{ return m_banned.find(address)!=m_banned.end(); }
+	const int GetNTimeWindow() const										{ return m_ntimewindow; }
+	void ClearCurrentHashesContributed()									{ CRITICAL_BLOCK(m_cs) { m_previoushashescontributed=m_currenthashescontributed; m_currenthashescontributed.clear(); } }
 
 private:
-	void BlockToJson(const CBlock *block, json_spirit::Object &obj);
+	void HandleMessage(RemoteClientConnection *client, const RemoteMinerMessage &message);
+
+	const bool PublishBlockTemplate(const boost::shared_ptr<const RemoteBlockTemplate> &blocktemplate);
+	static void BuildBlockTemplate(RemoteBlockTemplate &blocktemplate, const bool withtransactions);
+	static void ThreadTemplateBuilder(void *arg);
+	static const std::string FullBlockHead(const CBlock *block, const RemoteBlockTemplate &blocktemplate);
+	static void TxToJson(const CTransaction &tx, json_spirit::Object &obj);
+	const bool AcceptClient(const SOCKET listensocket);
 	void ReadBanned(const std::string &filename);
 
-	void AddDistributionFromConnected(CBlock *pblock, CBlockIndex *pindexPrev, int64 nFees);
-	void AddDistributionFromContributed(CBlock *pblock, CBlockIndex *pindexPrev, int64 nFees);
+	void AddDistributionFromConnected(CTransaction &txCoinbase, CBlockIndex *pindexPrev, int64 nFees);
+	void AddDistributionFromContributed(CTransaction &txCoinbase, CBlockIndex *pindexPrev, int64 nFees);
 
 	CBigNum m_bnExtraNonce;
+	CCriticalSection m_cstemplate;
+	boost::shared_ptr<const RemoteBlockTemplate> m_blocktemplate;
+	bool m_templatefilled;				// the empty template for the current tip was replaced by a full one
+	bool m_templatebuilderrunning;
+	bool m_stoptemplatebuilder;
 
 #ifdef _WIN32
 	static bool m_wsastartup;
 #endif
 	std::string m_distributiontype;
+	std::string m_password;
+	std::string m_accounting;			// metahash or shares
 	std::vector<SOCKET> m_listensockets;
-	std::vector<RemoteClientConnection *> m_clients;
+	std::vector<RemoteClientConnection *> m_clients;		// only touched by the server thread
+	RemoteMessageWorkers m_workers;
+	MetaHashVerifier m_metahashverifier;
+	mutable CCriticalSection m_cs;		// everything below that the message workers share
+	bool m_sendworktoall;				// a found hash asked for new work for every client
+#ifdef _BITCOIN_REMOTE_EPOLL_
+	int m_epollfd;
+	std::vector<struct epoll_event> m_epollevents;
+#endif
 	std::map<uint160,uint256> m_previoushashescontributed;	// number of hashes each address contributed to the previous block solve
 	std::map<uint160,uint256> m_currenthashescontributed;		// number of hashes each address contributed since last block solve
 	std::set<std::string> m_banned;
 	time_t m_startuptime;
 	int64 m_generatedcount;
+	int m_metahashinterval;				// seconds between metahashes that client metahash sizes aim for
+	int m_metahashchallenges;			// metahash tree segments checked per verification, 0 verifies whole metahashes
+	int m_ntimewindow;					// seconds clients may roll nTime of the work they are sent on
+	int m_maxverifyinterval;			// longest time in seconds the most trusted client goes without verification
+	int64 m_allkhashmeta;				// hash rate of all clients, summed at most once a second by the server thread
+	int64 m_allkhashbest;
+	int64 m_allclients;
+	std::map<uint160,int64> m_connectedkhash;	// hash rate of each requested recipient address
+	std::map<uint160,int64> m_stratumkhash;
+
+	// verification results of every recipient address, kept across reconnects
+	struct addresstrust
+	{
+		addresstrust():m_passed(0),m_failed(0)	{ }
+		int64 m_passed;
+		int64 m_failed;
+	};
+	std::map<uint160,addresstrust> m_addresstrust;
+	unsigned int m_lasttipchanges;
+	int64 m_metahashcount;				// metahashes received since the last tip change
+	int64 m_stalemetahashcount;			// of those, the ones for work on an older tip
+	int64 m_totalmetahashcount;
+	int64 m_totalstalemetahashcount;
+
+	// server thread only, the last rates read from each client, kept for clients a worker is busy with
+	struct clientkhash
+	{
+		clientkhash():m_meta(0),m_best(0),m_hasaddress(false)	{ }
+		int64 m_meta;
+		int64 m_best;
+		uint160 m_address;
+		bool m_hasaddress;
+	};
+	std::map<int64,clientkhash> m_clientkhash;
+	time_t m_allkhashtime;
 
 };
 
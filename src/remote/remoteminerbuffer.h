@@ -0,0 +1,97 @@
+/**
+    Copyright (C) 2010  puddinpop
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+**/
+
+#ifndef _remoteminer_buffer_
+#define _remoteminer_buffer_
+
+#include <vector>
+#include <cstring>
+
+/*
+	Contiguous receive buffer with read and write cursors.  Consuming a
+	message only moves the read cursor, the unread bytes are moved back to
+	the front once when more room is needed for the next recv, so messages
+	can be parsed in place and a backlog of them costs linear time.
+*/
+class RemoteMinerBuffer
+{
+public:
+	typedef std::vector<char>::size_type size_type;
+
+	RemoteMinerBuffer():m_read(0),m_write(0)	{ }
+
+	const size_type Size() const				{ return m_write-m_read; }
+	const bool Empty() const					{ return m_write==m_read; }
+	const char *Data() const					{ return m_data.empty() ? 0 : &m_data[m_read]; }
+	const char operator[](const size_type pos) const	{ return m_data[m_read+pos]; }
+
+	void Clear()
+	{
+		m_read=0;
+		m_write=0;
+	}
+
+	void Consume(const size_type len)
+	{
+		m_read+=(len<Size() ? len : Size());
+		if(m_read==m_write)
+		{
+			Clear();
+		}
+	}
+
+	// returns room for at least len bytes at the write cursor, Commit the bytes actually written
+	char *Reserve(const size_type len)
+	{
+		if(m_data.size()-m_write<len)
+		{
+			if(m_read>0)
+			{
+				::memmove(&m_data[0],&m_data[m_read],Size());
+				m_write-=m_read;
+				m_read=0;
+			}
+			if(m_data.size()-m_write<len)
+			{
+				m_data.resize(m_write+len);
+			}
+		}
+		return &m_data[m_write];
+	}
+
+	void Commit(const size_type len)
+	{
+		m_write+=len;
+	}
+
+	void Append(const char *data, const size_type len)
+	{
+		if(len>0)
+		{
+			::memcpy(Reserve(len),data,len);
+			Commit(len);
+		}
+	}
+
+private:
+	std::vector<char> m_data;
+	size_type m_read;
+	size_type m_write;
+};
+
+#endif	// _remoteminer_buffer_
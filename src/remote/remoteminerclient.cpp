@@ -42,7 +42,7 @@ int OutputDebugStringF(const char* pszFormat, ...)
 	return 0;
 }
 
-RemoteMinerClient::RemoteMinerClient():m_socket(INVALID_SOCKET),m_tempbuffer(8192,0),m_gotserverhello(false),m_metahashsize(0)
+RemoteMinerClient::RemoteMinerClient():m_socket(INVALID_SOCKET),m_gotserverhello(false),m_metahashsize(0),m_protocolversion(REMOTEMINER_PROTOCOL_VERSION_JSON),m_sharemode(false),m_requestfullblock(false)
 {
 #ifdef _WIN32
 	if(m_wsastartup==false)
@@ -62,7 +62,10 @@ RemoteMinerClient::~RemoteMinerClient()
 const bool RemoteMinerClient::Connect(const std::string &server, const std::string &port)
 {
 	m_sendbuffer.clear();
-	m_receivebuffer.clear();
+	m_receivebuffer.Clear();
+	m_protocolversion=REMOTEMINER_PROTOCOL_VERSION_JSON;
+	m_sharemode=false;
+	m_metahashsegments.clear();
 
 	if(IsConnected()==true)
 	{
@@ -137,7 +140,7 @@ const bool RemoteMinerClient::DecodeBase64(const std::string &encoded, std::vect
 const bool RemoteMinerClient::Disconnect()
 {
 	m_sendbuffer.clear();
-	m_receivebuffer.clear();
+	m_receivebuffer.Clear();
 	if(IsConnected())
 	{
 		myclosesocket(m_socket);
@@ -234,15 +237,69 @@ const bool RemoteMinerClient::FindGenerationAddressInBlock(const uint160 address
 	return false;
 }
 
+// the server only sends the ids of the transactions after the coinbase, so the coinbase's merkle branch has
+// to lead to the block's merkle root, and the end of that root is in the block data we hash
+const bool RemoteMinerClient::CheckBlockMerkleRoot(json_spirit::Object &obj, const std::vector<unsigned char> &block) const
+{
+	json_spirit::Value tx=json_spirit::find_value(obj,"tx");
+	json_spirit::Value branch=json_spirit::find_value(obj,"mrkl_branch");
+	json_spirit::Value root=json_spirit::find_value(obj,"mrkl_root");
+	if(tx.type()!=json_spirit::array_type || tx.get_array().size()<1 || tx.get_array()[0].type()!=json_spirit::obj_type || branch.type()!=json_spirit::array_type || root.type()!=json_spirit::str_type || block.size()<4)
+	{
+		return false;
+	}
+
+	json_spirit::Value coinbasehash=json_spirit::find_value(tx.get_array()[0].get_obj(),"hash");
+	if(coinbasehash.type()!=json_spirit::str_type)
+	{
+		return false;
+	}
+
+	// the coinbase is at index 0, so it is always the left side
+	uint256 hash(coinbasehash.get_str());
+	json_spirit::Array brancharray=branch.get_array();
+	for(json_spirit::Array::iterator i=brancharray.begin(); i!=brancharray.end(); i++)
+	{
+		if((*i).type()!=json_spirit::str_type)
+		{
+			return false;
+		}
+		uint256 otherside((*i).get_str());
+		hash=Hash(BEGIN(hash),END(hash),BEGIN(otherside),END(otherside));
+	}
+
+	uint256 merkleroot(root.get_str());
+	if(hash!=merkleroot)
+	{
+		return false;
+	}
+
+	// the block data is byte swapped by word and starts with the last 4 bytes of the merkle root
+	const unsigned char *rootptr=merkleroot.begin();
+	return (block[0]==rootptr[31] && block[1]==rootptr[30] && block[2]==rootptr[29] && block[3]==rootptr[28]);
+}
+
 void RemoteMinerClient::HandleMessage(const RemoteMinerMessage &message)
 {
-	json_spirit::Value tval=json_spirit::find_value(message.GetValue().get_obj(),"type");
-	if(tval.type()==json_spirit::int_type)
+	int type=RemoteMinerMessage::MESSAGE_TYPE_NONE;
+	json_spirit::Value tval;
+	if(message.GetType(type))
 	{
-		std::cout << "Got message " << tval.get_int() << " from server." << std::endl;
-		if(tval.get_int()==RemoteMinerMessage::MESSAGE_TYPE_SERVERHELLO)
+		std::cout << "Got message " << type << " from server." << std::endl;
+		if(type==RemoteMinerMessage::MESSAGE_TYPE_SERVERHELLO && message.IsBinary()==false)
 		{
 			m_gotserverhello=true;
+			tval=json_spirit::find_value(message.GetValue().get_obj(),"protocolversion");
+			if(tval.type()==json_spirit::int_type && tval.get_int()>=REMOTEMINER_PROTOCOL_VERSION)
+			{
+				m_protocolversion=REMOTEMINER_PROTOCOL_VERSION;
+			}
+			tval=json_spirit::find_value(message.GetValue().get_obj(),"accounting");
+			if(tval.type()==json_spirit::str_type)
+			{
+				m_sharemode=(tval.get_str()=="shares");
+				std::cout << "Accounting : " << tval.get_str() << std::endl;
+			}
 			tval=json_spirit::find_value(message.GetValue().get_obj(),"metahashrate");
 			if(tval.type()==json_spirit::int_type)
 			{
@@ -267,36 +324,77 @@ void RemoteMinerClient::HandleMessage(const RemoteMinerMessage &message)
 				std::cout << "Distribution type : " << tval.get_str() << std::endl;
 			}
 		}
-		else if(tval.get_int()==RemoteMinerMessage::MESSAGE_TYPE_SERVERSENDWORK)
+		else if(type==RemoteMinerMessage::MESSAGE_TYPE_SERVERSENDWORK)
 		{
 			int64 nextblockid=0;
 			std::vector<unsigned char> nextblock;
 			std::vector<unsigned char> nextmidstate;
 			uint256 nexttarget;
-			tval=json_spirit::find_value(message.GetValue().get_obj(),"blockid");
-			if(tval.type()==json_spirit::int_type)
+			uint256 nextsharetarget=0;
+			unsigned int nextsegmentsize=0;
+			unsigned int nextmetahashsize=0;		// 0 uses the size from serverhello
+			unsigned int nextntimewindow=0;
+			if(message.IsBinary())
 			{
-				nextblockid=tval.get_int();
-			}
-			tval=json_spirit::find_value(message.GetValue().get_obj(),"block");
-			if(tval.type()==json_spirit::str_type)
-			{
-				DecodeBase64(tval.get_str(),nextblock);
-			}
-			tval=json_spirit::find_value(message.GetValue().get_obj(),"target");
-			if(tval.type()==json_spirit::str_type)
-			{
-				nexttarget.SetHex(tval.get_str());
+				RemoteMinerMessage::workrecord work;
+				if(work.Read(message.GetRecord()))
+				{
+					nextblockid=work.m_blockid;
+					nextblock.assign(work.m_block,work.m_block+64);
+					nextmidstate.assign(work.m_midstate,work.m_midstate+32);
+					::memcpy(nexttarget.begin(),work.m_target,32);
+					nextmetahashsize=work.m_metahashsize;
+					::memcpy(nextsharetarget.begin(),work.m_sharetarget,32);
+					nextsegmentsize=work.m_segmentsize;
+					nextntimewindow=work.m_ntimewindow;
+					json_spirit::read(work.m_fullblock,tval);
+				}
+				else
+				{
+					std::cout << "Server sent malformed work record." << std::endl;
+					return;
+				}
 			}
-			tval=json_spirit::find_value(message.GetValue().get_obj(),"midstate");
-			if(tval.type()==json_spirit::str_type)
+			else
 			{
-				DecodeBase64(tval.get_str(),nextmidstate);
+				tval=json_spirit::find_value(message.GetValue().get_obj(),"blockid");
+				if(tval.type()==json_spirit::int_type)
+				{
+					nextblockid=tval.get_int();
+				}
+				tval=json_spirit::find_value(message.GetValue().get_obj(),"block");
+				if(tval.type()==json_spirit::str_type)
+				{
+					DecodeBase64(tval.get_str(),nextblock);
+				}
+				tval=json_spirit::find_value(message.GetValue().get_obj(),"target");
+				if(tval.type()==json_spirit::str_type)
+				{
+					nexttarget.SetHex(tval.get_str());
+				}
+				tval=json_spirit::find_value(message.GetValue().get_obj(),"midstate");
+				if(tval.type()==json_spirit::str_type)
+				{
+					DecodeBase64(tval.get_str(),nextmidstate);
+				}
+
+				tval=json_spirit::find_value(message.GetValue().get_obj(),"fullblock");
 			}
 
-			tval=json_spirit::find_value(message.GetValue().get_obj(),"fullblock");
 			if(tval.type()==json_spirit::obj_type)
 			{
+				// compact blocks list the transactions after the coinbase by id only
+				if(json_spirit::find_value(tval.get_obj(),"txids").type()==json_spirit::array_type)
+				{
+					if(CheckBlockMerkleRoot(tval.get_obj(),nextblock)==false)
+					{
+						std::cout << "Merkle root of block being solved doesn't match its coinbase" << std::endl;
+					}
+					if(m_requestfullblock)
+					{
+						SendFullBlockRequest(nextblockid);
+					}
+				}
 				SaveBlock(tval.get_obj(),"block.txt");
 				if(m_address160!=0)
 				{
@@ -313,7 +411,16 @@ void RemoteMinerClient::HandleMessage(const RemoteMinerMessage &message)
 			}
 
 			//m_minerthread.SetNextBlock(nextblockid,nexttarget,nextblock,nextmidstate);
-			m_minerthreads.SetNextBlock(nextblockid,nexttarget,nextblock,nextmidstate);
+			m_minerthreads.SetNextBlock(nextblockid,nexttarget,nextblock,nextmidstate,nextmetahashsize,nextsharetarget,nextsegmentsize,nextntimewindow);
+
+			// the extranonce record follows the work if the server lets us roll it
+			m_extranoncework=extranoncework();
+			m_extranoncework.m_blockid=nextblockid;
+			m_extranoncework.m_target=nexttarget;
+			m_extranoncework.m_metahashsize=nextmetahashsize;
+			m_extranoncework.m_sharetarget=nextsharetarget;
+			m_extranoncework.m_segmentsize=nextsegmentsize;
+			m_extranoncework.m_ntimewindow=nextntimewindow;
 
 			/*
 			if(m_havework==false)
@@ -330,7 +437,49 @@ void RemoteMinerClient::HandleMessage(const RemoteMinerMessage &message)
 			m_havework=true;
 			*/
 		}
-		else if(tval.get_int()==RemoteMinerMessage::MESSAGE_TYPE_SERVERSTATUS)
+		else if(type==RemoteMinerMessage::MESSAGE_TYPE_SERVEREXTRANONCE && message.IsBinary())
+		{
+			RemoteMinerMessage::extranoncerecord en;
+			if(en.Read(message.GetRecord()))
+			{
+				if(en.m_blockid==m_extranoncework.m_blockid)
+				{
+					m_extranoncework.m_header.assign(en.m_header,en.m_header+80);
+					m_extranoncework.m_coinbase1.swap(en.m_coinbase1);
+					m_extranoncework.m_coinbase2.swap(en.m_coinbase2);
+					m_extranoncework.m_merklebranch.resize(en.m_merklebranch.size()/32);
+					for(std::vector<uint256>::size_type i=0; i<m_extranoncework.m_merklebranch.size(); i++)
+					{
+						::memcpy(m_extranoncework.m_merklebranch[i].begin(),&en.m_merklebranch[i*32],32);
+					}
+				}
+			}
+			else
+			{
+				std::cout << "Server sent malformed extranonce record." << std::endl;
+			}
+		}
+		else if(type==RemoteMinerMessage::MESSAGE_TYPE_SERVERFULLBLOCK && message.IsBinary()==false)
+		{
+			tval=json_spirit::find_value(message.GetValue().get_obj(),"fullblock");
+			if(tval.type()==json_spirit::obj_type)
+			{
+				SaveBlock(tval.get_obj(),"block.txt");
+			}
+		}
+		else if(type==RemoteMinerMessage::MESSAGE_TYPE_SERVERCHALLENGE && message.IsBinary())
+		{
+			RemoteMinerMessage::challengerecord challenge;
+			if(challenge.Read(message.GetRecord()))
+			{
+				SendProof(challenge);
+			}
+			else
+			{
+				std::cout << "Server sent malformed challenge record." << std::endl;
+			}
+		}
+		else if(type==RemoteMinerMessage::MESSAGE_TYPE_SERVERSTATUS)
 		{
 			int64 clients=0;
 			int64 khashmeta=0;
@@ -341,41 +490,60 @@ void RemoteMinerClient::HandleMessage(const RemoteMinerMessage &message)
 			std::string startuptimestr("");
 			int64 blocksgenerated=0;
 
-			tval=json_spirit::find_value(message.GetValue().get_obj(),"clients");
-			if(tval.type()==json_spirit::int_type)
+			if(message.IsBinary())
 			{
-				clients=tval.get_int();
-			}
-			tval=json_spirit::find_value(message.GetValue().get_obj(),"khashmeta");
-			if(tval.type()==json_spirit::int_type)
-			{
-				khashmeta=tval.get_int();
-			}
-			tval=json_spirit::find_value(message.GetValue().get_obj(),"khashbest");
-			if(tval.type()==json_spirit::int_type)
-			{
-				khashbest=tval.get_int();
+				RemoteMinerMessage::statusrecord status;
+				if(status.Read(message.GetRecord()))
+				{
+					clients=status.m_clients;
+					khashmeta=status.m_khashmeta;
+					khashbest=status.m_khashbest;
+					clientkhashmeta=status.m_yourkhashmeta;
+					startuptime=status.m_sessionstartuptime;
+					blocksgenerated=status.m_sessionblocksgenerated;
+				}
 			}
-			tval=json_spirit::find_value(message.GetValue().get_obj(),"yourkhashmeta");
-			if(tval.type()==json_spirit::int_type)
+			else
 			{
-				clientkhashmeta=tval.get_int();
+				tval=json_spirit::find_value(message.GetValue().get_obj(),"clients");
+				if(tval.type()==json_spirit::int_type)
+				{
+					clients=tval.get_int();
+				}
+				tval=json_spirit::find_value(message.GetValue().get_obj(),"khashmeta");
+				if(tval.type()==json_spirit::int_type)
+				{
+					khashmeta=tval.get_int();
+				}
+				tval=json_spirit::find_value(message.GetValue().get_obj(),"khashbest");
+				if(tval.type()==json_spirit::int_type)
+				{
+					khashbest=tval.get_int();
+				}
+				tval=json_spirit::find_value(message.GetValue().get_obj(),"yourkhashmeta");
+				if(tval.type()==json_spirit::int_type)
+				{
+					clientkhashmeta=tval.get_int();
+				}
+				tval=json_spirit::find_value(message.GetValue().get_obj(),"sessionstartuptime");
+				if(tval.type()==json_spirit::int_type)
+				{
+					startuptime=tval.get_int();
+				}
+				tval=json_spirit::find_value(message.GetValue().get_obj(),"sessionblocksgenerated");
+				if(tval.type()==json_spirit::int_type)
+				{
+					blocksgenerated=tval.get_int();
+				}
 			}
-			tval=json_spirit::find_value(message.GetValue().get_obj(),"sessionstartuptime");
-			if(tval.type()==json_spirit::int_type)
+			if(startuptime!=0)
 			{
-				startuptime=tval.get_int();
 				startuptimetm=*gmtime(&startuptime);
 				std::vector<char> buff(128,0);
 				int rval=strftime(&buff[0],buff.size()-1,"%Y-%m-%d %H:%M:%S",&startuptimetm);
 				buff.resize(rval);
 				startuptimestr=std::string(buff.begin(),buff.end());
 			}
-			tval=json_spirit::find_value(message.GetValue().get_obj(),"sessionblocksgenerated");
-			if(tval.type()==json_spirit::int_type)
-			{
-				blocksgenerated=tval.get_int();
-			}
 			
 			//std::cout << "Server Status : " << clients << " clients, " << khashmeta << " khash/s m " << khashbest << " khash/s b  " << std::endl;
 			std::cout << "Server Status : " << clients << " clients, " << khashmeta << " khash/s" << std::endl;
@@ -447,6 +615,9 @@ void RemoteMinerClient::Run(const std::string &server, const std::string &port,
 				//m_minerthread.Start();
 				m_minerthreads.Start(new threadtype);
 				m_gotserverhello=false;
+				// block ids start over with each connection
+				m_extranoncework=extranoncework();
+				m_replacedwork.clear();
 				//m_havework=false;
 				std::cout << "Connected to " << server << ":" << port << std::endl;
 				SendClientHello(password,address);
@@ -465,7 +636,7 @@ void RemoteMinerClient::Run(const std::string &server, const std::string &port,
 					RemoteMinerMessage message;
 					if(ReceiveMessage(message))
 					{
-						if(message.GetValue().type()==json_spirit::obj_type)
+						if(message.IsBinary() || message.GetValue().type()==json_spirit::obj_type)
 						{
 							HandleMessage(message);
 						}
@@ -503,6 +674,13 @@ void RemoteMinerClient::Run(const std::string &server, const std::string &port,
 					SendWorkRequest();
 				}
 
+				while(m_minerthreads.HaveShare())
+				{
+					RemoteMinerThread::foundhash share;
+					m_minerthreads.GetShare(share);
+					SendShare(share.m_blockid,share.m_nonce);
+				}
+
 				//while(m_minerthread.HaveHashResult())
 				while(m_minerthreads.HaveHashResult())
 				{
@@ -510,28 +688,51 @@ void RemoteMinerClient::Run(const std::string &server, const std::string &port,
 					//m_minerthread.GetHashResult(hresult);
 					m_minerthreads.GetHashResult(hresult);
 
-					//SHA256(hresult.m_metahashptr,m_metahashsize,&mhdigest[0]);
-
-					SendMetaHash(hresult.m_blockid,hresult.m_metahashstartnonce,hresult.m_metahashdigest,hresult.m_besthash,hresult.m_besthashnonce);
-
-					//m_minerthread.AddMetaHashPointer(hresult.m_metahashptr);
+					if(m_sharemode==false)
+					{
+						SendMetaHash(hresult.m_blockid,hresult.m_metahashstartnonce,hresult.m_metahashdigest,hresult.m_besthash,hresult.m_besthashnonce);
+						if(hresult.m_segments.size()>0)
+						{
+							metahashsegments segments;
+							segments.m_blockid=hresult.m_blockid;
+							segments.m_startnonce=hresult.m_metahashstartnonce;
+							segments.m_leaves.swap(hresult.m_segments);
+							m_metahashsegments.push_back(segments);
+							while(m_metahashsegments.size()>64)
+							{
+								m_metahashsegments.pop_front();
+							}
+						}
+					}
 
 					//debug
 					//std::cout << "sent result " << hresult.m_blockid << " " << hresult.m_metahashstartnonce << " " << hresult.m_besthashnonce << std::endl;
-					hashcount+=m_metahashsize;
+					hashcount+=hresult.m_metahashsize;
 
-					if(hresult.m_metahashstartnonce>4000000000 && (lastrequestedwork+5000)<GetTimeMillis())
+					// work running out of nonces that can't roll nTime any more is replaced once by work with the next extranonce, or else by new work from the server
+					if(hresult.m_metahashstartnonce>4000000000 && hresult.m_rollstime==false && m_replacedwork.find(hresult.m_blockid)==m_replacedwork.end())
 					{
-						std::cout << "Requesting a new block " << GetTimeMillis() << std::endl;
-						SendWorkRequest();
-						lastrequestedwork=GetTimeMillis();
+						if(RollExtraNonce())
+						{
+							if(m_replacedwork.size()>=1024)
+							{
+								m_replacedwork.clear();
+							}
+							m_replacedwork.insert(hresult.m_blockid);
+						}
+						else if((lastrequestedwork+5000)<GetTimeMillis())
+						{
+							std::cout << "Requesting a new block " << GetTimeMillis() << std::endl;
+							SendWorkRequest();
+							lastrequestedwork=GetTimeMillis();
+						}
 					}
 				}
 			}
 			//else
 			if(m_minerthreads.NeedWork())
 			{
-				if((lastrequestedwork+5000)<GetTimeMillis())
+				if(RollExtraNonce()==false && (lastrequestedwork+5000)<GetTimeMillis())
 				{
 					std::cout << "Requesting a new block " << GetTimeMillis() << std::endl;
 					SendWorkRequest();
@@ -568,6 +769,11 @@ void RemoteMinerClient::SendClientHello(const std::string &password, const std::
 	
 	obj.push_back(json_spirit::Pair("type",RemoteMinerMessage::MESSAGE_TYPE_CLIENTHELLO));
 	obj.push_back(json_spirit::Pair("password",password));
+	obj.push_back(json_spirit::Pair("protocolversion",REMOTEMINER_PROTOCOL_VERSION));
+	obj.push_back(json_spirit::Pair("shares",threadtype::ReportsShares()));
+	obj.push_back(json_spirit::Pair("metahashtree",true));
+	obj.push_back(json_spirit::Pair("compactblock",true));
+	obj.push_back(json_spirit::Pair("extranonce",true));
 	if(address!="")
 	{
 		uint160 h160;
@@ -583,6 +789,17 @@ void RemoteMinerClient::SendClientHello(const std::string &password, const std::
 
 void RemoteMinerClient::SendFoundHash(const int64 blockid, const unsigned int nonce)
 {
+	if(m_protocolversion>=REMOTEMINER_PROTOCOL_VERSION)
+	{
+		RemoteMinerMessage::foundhashrecord fhash;
+		std::vector<unsigned char> record;
+		fhash.m_blockid=blockid;
+		fhash.m_nonce=nonce;
+		fhash.Write(record);
+		SendMessage(RemoteMinerMessage(record));
+		return;
+	}
+
 	json_spirit::Object obj;
 	
 	obj.push_back(json_spirit::Pair("type",static_cast<int>(RemoteMinerMessage::MESSAGE_TYPE_CLIENTFOUNDHASH)));
@@ -594,11 +811,25 @@ void RemoteMinerClient::SendFoundHash(const int64 blockid, const unsigned int no
 
 void RemoteMinerClient::SendMessage(const RemoteMinerMessage &message)
 {
-	message.PushWireData(m_sendbuffer);
+	message.PushWireData(m_sendbuffer,m_protocolversion);
 }
 
 void RemoteMinerClient::SendMetaHash(const int64 blockid, const unsigned int startnonce, const std::vector<unsigned char> &digest, const uint256 &besthash, const unsigned int besthashnonce)
 {
+	if(m_protocolversion>=REMOTEMINER_PROTOCOL_VERSION && digest.size()==32)
+	{
+		RemoteMinerMessage::metahashrecord mhash;
+		std::vector<unsigned char> record;
+		mhash.m_blockid=blockid;
+		mhash.m_startnonce=startnonce;
+		::memcpy(mhash.m_digest,&digest[0],32);
+		::memcpy(mhash.m_besthash,(const unsigned char *)&besthash,32);
+		mhash.m_besthashnonce=besthashnonce;
+		mhash.Write(record);
+		SendMessage(RemoteMinerMessage(record));
+		return;
+	}
+
 	std::string digeststr("");
 
 	EncodeBase64(digest,digeststr);
@@ -613,6 +844,47 @@ void RemoteMinerClient::SendMetaHash(const int64 blockid, const unsigned int sta
 	SendMessage(RemoteMinerMessage(obj));
 }
 
+// shares only exist with the binary records, the server never asks a JSON client for them
+void RemoteMinerClient::SendShare(const int64 blockid, const unsigned int nonce)
+{
+	if(m_protocolversion>=REMOTEMINER_PROTOCOL_VERSION)
+	{
+		RemoteMinerMessage::sharerecord share;
+		std::vector<unsigned char> record;
+		share.m_blockid=blockid;
+		share.m_nonce=nonce;
+		share.Write(record);
+		SendMessage(RemoteMinerMessage(record));
+	}
+}
+
+void RemoteMinerClient::SendProof(const RemoteMinerMessage::challengerecord &challenge)
+{
+	for(std::deque<metahashsegments>::const_reverse_iterator i=m_metahashsegments.rbegin(); i!=m_metahashsegments.rend(); i++)
+	{
+		if((*i).m_blockid==challenge.m_blockid && (*i).m_startnonce==challenge.m_startnonce)
+		{
+			RemoteMinerMessage::proofrecord proof;
+			std::vector<unsigned char> record;
+			unsigned int leafcount=(*i).m_leaves.size()/32;
+			proof.m_blockid=challenge.m_blockid;
+			proof.m_startnonce=challenge.m_startnonce;
+			for(std::vector<unsigned int>::const_iterator j=challenge.m_segments.begin(); j!=challenge.m_segments.end() && (*j)<leafcount; j++)
+			{
+				RemoteMinerMessage::proofrecord::segmentproof segment;
+				segment.m_index=(*j);
+				::memcpy(segment.m_digest,&(*i).m_leaves[(*j)*32],32);
+				MetaHashTree::GetBranch((*i).m_leaves,(*j),segment.m_branch);
+				proof.m_proofs.push_back(segment);
+			}
+			proof.Write(record);
+			SendMessage(RemoteMinerMessage(record));
+			return;
+		}
+	}
+	std::cout << "Server challenged a metahash that is no longer kept." << std::endl;
+}
+
 void RemoteMinerClient::SendWorkRequest()
 {
 	json_spirit::Object obj;
@@ -621,14 +893,69 @@ void RemoteMinerClient::SendWorkRequest()
 	SendMessage(RemoteMinerMessage(obj));
 }
 
+// makes work from the newest work the server sent with the next extranonce in its coinbase
+const bool RemoteMinerClient::RollExtraNonce()
+{
+	if(m_extranoncework.m_header.size()!=80 || m_extranoncework.m_extranonce>=RemoteMinerMessage::MAX_EXTRANONCE)
+	{
+		return false;
+	}
+
+	const unsigned int extranonce=++m_extranoncework.m_extranonce;
+	std::vector<unsigned char> coinbase(m_extranoncework.m_coinbase1);
+	for(int b=0; b<4; b++)
+	{
+		coinbase.push_back((extranonce >> (b*8)) & 0xff);
+	}
+	coinbase.insert(coinbase.end(),m_extranoncework.m_coinbase2.begin(),m_extranoncework.m_coinbase2.end());
+
+	// the coinbase is at index 0, so it is always the left side
+	uint256 merkleroot=Hash(coinbase.begin(),coinbase.end());
+	for(std::vector<uint256>::const_iterator i=m_extranoncework.m_merklebranch.begin(); i!=m_extranoncework.m_merklebranch.end(); i++)
+	{
+		merkleroot=Hash(BEGIN(merkleroot),END(merkleroot),BEGIN(*i),END(*i));
+	}
+
+	// the header padded to two SHA-256 blocks and byte swapped by word, the same way the server prepares it
+	unsigned int data[32];
+	::memset(data,0,sizeof(data));
+	::memcpy(data,&m_extranoncework.m_header[0],80);
+	::memcpy(((unsigned char *)data)+36,merkleroot.begin(),32);
+	((unsigned char *)data)[80]=0x80;
+	((unsigned char *)data)[126]=0x02;		// 640 bits
+	((unsigned char *)data)[127]=0x80;
+	for(int i=0; i<32; i++)
+	{
+		data[i]=CryptoPP::ByteReverse(data[i]);
+	}
+
+	CryptoPP::word32 midstate[8];
+	CryptoPP::SHA256::InitState(midstate);
+	CryptoPP::SHA256::Transform(midstate,data);
+
+	std::vector<unsigned char> block(((unsigned char *)data)+64,((unsigned char *)data)+128);
+	std::vector<unsigned char> mid((unsigned char *)midstate,((unsigned char *)midstate)+32);
+	m_minerthreads.SetNextBlock(RemoteMinerMessage::ExtraNonceBlockID(m_extranoncework.m_blockid,extranonce),m_extranoncework.m_target,block,mid,m_extranoncework.m_metahashsize,m_extranoncework.m_sharetarget,m_extranoncework.m_segmentsize,m_extranoncework.m_ntimewindow);
+	return true;
+}
+
+void RemoteMinerClient::SendFullBlockRequest(const int64 blockid)
+{
+	json_spirit::Object obj;
+	obj.push_back(json_spirit::Pair("type",RemoteMinerMessage::MESSAGE_TYPE_CLIENTGETFULLBLOCK));
+	obj.push_back(json_spirit::Pair("blockid",static_cast<boost::int64_t>(blockid)));
+
+	SendMessage(RemoteMinerMessage(obj));
+}
+
 void RemoteMinerClient::SocketReceive()
 {
 	if(IsConnected())
 	{
-		int len=::recv(m_socket,&m_tempbuffer[0],m_tempbuffer.size(),0);
+		int len=::recv(m_socket,m_receivebuffer.Reserve(8192),8192,0);
 		if(len>0)
 		{
-			m_receivebuffer.insert(m_receivebuffer.end(),m_tempbuffer.begin(),m_tempbuffer.begin()+len);
+			m_receivebuffer.Commit(len);
 		}
 		else
 		{
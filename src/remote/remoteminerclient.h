@@ -21,6 +21,8 @@
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <set>
 
 #ifdef _WIN32
 	#include <winsock2.h>
@@ -41,6 +43,9 @@ public:
 
 	virtual void Run(const std::string &server, const std::string &port, const std::string &password, const std::string &address, const int threadcount=1);
 
+	// ask the server for every transaction of the blocks being worked on, not just their ids
+	void SetRequestFullBlock(const bool request)	{ m_requestfullblock=request; }
+
 	const bool Connect(const std::string &server, const std::string &port);
 	const bool Disconnect();
 	const bool IsConnected() const		{ return m_socket!=INVALID_SOCKET; }
@@ -65,11 +70,16 @@ protected:
 	void SendClientHello(const std::string &password, const std::string &address);
 	void SendMetaHash(const int64 blockid, const unsigned int startnonce, const std::vector<unsigned char> &digest, const uint256 &besthash, const unsigned int besthashnonce);
 	void SendWorkRequest();
+	void SendFullBlockRequest(const int64 blockid);
+	const bool RollExtraNonce();
 	void SendFoundHash(const int64 blockid, const unsigned int nonce);
+	void SendShare(const int64 blockid, const unsigned int nonce);
+	void SendProof(const RemoteMinerMessage::challengerecord &challenge);
 
 	void HandleMessage(const RemoteMinerMessage &message);
 
 	const bool FindGenerationAddressInBlock(const uint160 address, json_spirit::Object &obj, double &amount) const;
+	const bool CheckBlockMerkleRoot(json_spirit::Object &obj, const std::vector<unsigned char> &block) const;
 	const std::string ReverseAddressHex(const uint160 address) const;
 
 	void SaveBlock(json_spirit::Object &block, const std::string &filename);
@@ -77,13 +87,43 @@ protected:
 	uint160 m_address160;
 	bool m_gotserverhello;
 	SOCKET m_socket;
-	std::vector<char> m_receivebuffer;
+	RemoteMinerBuffer m_receivebuffer;
 	std::vector<char> m_sendbuffer;
-	std::vector<char> m_tempbuffer;
 	fd_set m_readfs;
 	fd_set m_writefs;
 	struct timeval m_timeval;
 	unsigned int m_metahashsize;
+	int m_protocolversion;
+	bool m_sharemode;				// server accounts our work with shares, metahashes aren't sent
+	bool m_requestfullblock;
+
+	// leaves of the metahash trees sent most recently, kept to answer challenges from the server
+	struct metahashsegments
+	{
+		int64 m_blockid;
+		unsigned int m_startnonce;
+		std::vector<unsigned char> m_leaves;
+	};
+	std::deque<metahashsegments> m_metahashsegments;
+
+	// the newest work from the server and its coinbase split around the extranonce, new work is made from it without asking the server
+	struct extranoncework
+	{
+		extranoncework():m_blockid(0),m_target(0),m_metahashsize(0),m_sharetarget(0),m_segmentsize(0),m_ntimewindow(0),m_extranonce(0)	{ }
+		int64 m_blockid;
+		uint256 m_target;
+		unsigned int m_metahashsize;
+		uint256 m_sharetarget;
+		unsigned int m_segmentsize;
+		unsigned int m_ntimewindow;
+		std::vector<unsigned char> m_header;		// empty until the server sends the extranonce record for the work
+		std::vector<unsigned char> m_coinbase1;
+		std::vector<unsigned char> m_coinbase2;
+		std::vector<uint256> m_merklebranch;
+		unsigned int m_extranonce;					// the last extranonce used
+	};
+	extranoncework m_extranoncework;
+	std::set<int64> m_replacedwork;					// work that already had extranonce work made to replace it when it ran out of nonces
 
 /*
 #if  defined(_BITCOIN_MINER_CUDA_)
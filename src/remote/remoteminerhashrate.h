@@ -0,0 +1,77 @@
+/**
+    Copyright (C) 2010  puddinpop
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+**/
+
+#ifndef _remoteminer_hashrate_
+#define _remoteminer_hashrate_
+
+#include "remotebitcoinheaders.h"
+#include <algorithm>
+#include <ctime>
+#include <vector>
+
+/*
+	Sum of the values added over the last window seconds, kept in a ring of
+	buckets with a running total.  Adding and reading are constant time, the
+	buckets that fell out of the window are cleared as time moves on.
+*/
+class HashRateWindow
+{
+public:
+	HashRateWindow(const int windowseconds, const int buckets):m_bucketseconds((std::max)(windowseconds/buckets,1)),m_buckets(buckets,0),m_total(0),m_lastbucket(0)	{ }
+
+	void Add(const time_t now, const int64 value)
+	{
+		Advance(now);
+		m_buckets[m_lastbucket%m_buckets.size()]+=value;
+		m_total+=value;
+	}
+
+	const int64 GetTotal(const time_t now) const
+	{
+		Advance(now);
+		return m_total;
+	}
+
+	const int GetWindowSeconds() const		{ return m_bucketseconds*m_buckets.size(); }
+
+private:
+	void Advance(const time_t now) const
+	{
+		int64 bucket=static_cast<int64>(now)/m_bucketseconds;
+		if(bucket<=m_lastbucket)
+		{
+			return;
+		}
+		// buckets that weren't touched since last time are cleared, at most the whole ring
+		int64 first=(std::max)(m_lastbucket+1,bucket-static_cast<int64>(m_buckets.size())+1);
+		for(int64 b=first; b<=bucket; b++)
+		{
+			m_total-=m_buckets[b%m_buckets.size()];
+			m_buckets[b%m_buckets.size()]=0;
+		}
+		m_lastbucket=bucket;
+	}
+
+	int m_bucketseconds;
+	mutable std::vector<int64> m_buckets;
+	mutable int64 m_total;
+	mutable int64 m_lastbucket;
+
+};
+
+#endif	// _remoteminer_hashrate_
@@ -17,61 +17,65 @@
 **/
 
 #include "remoteminermessage.h"
+#include "../json/json_spirit_reader_template.h"
 
-RemoteMinerMessage::RemoteMinerMessage()
+#include <cstring>
+
+RemoteMinerMessage::RemoteMinerMessage():m_binary(false),m_version(REMOTEMINER_PROTOCOL_VERSION)
 {
 
 }
 
-RemoteMinerMessage::RemoteMinerMessage(const json_spirit::Value &value):m_value(value)
+RemoteMinerMessage::RemoteMinerMessage(const json_spirit::Value &value):m_value(value),m_binary(false),m_version(REMOTEMINER_PROTOCOL_VERSION)
 {
 
 }
 
-RemoteMinerMessage::~RemoteMinerMessage()
+RemoteMinerMessage::RemoteMinerMessage(const std::vector<unsigned char> &record):m_record(record),m_binary(true),m_version(REMOTEMINER_PROTOCOL_VERSION)
 {
 
 }
 
-const std::vector<char> RemoteMinerMessage::GetWireData() const
+RemoteMinerMessage::~RemoteMinerMessage()
 {
-	char flags=0;
-	std::string jsonstr=json_spirit::write(m_value);
-	std::vector<char> data;
-	data.push_back(REMOTEMINER_PROTOCOL_VERSION);			// protocol version;
-
-	if(jsonstr.size()>=65535)
-	{
-		flags|=FLAG_4BYTESIZE;
-	}
 
-	data.push_back(flags);
+}
 
-	if((flags & FLAG_4BYTESIZE)!=FLAG_4BYTESIZE)
+const bool RemoteMinerMessage::GetType(int &type) const
+{
+	if(m_binary)
 	{
-		data.push_back((jsonstr.size() >> 8) & 0xff);			// size
-		data.push_back(jsonstr.size() & 0xff);					// size
+		if(m_record.size()>0)
+		{
+			type=m_record[0];
+			return true;
+		}
 	}
-	else
+	else if(m_value.type()==json_spirit::obj_type)
 	{
-		data.push_back((jsonstr.size() >> 24) & 0xff);
-		data.push_back((jsonstr.size() >> 16) & 0xff);
-		data.push_back((jsonstr.size() >> 8) & 0xff);
-		data.push_back(jsonstr.size() & 0xff);
+		json_spirit::Value val=json_spirit::find_value(m_value.get_obj(),"type");
+		if(val.type()==json_spirit::int_type)
+		{
+			type=val.get_int();
+			return true;
+		}
 	}
+	return false;
+}
 
-	data.insert(data.end(),jsonstr.begin(),jsonstr.end());	// json object
-
+const std::vector<char> RemoteMinerMessage::GetWireData(const int version) const
+{
+	std::vector<char> data;
+	PushWireData(data,version);
 	return data;
 }
 
-bool RemoteMinerMessage::MessageReady(const std::vector<char> &buffer)
+const bool RemoteMinerMessage::GetFrameSize(const RemoteMinerBuffer &buffer, unsigned long &headersize, unsigned long &messagesize)
 {
-	if(buffer.size()>4 && buffer[0]==REMOTEMINER_PROTOCOL_VERSION)
+	if(buffer.Size()>4 && IsKnownVersion(buffer[0]))
 	{
 		char flags=buffer[1];
-		unsigned long messagesize=0;
-		unsigned long headersize=4;
+		messagesize=0;
 
 		if((flags & FLAG_4BYTESIZE)!=FLAG_4BYTESIZE)
 		{
@@ -81,7 +85,7 @@ bool RemoteMinerMessage::MessageReady(const std::vector<char> &buffer)
 		}
 		else
 		{
-			if(buffer.size()>=6)
+			if(buffer.Size()>=6)
 			{
 				headersize=6;
 				messagesize|=(buffer[2] << 24) & 0xff000000;
@@ -95,18 +99,23 @@ bool RemoteMinerMessage::MessageReady(const std::vector<char> &buffer)
 			}
 		}
 
-		if(buffer.size()>=headersize+messagesize)
-		{
-			return true;
-		}
+		return true;
 	}
 
 	return false;
 }
 
-bool RemoteMinerMessage::ProtocolError(const std::vector<char> &buffer)
+bool RemoteMinerMessage::MessageReady(const RemoteMinerBuffer &buffer)
+{
+	unsigned long headersize=0;
+	unsigned long messagesize=0;
+
+	return GetFrameSize(buffer,headersize,messagesize) && buffer.Size()>=headersize+messagesize;
+}
+
+bool RemoteMinerMessage::ProtocolError(const RemoteMinerBuffer &buffer)
 {
-	if(buffer.size()>0 && buffer[0]!=REMOTEMINER_PROTOCOL_VERSION)
+	if(buffer.Size()>0 && !IsKnownVersion(buffer[0]))
 	{
 		return true;
 	}
@@ -116,14 +125,41 @@ bool RemoteMinerMessage::ProtocolError(const std::vector<char> &buffer)
 	}
 }
 
-void RemoteMinerMessage::PushWireData(std::vector<char> &buffer) const
+void RemoteMinerMessage::PushWireData(std::vector<char> &buffer, const int version) const
+{
+	std::string jsonstr("");
+	std::vector<char>::size_type size=m_record.size();
+
+	if(m_binary==false)
+	{
+		jsonstr=json_spirit::write(m_value);
+		size=jsonstr.size();
+	}
+
+	PushWireHeader(buffer,size,m_binary,version);
+
+	if(m_binary)
+	{
+		buffer.insert(buffer.end(),m_record.begin(),m_record.end());
+	}
+	else
+	{
+		buffer.insert(buffer.end(),jsonstr.begin(),jsonstr.end());
+	}
+}
+
+void RemoteMinerMessage::PushWireHeader(std::vector<char> &buffer, const std::vector<char>::size_type size, const bool binary, const int version)
 {
 	char flags=0;
-	std::string jsonstr=json_spirit::write(m_value);
 
-	buffer.push_back(REMOTEMINER_PROTOCOL_VERSION);
+	if(binary)
+	{
+		flags|=FLAG_BINARY;
+	}
+
+	buffer.push_back(version);
 
-	if(jsonstr.size()>=65535)
+	if(size>=65535)
 	{
 		flags|=FLAG_4BYTESIZE;
 	}
@@ -132,62 +168,358 @@ void RemoteMinerMessage::PushWireData(std::vector<char> &buffer) const
 
 	if((flags & FLAG_4BYTESIZE)!=FLAG_4BYTESIZE)
 	{
-		buffer.push_back((jsonstr.size() >> 8) & 0xff);			// size
-		buffer.push_back(jsonstr.size() & 0xff);					// size
+		buffer.push_back((size >> 8) & 0xff);			// size
+		buffer.push_back(size & 0xff);					// size
 	}
 	else
 	{
-		buffer.push_back((jsonstr.size() >> 24) & 0xff);
-		buffer.push_back((jsonstr.size() >> 16) & 0xff);
-		buffer.push_back((jsonstr.size() >> 8) & 0xff);
-		buffer.push_back(jsonstr.size() & 0xff);
+		buffer.push_back((size >> 24) & 0xff);
+		buffer.push_back((size >> 16) & 0xff);
+		buffer.push_back((size >> 8) & 0xff);
+		buffer.push_back(size & 0xff);
 	}
-
-	buffer.insert(buffer.end(),jsonstr.begin(),jsonstr.end());
 }
 
-bool RemoteMinerMessage::ReceiveMessage(std::vector<char> &buffer, RemoteMinerMessage &message)
+// the message is parsed straight out of the buffer and then consumed
+bool RemoteMinerMessage::ReceiveMessage(RemoteMinerBuffer &buffer, RemoteMinerMessage &message)
 {
-	if(MessageReady(buffer)==true)
+	unsigned long headersize=0;
+	unsigned long messagesize=0;
+
+	if(GetFrameSize(buffer,headersize,messagesize) && buffer.Size()>=headersize+messagesize)
 	{
+		char version=buffer[0];
 		char flags=buffer[1];
-		unsigned long messagesize=0;
-		unsigned long headersize=4;
+		const char *begin=buffer.Data()+headersize;
+		const char *end=begin+messagesize;
+		bool read=false;
 
-		if((flags & FLAG_4BYTESIZE)!=FLAG_4BYTESIZE)
-		{
-			headersize=4;
-			messagesize|=(buffer[2] << 8) & 0xff00;
-			messagesize|=(buffer[3]) & 0xff;
-		}
-		else
+		if((flags & FLAG_BINARY)==FLAG_BINARY)
 		{
-			if(buffer.size()>=6)
-			{
-				headersize=6;
-				messagesize|=(buffer[2] << 24) & 0xff000000;
-				messagesize|=(buffer[3] << 16) & 0xff0000;
-				messagesize|=(buffer[4] << 8) & 0xff00;
-				messagesize|=buffer[5] & 0xff;
-			}
-			else
+			// binary records are not part of the JSON only protocol
+			read=(version>=REMOTEMINER_PROTOCOL_VERSION && messagesize>0);
+			if(read)
 			{
-				return false;
+				message=RemoteMinerMessage(std::vector<unsigned char>(begin,end));
 			}
 		}
-
-		if(buffer.size()>=headersize+messagesize)
+		else
 		{
-			std::string objstr(buffer.begin()+headersize,buffer.begin()+headersize+messagesize);
 			json_spirit::Value value;
-			bool jsonread=json_spirit::read(objstr,value);
-			if(jsonread)
+			read=json_spirit::read_range(begin,end,value);
+			if(read)
 			{
 				message=RemoteMinerMessage(value);
 			}
-			buffer.erase(buffer.begin(),buffer.begin()+headersize+messagesize);
-			return jsonread;
 		}
+		message.m_version=version;
+		buffer.Consume(headersize+messagesize);
+		return read;
 	}
 	return false;
 }
+
+void RemoteMinerMessage::PutInt(std::vector<unsigned char> &record, const boost::uint64_t val, const int bytes)
+{
+	for(int i=0; i<bytes; i++)
+	{
+		record.push_back((val >> (i*8)) & 0xff);
+	}
+}
+
+void RemoteMinerMessage::PutBytes(std::vector<unsigned char> &record, const unsigned char *data, const int bytes)
+{
+	record.insert(record.end(),data,data+bytes);
+}
+
+const boost::uint64_t RemoteMinerMessage::GetInt(const std::vector<unsigned char> &record, std::vector<unsigned char>::size_type &pos, const int bytes)
+{
+	boost::uint64_t val=0;
+	for(int i=0; i<bytes; i++)
+	{
+		val|=static_cast<boost::uint64_t>(record[pos++]) << (i*8);
+	}
+	return val;
+}
+
+void RemoteMinerMessage::GetBytes(const std::vector<unsigned char> &record, std::vector<unsigned char>::size_type &pos, unsigned char *data, const int bytes)
+{
+	::memcpy(data,&record[pos],bytes);
+	pos+=bytes;
+}
+
+void RemoteMinerMessage::metahashrecord::Write(std::vector<unsigned char> &record) const
+{
+	record.clear();
+	record.reserve(81);
+	PutInt(record,MESSAGE_TYPE_CLIENTMETAHASH,1);
+	PutInt(record,m_blockid,8);
+	PutInt(record,m_startnonce,4);
+	PutBytes(record,m_digest,32);
+	PutBytes(record,m_besthash,32);
+	PutInt(record,m_besthashnonce,4);
+}
+
+const bool RemoteMinerMessage::metahashrecord::Read(const std::vector<unsigned char> &record)
+{
+	std::vector<unsigned char>::size_type pos=1;
+	if(record.size()!=81 || record[0]!=MESSAGE_TYPE_CLIENTMETAHASH)
+	{
+		return false;
+	}
+	m_blockid=GetInt(record,pos,8);
+	m_startnonce=GetInt(record,pos,4);
+	GetBytes(record,pos,m_digest,32);
+	GetBytes(record,pos,m_besthash,32);
+	m_besthashnonce=GetInt(record,pos,4);
+	return true;
+}
+
+void RemoteMinerMessage::foundhashrecord::Write(std::vector<unsigned char> &record) const
+{
+	record.clear();
+	PutInt(record,MESSAGE_TYPE_CLIENTFOUNDHASH,1);
+	PutInt(record,m_blockid,8);
+	PutInt(record,m_nonce,4);
+}
+
+const bool RemoteMinerMessage::foundhashrecord::Read(const std::vector<unsigned char> &record)
+{
+	std::vector<unsigned char>::size_type pos=1;
+	if(record.size()!=13 || record[0]!=MESSAGE_TYPE_CLIENTFOUNDHASH)
+	{
+		return false;
+	}
+	m_blockid=GetInt(record,pos,8);
+	m_nonce=GetInt(record,pos,4);
+	return true;
+}
+
+void RemoteMinerMessage::sharerecord::Write(std::vector<unsigned char> &record) const
+{
+	record.clear();
+	PutInt(record,MESSAGE_TYPE_CLIENTSHARE,1);
+	PutInt(record,m_blockid,8);
+	PutInt(record,m_nonce,4);
+}
+
+const bool RemoteMinerMessage::sharerecord::Read(const std::vector<unsigned char> &record)
+{
+	std::vector<unsigned char>::size_type pos=1;
+	if(record.size()!=13 || record[0]!=MESSAGE_TYPE_CLIENTSHARE)
+	{
+		return false;
+	}
+	m_blockid=GetInt(record,pos,8);
+	m_nonce=GetInt(record,pos,4);
+	return true;
+}
+
+void RemoteMinerMessage::challengerecord::Write(std::vector<unsigned char> &record) const
+{
+	record.clear();
+	PutInt(record,MESSAGE_TYPE_SERVERCHALLENGE,1);
+	PutInt(record,m_blockid,8);
+	PutInt(record,m_startnonce,4);
+	PutInt(record,m_segments.size(),1);
+	for(std::vector<unsigned int>::const_iterator i=m_segments.begin(); i!=m_segments.end(); i++)
+	{
+		PutInt(record,(*i),4);
+	}
+}
+
+const bool RemoteMinerMessage::challengerecord::Read(const std::vector<unsigned char> &record)
+{
+	std::vector<unsigned char>::size_type pos=1;
+	if(record.size()<14 || record[0]!=MESSAGE_TYPE_SERVERCHALLENGE)
+	{
+		return false;
+	}
+	m_blockid=GetInt(record,pos,8);
+	m_startnonce=GetInt(record,pos,4);
+	unsigned int count=GetInt(record,pos,1);
+	if(record.size()-pos!=count*4)
+	{
+		return false;
+	}
+	m_segments.resize(count);
+	for(unsigned int i=0; i<count; i++)
+	{
+		m_segments[i]=GetInt(record,pos,4);
+	}
+	return true;
+}
+
+void RemoteMinerMessage::proofrecord::Write(std::vector<unsigned char> &record) const
+{
+	record.clear();
+	PutInt(record,MESSAGE_TYPE_CLIENTPROOF,1);
+	PutInt(record,m_blockid,8);
+	PutInt(record,m_startnonce,4);
+	PutInt(record,m_proofs.size(),1);
+	for(std::vector<segmentproof>::const_iterator i=m_proofs.begin(); i!=m_proofs.end(); i++)
+	{
+		PutInt(record,(*i).m_index,4);
+		PutBytes(record,(*i).m_digest,32);
+		PutInt(record,(*i).m_branch.size()/32,1);
+		if((*i).m_branch.size()>0)
+		{
+			PutBytes(record,&(*i).m_branch[0],((*i).m_branch.size()/32)*32);
+		}
+	}
+}
+
+const bool RemoteMinerMessage::proofrecord::Read(const std::vector<unsigned char> &record)
+{
+	std::vector<unsigned char>::size_type pos=1;
+	if(record.size()<14 || record[0]!=MESSAGE_TYPE_CLIENTPROOF)
+	{
+		return false;
+	}
+	m_blockid=GetInt(record,pos,8);
+	m_startnonce=GetInt(record,pos,4);
+	unsigned int count=GetInt(record,pos,1);
+	m_proofs.resize(count);
+	for(unsigned int i=0; i<count; i++)
+	{
+		if(record.size()-pos<37)
+		{
+			return false;
+		}
+		m_proofs[i].m_index=GetInt(record,pos,4);
+		GetBytes(record,pos,m_proofs[i].m_digest,32);
+		unsigned int depth=GetInt(record,pos,1);
+		if(record.size()-pos<depth*32)
+		{
+			return false;
+		}
+		m_proofs[i].m_branch.assign(record.begin()+pos,record.begin()+pos+depth*32);
+		pos+=depth*32;
+	}
+	return pos==record.size();
+}
+
+void RemoteMinerMessage::workrecord::Write(std::vector<unsigned char> &record) const
+{
+	record.reserve(185+m_fullblock.size());
+	WriteFixed(record,m_fullblock.size());
+	record.insert(record.end(),m_fullblock.begin(),m_fullblock.end());
+}
+
+void RemoteMinerMessage::workrecord::WriteFixed(std::vector<unsigned char> &record, const boost::uint64_t fullblocksize) const
+{
+	record.clear();
+	PutInt(record,MESSAGE_TYPE_SERVERSENDWORK,1);
+	PutInt(record,m_blockid,8);
+	PutBytes(record,m_block,64);
+	PutBytes(record,m_midstate,32);
+	PutBytes(record,m_target,32);
+	PutInt(record,m_metahashsize,4);
+	PutBytes(record,m_sharetarget,32);
+	PutInt(record,m_segmentsize,4);
+	PutInt(record,m_ntimewindow,4);
+	PutInt(record,fullblocksize,4);
+}
+
+const bool RemoteMinerMessage::workrecord::Read(const std::vector<unsigned char> &record)
+{
+	std::vector<unsigned char>::size_type pos=1;
+	if(record.size()<185 || record[0]!=MESSAGE_TYPE_SERVERSENDWORK)
+	{
+		return false;
+	}
+	m_blockid=GetInt(record,pos,8);
+	GetBytes(record,pos,m_block,64);
+	GetBytes(record,pos,m_midstate,32);
+	GetBytes(record,pos,m_target,32);
+	m_metahashsize=GetInt(record,pos,4);
+	GetBytes(record,pos,m_sharetarget,32);
+	m_segmentsize=GetInt(record,pos,4);
+	m_ntimewindow=GetInt(record,pos,4);
+	boost::uint64_t fullblocksize=GetInt(record,pos,4);
+	if(record.size()-pos!=fullblocksize)
+	{
+		return false;
+	}
+	m_fullblock.assign(record.begin()+pos,record.end());
+	return true;
+}
+
+void RemoteMinerMessage::extranoncerecord::Write(std::vector<unsigned char> &record) const
+{
+	record.clear();
+	record.reserve(103+m_coinbase1.size()+m_coinbase2.size()+m_merklebranch.size());
+	PutInt(record,MESSAGE_TYPE_SERVEREXTRANONCE,1);
+	PutInt(record,m_blockid,8);
+	PutBytes(record,m_header,80);
+	PutInt(record,m_coinbase1.size(),4);
+	record.insert(record.end(),m_coinbase1.begin(),m_coinbase1.end());
+	PutInt(record,m_coinbase2.size(),4);
+	record.insert(record.end(),m_coinbase2.begin(),m_coinbase2.end());
+	PutInt(record,m_merklebranch.size()/32,1);
+	record.insert(record.end(),m_merklebranch.begin(),m_merklebranch.begin()+(m_merklebranch.size()/32)*32);
+}
+
+const bool RemoteMinerMessage::extranoncerecord::Read(const std::vector<unsigned char> &record)
+{
+	std::vector<unsigned char>::size_type pos=1;
+	if(record.size()<98 || record[0]!=MESSAGE_TYPE_SERVEREXTRANONCE)
+	{
+		return false;
+	}
+	m_blockid=GetInt(record,pos,8);
+	GetBytes(record,pos,m_header,80);
+	unsigned int size=GetInt(record,pos,4);
+	if(record.size()-pos<static_cast<std::vector<unsigned char>::size_type>(size)+4)
+	{
+		return false;
+	}
+	m_coinbase1.assign(record.begin()+pos,record.begin()+pos+size);
+	pos+=size;
+	size=GetInt(record,pos,4);
+	if(record.size()-pos<static_cast<std::vector<unsigned char>::size_type>(size)+1)
+	{
+		return false;
+	}
+	m_coinbase2.assign(record.begin()+pos,record.begin()+pos+size);
+	pos+=size;
+	unsigned int depth=GetInt(record,pos,1);
+	if(record.size()-pos!=depth*32)
+	{
+		return false;
+	}
+	m_merklebranch.assign(record.begin()+pos,record.end());
+	return true;
+}
+
+void RemoteMinerMessage::statusrecord::Write(std::vector<unsigned char> &record) const
+{
+	record.clear();
+	PutInt(record,MESSAGE_TYPE_SERVERSTATUS,1);
+	PutInt(record,m_time,8);
+	PutInt(record,m_clients,8);
+	PutInt(record,m_khashmeta,8);
+	PutInt(record,m_khashbest,8);
+	PutInt(record,m_sessionstartuptime,8);
+	PutInt(record,m_sessionblocksgenerated,8);
+	PutInt(record,m_yourkhashmeta,8);
+	PutInt(record,m_yourkhashbest,8);
+}
+
+const bool RemoteMinerMessage::statusrecord::Read(const std::vector<unsigned char> &record)
+{
+	std::vector<unsigned char>::size_type pos=1;
+	if(record.size()!=65 || record[0]!=MESSAGE_TYPE_SERVERSTATUS)
+	{
+		return false;
+	}
+	m_time=GetInt(record,pos,8);
+	m_clients=GetInt(record,pos,8);
+	m_khashmeta=GetInt(record,pos,8);
+	m_khashbest=GetInt(record,pos,8);
+	m_sessionstartuptime=GetInt(record,pos,8);
+	m_sessionblocksgenerated=GetInt(record,pos,8);
+	m_yourkhashmeta=GetInt(record,pos,8);
+	m_yourkhashbest=GetInt(record,pos,8);
+	return true;
+}
@@ -20,25 +20,47 @@
 #define _remote_miner_message_
 
 #include "../json/json_spirit.h"
+#include "remoteminerbuffer.h"
+#include <boost/cstdint.hpp>
 #include <vector>
+#include <string>
 
-const int REMOTEMINER_PROTOCOL_VERSION=2;
+// version 3 adds binary records for the frequent messages, version 2 is JSON only
+const int REMOTEMINER_PROTOCOL_VERSION=3;
+const int REMOTEMINER_PROTOCOL_VERSION_JSON=2;
 
 class RemoteMinerMessage
 {
 public:
 	RemoteMinerMessage();
 	RemoteMinerMessage(const json_spirit::Value &value);
+	RemoteMinerMessage(const std::vector<unsigned char> &record);
 	~RemoteMinerMessage();
 
 	const json_spirit::Value GetValue() const		{ return m_value; }
+	const std::vector<unsigned char> &GetRecord() const	{ return m_record; }
+	const bool IsBinary() const						{ return m_binary; }
+	const int GetVersion() const					{ return m_version; }
+	const bool GetType(int &type) const;
 
-	const std::vector<char> GetWireData() const;
-	void PushWireData(std::vector<char> &buffer) const;
+	// binary records can only be framed with version 3 or later
+	const std::vector<char> GetWireData(const int version=REMOTEMINER_PROTOCOL_VERSION) const;
+	void PushWireData(std::vector<char> &buffer, const int version=REMOTEMINER_PROTOCOL_VERSION) const;
+	// frame header for a message of size bytes that is put together by the caller
+	static void PushWireHeader(std::vector<char> &buffer, const std::vector<char>::size_type size, const bool binary, const int version=REMOTEMINER_PROTOCOL_VERSION);
 
-	static bool MessageReady(const std::vector<char> &buffer);
-	static bool ReceiveMessage(std::vector<char> &buffer, RemoteMinerMessage &message);
-	static bool ProtocolError(const std::vector<char> &buffer);
+	static bool MessageReady(const RemoteMinerBuffer &buffer);
+	static bool ReceiveMessage(RemoteMinerBuffer &buffer, RemoteMinerMessage &message);
+	static bool ProtocolError(const RemoteMinerBuffer &buffer);
+
+	// ids of work the client made itself, bits 0-31 are the id of the work the server sent, which stays below 2^32,
+	// bits 32-51 the extranonce the client rolled and bits 52-62 the seconds the client rolled nTime on
+	static const boost::int64_t ExtraNonceBlockID(const boost::int64_t blockid, const unsigned int extranonce)	{ return blockid|(static_cast<boost::int64_t>(extranonce)<<32); }
+	static const boost::int64_t RolledTimeBlockID(const boost::int64_t blockid, const unsigned int seconds)		{ return blockid|(static_cast<boost::int64_t>(seconds)<<52); }
+	static const unsigned int MAX_EXTRANONCE=0xfffff;
+	static const unsigned int MAX_ROLLEDTIME=0x7ff;
+	// challenge and proof records carry the segment count in one byte
+	static const unsigned int MAX_CHALLENGES=0xff;
 
 	enum RemoteMinerMessageType
 	{
@@ -53,16 +75,151 @@ public:
 		MESSAGE_TYPE_CLIENTMETAHASH=8,
 		MESSAGE_TYPE_CLIENTFOUNDHASH=9,
 		MESSAGE_TYPE_SERVERSTATUS=10,
+		MESSAGE_TYPE_CLIENTSHARE=11,
+		MESSAGE_TYPE_SERVERCHALLENGE=12,
+		MESSAGE_TYPE_CLIENTPROOF=13,
+		MESSAGE_TYPE_CLIENTGETFULLBLOCK=14,
+		MESSAGE_TYPE_SERVERFULLBLOCK=15,
+		MESSAGE_TYPE_SERVEREXTRANONCE=16,
 		MESSAGE_TYPE_MAX
 	};
 
 	enum Flag
 	{
 		FLAG_4BYTESIZE=1,
+		FLAG_BINARY=2,
+	};
+
+	/*
+		Fixed layout records sent with FLAG_BINARY.  Every record starts with
+		its message type byte, integers are little endian and hashes are the
+		32 bytes of the uint256 in the order bitcoin serializes them.
+	*/
+	struct metahashrecord
+	{
+		boost::int64_t m_blockid;
+		unsigned int m_startnonce;
+		unsigned char m_digest[32];
+		unsigned char m_besthash[32];
+		unsigned int m_besthashnonce;
+
+		void Write(std::vector<unsigned char> &record) const;
+		const bool Read(const std::vector<unsigned char> &record);
+	};
+
+	struct foundhashrecord
+	{
+		boost::int64_t m_blockid;
+		unsigned int m_nonce;
+
+		void Write(std::vector<unsigned char> &record) const;
+		const bool Read(const std::vector<unsigned char> &record);
+	};
+
+	// a nonce whose hash meets the share target of the work it was found on
+	struct sharerecord
+	{
+		boost::int64_t m_blockid;
+		unsigned int m_nonce;
+
+		void Write(std::vector<unsigned char> &record) const;
+		const bool Read(const std::vector<unsigned char> &record);
+	};
+
+	// segments of a metahash tree the client has to prove
+	struct challengerecord
+	{
+		boost::int64_t m_blockid;
+		unsigned int m_startnonce;
+		std::vector<unsigned int> m_segments;
+
+		void Write(std::vector<unsigned char> &record) const;
+		const bool Read(const std::vector<unsigned char> &record);
+	};
+
+	// digest and merkle branch of each challenged segment, in the order they were challenged
+	struct proofrecord
+	{
+		struct segmentproof
+		{
+			unsigned int m_index;
+			unsigned char m_digest[32];
+			std::vector<unsigned char> m_branch;
+		};
+
+		boost::int64_t m_blockid;
+		unsigned int m_startnonce;
+		std::vector<segmentproof> m_proofs;
+
+		void Write(std::vector<unsigned char> &record) const;
+		const bool Read(const std::vector<unsigned char> &record);
+	};
+
+	// the full block follows the fixed part as JSON text
+	// a share target of 0 means the work is accounted with metahashes
+	// a segment size of 0 means the metahash is a plain digest instead of a metahash tree root
+	// the client may move nTime up to ntimewindow seconds on once it runs out of nonces
+	struct workrecord
+	{
+		boost::int64_t m_blockid;
+		unsigned char m_block[64];
+		unsigned char m_midstate[32];
+		unsigned char m_target[32];
+		unsigned int m_metahashsize;
+		unsigned char m_sharetarget[32];
+		unsigned int m_segmentsize;
+		unsigned int m_ntimewindow;
+		std::string m_fullblock;
+
+		void Write(std::vector<unsigned char> &record) const;
+		// everything up to the full block, which the caller sends after it
+		void WriteFixed(std::vector<unsigned char> &record, const boost::uint64_t fullblocksize) const;
+		const bool Read(const std::vector<unsigned char> &record);
+	};
+
+	// sent after the work record to clients that roll the extranonce themselves
+	// the coinbase is split around the 4 byte little endian extranonce, the header is serialized with a nonce of 0
+	struct extranoncerecord
+	{
+		boost::int64_t m_blockid;
+		unsigned char m_header[80];
+		std::vector<unsigned char> m_coinbase1;
+		std::vector<unsigned char> m_coinbase2;
+		std::vector<unsigned char> m_merklebranch;	// 32 bytes for each level of the coinbase's branch
+
+		void Write(std::vector<unsigned char> &record) const;
+		const bool Read(const std::vector<unsigned char> &record);
+	};
+
+	struct statusrecord
+	{
+		boost::int64_t m_time;
+		boost::int64_t m_clients;
+		boost::int64_t m_khashmeta;
+		boost::int64_t m_khashbest;
+		boost::int64_t m_sessionstartuptime;
+		boost::int64_t m_sessionblocksgenerated;
+		boost::int64_t m_yourkhashmeta;
+		boost::int64_t m_yourkhashbest;
+
+		void Write(std::vector<unsigned char> &record) const;
+		const bool Read(const std::vector<unsigned char> &record);
 	};
 
 private:
+	static const bool GetFrameSize(const RemoteMinerBuffer &buffer, unsigned long &headersize, unsigned long &messagesize);
+
+	static void PutInt(std::vector<unsigned char> &record, const boost::uint64_t val, const int bytes);
+	static void PutBytes(std::vector<unsigned char> &record, const unsigned char *data, const int bytes);
+	static const boost::uint64_t GetInt(const std::vector<unsigned char> &record, std::vector<unsigned char>::size_type &pos, const int bytes);
+	static void GetBytes(const std::vector<unsigned char> &record, std::vector<unsigned char>::size_type &pos, unsigned char *data, const int bytes);
+
+	static const bool IsKnownVersion(const char version)	{ return version==REMOTEMINER_PROTOCOL_VERSION_JSON || version==REMOTEMINER_PROTOCOL_VERSION; }
+
 	json_spirit::Value m_value;
+	std::vector<unsigned char> m_record;
+	bool m_binary;
+	int m_version;
 };
 
 #endif	// _remote_miner_message_
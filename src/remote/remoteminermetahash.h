@@ -0,0 +1,212 @@
+/**
+    Copyright (C) 2010  puddinpop
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+**/
+
+#ifndef _remoteminer_metahash_
+#define _remoteminer_metahash_
+
+#include <openssl/sha.h>
+#include <cstring>
+#include <vector>
+
+/*
+	SHA-256 of a metahash, built up one byte per nonce as the bytes are
+	produced so the whole metahash never has to be held in memory.
+*/
+class MetaHashDigest
+{
+public:
+	MetaHashDigest()					{ Reset(); }
+
+	void Reset()
+	{
+		SHA256_Init(&m_ctx);
+		m_blockpos=0;
+	}
+
+	void Add(const unsigned char val)
+	{
+		m_block[m_blockpos++]=val;
+		if(m_blockpos==sizeof(m_block))
+		{
+			SHA256_Update(&m_ctx,m_block,sizeof(m_block));
+			m_blockpos=0;
+		}
+	}
+
+	// writes the digest of everything added since the last Reset and starts over
+	void Final(std::vector<unsigned char> &digest)
+	{
+		if(m_blockpos>0)
+		{
+			SHA256_Update(&m_ctx,m_block,m_blockpos);
+		}
+		digest.resize(SHA256_DIGEST_LENGTH,0);
+		SHA256_Final(&digest[0],&m_ctx);
+		Reset();
+	}
+
+private:
+	SHA256_CTX m_ctx;
+	unsigned char m_block[64];
+	unsigned int m_blockpos;
+
+};
+
+/*
+	Metahash split into segments of a fixed number of nonces.  The digest of
+	each segment is a leaf of a merkle tree and the root is sent in place of
+	the metahash digest, so the server can challenge a few segments and
+	recompute only those.  Leaves are kept as one array of 32 byte digests,
+	an odd leaf at the end of a level is paired with itself.  With a segment
+	size of 0 this is the plain digest of the whole metahash.
+*/
+class MetaHashTree
+{
+public:
+	MetaHashTree():m_segmentsize(0),m_segmentpos(0)		{ }
+
+	void Reset(const unsigned int segmentsize)
+	{
+		m_digest.Reset();
+		m_leaves.clear();
+		m_segmentsize=segmentsize;
+		m_segmentpos=0;
+	}
+
+	void Add(const unsigned char val)
+	{
+		m_digest.Add(val);
+		if(m_segmentsize>0 && ++m_segmentpos==m_segmentsize)
+		{
+			AddLeaf();
+		}
+	}
+
+	// writes the root and leaves of everything added since the last Reset and starts over with the same segment size
+	void Final(std::vector<unsigned char> &root, std::vector<unsigned char> &leaves)
+	{
+		leaves.clear();
+		if(m_segmentsize==0)
+		{
+			m_digest.Final(root);
+		}
+		else
+		{
+			if(m_segmentpos>0)
+			{
+				AddLeaf();
+			}
+			GetRoot(m_leaves,root);
+			leaves.swap(m_leaves);
+		}
+		Reset(m_segmentsize);
+	}
+
+	static const unsigned int GetDepth(unsigned int leafcount)
+	{
+		unsigned int depth=0;
+		while(leafcount>1)
+		{
+			leafcount=(leafcount+1)/2;
+			depth++;
+		}
+		return depth;
+	}
+
+	static void GetRoot(const std::vector<unsigned char> &leaves, std::vector<unsigned char> &root)
+	{
+		root=leaves;
+		while(root.size()>SHA256_DIGEST_LENGTH)
+		{
+			NextLevel(root);
+		}
+		root.resize(SHA256_DIGEST_LENGTH,0);
+	}
+
+	static void GetBranch(const std::vector<unsigned char> &leaves, unsigned int index, std::vector<unsigned char> &branch)
+	{
+		std::vector<unsigned char> level(leaves);
+		branch.clear();
+		while(level.size()>SHA256_DIGEST_LENGTH)
+		{
+			unsigned int sibling=(index^1)<level.size()/SHA256_DIGEST_LENGTH ? (index^1) : index;
+			branch.insert(branch.end(),level.begin()+sibling*SHA256_DIGEST_LENGTH,level.begin()+(sibling+1)*SHA256_DIGEST_LENGTH);
+			NextLevel(level);
+			index>>=1;
+		}
+	}
+
+	static const bool CheckBranch(const unsigned char *leaf, unsigned int index, const std::vector<unsigned char> &branch, const unsigned char *root)
+	{
+		unsigned char hash[SHA256_DIGEST_LENGTH];
+		unsigned char pair[SHA256_DIGEST_LENGTH*2];
+		if(branch.size()%SHA256_DIGEST_LENGTH!=0)
+		{
+			return false;
+		}
+		::memcpy(hash,leaf,SHA256_DIGEST_LENGTH);
+		for(std::vector<unsigned char>::size_type pos=0; pos<branch.size(); pos+=SHA256_DIGEST_LENGTH)
+		{
+			if(index & 1)
+			{
+				::memcpy(pair,&branch[pos],SHA256_DIGEST_LENGTH);
+				::memcpy(pair+SHA256_DIGEST_LENGTH,hash,SHA256_DIGEST_LENGTH);
+			}
+			else
+			{
+				::memcpy(pair,hash,SHA256_DIGEST_LENGTH);
+				::memcpy(pair+SHA256_DIGEST_LENGTH,&branch[pos],SHA256_DIGEST_LENGTH);
+			}
+			SHA256(pair,sizeof(pair),hash);
+			index>>=1;
+		}
+		return ::memcmp(hash,root,SHA256_DIGEST_LENGTH)==0;
+	}
+
+private:
+	void AddLeaf()
+	{
+		std::vector<unsigned char> digest;
+		m_digest.Final(digest);
+		m_leaves.insert(m_leaves.end(),digest.begin(),digest.end());
+		m_segmentpos=0;
+	}
+
+	static void NextLevel(std::vector<unsigned char> &level)
+	{
+		std::vector<unsigned char>::size_type count=level.size()/SHA256_DIGEST_LENGTH;
+		std::vector<unsigned char> next(((count+1)/2)*SHA256_DIGEST_LENGTH,0);
+		unsigned char pair[SHA256_DIGEST_LENGTH*2];
+		for(std::vector<unsigned char>::size_type i=0; i<count; i+=2)
+		{
+			std::vector<unsigned char>::size_type right=(i+1<count) ? i+1 : i;
+			::memcpy(pair,&level[i*SHA256_DIGEST_LENGTH],SHA256_DIGEST_LENGTH);
+			::memcpy(pair+SHA256_DIGEST_LENGTH,&level[right*SHA256_DIGEST_LENGTH],SHA256_DIGEST_LENGTH);
+			SHA256(pair,sizeof(pair),&next[(i/2)*SHA256_DIGEST_LENGTH]);
+		}
+		level.swap(next);
+	}
+
+	MetaHashDigest m_digest;
+	std::vector<unsigned char> m_leaves;
+	unsigned int m_segmentsize;
+	unsigned int m_segmentpos;
+
+};
+
+#endif	// _remoteminer_metahash_
@@ -5,6 +5,8 @@
 
 #include "remotebitcoinheaders.h"
 #include "../cryptopp/sha.h"
+#include "remoteminermetahash.h"
+#include "remoteminermessage.h"
 #include <limits>
 
 class RemoteMinerThread
@@ -22,23 +24,21 @@ public:
 			Stop();
 		}
 
-		FreeMetaHashPointers();
-
 	}
 
 	struct hashresult
 	{
-		hashresult():m_blockid(0),m_besthash(0),m_besthashnonce(0),m_metahashstartnonce(0),m_metahashptr(0)	{ }
-		//hashresult(int64 blockid, uint256 besthash, unsigned int besthashnonce, std::vector<unsigned char> &metahashdigest, unsigned int metahashstartnonce):m_blockid(blockid),m_besthash(besthash),m_besthashnonce(besthashnonce),m_metahashdigest(metahashdigest),m_metahashstartnonce(metahashstartnonce)	{ }
-		hashresult(int64 blockid, uint256 besthash, unsigned int besthashnonce, unsigned char *metahashptr, unsigned int metahashstartnonce):m_blockid(blockid),m_besthash(besthash),m_besthashnonce(besthashnonce),m_metahashptr(metahashptr),m_metahashstartnonce(metahashstartnonce) { }
+		hashresult():m_blockid(0),m_besthash(0),m_besthashnonce(0),m_metahashstartnonce(0),m_metahashsize(0),m_rollstime(false)	{ }
+		hashresult(int64 blockid, uint256 besthash, unsigned int besthashnonce, std::vector<unsigned char> &metahashdigest, unsigned int metahashstartnonce, unsigned int metahashsize):m_blockid(blockid),m_besthash(besthash),m_besthashnonce(besthashnonce),m_metahashdigest(metahashdigest),m_metahashstartnonce(metahashstartnonce),m_metahashsize(metahashsize),m_rollstime(false)	{ }
 
 		int64 m_blockid;
 		uint256 m_besthash;
 		unsigned int m_besthashnonce;
 		std::vector<unsigned char> m_metahashdigest;
 		unsigned int m_metahashstartnonce;
-
-		unsigned char *m_metahashptr;
+		unsigned int m_metahashsize;
+		std::vector<unsigned char> m_segments;		// metahash tree leaves, empty for a plain metahash digest
+		bool m_rollstime;							// the thread goes on with a later nTime when the work runs out of nonces
 	};
 
 	struct foundhash
@@ -56,7 +56,6 @@ public:
 		m_threaddata.m_havework=false;
 		m_threaddata.m_generate=true;
 		m_threaddata.m_nextblock.m_blockid=0;
-		FreeMetaHashPointers();
 		if(!CreateThread(RemoteMinerThread::Run,&m_threaddata))
 		{
 			m_threaddata.m_done=true;
@@ -65,7 +64,7 @@ public:
 		return true;
 	}
 
-	void Stop()		{ CRITICAL_BLOCK(m_threaddata.m_cs); m_threaddata.m_generate=false; }
+	void Stop()		{ CRITICAL_BLOCK(m_threaddata.m_cs) { m_threaddata.m_generate=false; } }
 
 	const bool Done()
 	{
@@ -74,79 +73,104 @@ public:
 
 	const bool HaveHashResult()
 	{
-		CRITICAL_BLOCK(m_threaddata.m_cs);
-		return (m_threaddata.m_hashresults.size()>0);
+		CRITICAL_BLOCK(m_threaddata.m_cs)
+		{
+			return (m_threaddata.m_hashresults.size()>0);
+		}
+		return false;
 	}
 
 	const bool GetHashResult(hashresult &result)
 	{
-		CRITICAL_BLOCK(m_threaddata.m_cs);
-		if(m_threaddata.m_hashresults.size()>0)
+		CRITICAL_BLOCK(m_threaddata.m_cs)
 		{
-			result=m_threaddata.m_hashresults[0];
-			m_threaddata.m_hashresults.erase(m_threaddata.m_hashresults.begin());
-			return true;
+			if(m_threaddata.m_hashresults.size()>0)
+			{
+				result=m_threaddata.m_hashresults[0];
+				m_threaddata.m_hashresults.erase(m_threaddata.m_hashresults.begin());
+				return true;
+			}
 		}
 		return false;
 	}
 
 	const bool HaveFoundHash()
 	{
-		CRITICAL_BLOCK(m_threaddata.m_cs);
-		return (m_threaddata.m_foundhashes.size()>0);
+		CRITICAL_BLOCK(m_threaddata.m_cs)
+		{
+			return (m_threaddata.m_foundhashes.size()>0);
+		}
+		return false;
 	}
 
 	const bool GetFoundHash(foundhash &hash)
 	{
-		CRITICAL_BLOCK(m_threaddata.m_cs);
-		if(m_threaddata.m_foundhashes.size()>0)
+		CRITICAL_BLOCK(m_threaddata.m_cs)
 		{
-			hash=m_threaddata.m_foundhashes[0];
-			m_threaddata.m_foundhashes.erase(m_threaddata.m_foundhashes.begin());
-			return true;
+			if(m_threaddata.m_foundhashes.size()>0)
+			{
+				hash=m_threaddata.m_foundhashes[0];
+				m_threaddata.m_foundhashes.erase(m_threaddata.m_foundhashes.begin());
+				return true;
+			}
 		}
 		return false;
 	}
 
-	const bool HasWork()
+	const bool HaveShare()
 	{
-		CRITICAL_BLOCK(m_threaddata.m_cs);
-		return m_threaddata.m_havework;
+		CRITICAL_BLOCK(m_threaddata.m_cs)
+		{
+			return (m_threaddata.m_shares.size()>0);
+		}
+		return false;
 	}
 
-	void SetNextBlock(const int64 blockid, uint256 target, std::vector<unsigned char> &block, std::vector<unsigned char> &midstate)
+	const bool GetShare(foundhash &share)
 	{
-		CRITICAL_BLOCK(m_threaddata.m_cs);
-		m_threaddata.m_nextblock.m_blockid=blockid;
-		m_threaddata.m_nextblock.m_target=target;
-		m_threaddata.m_nextblock.m_block=block;
-		m_threaddata.m_nextblock.m_midstate=midstate;
-		m_threaddata.m_havework=true;
+		CRITICAL_BLOCK(m_threaddata.m_cs)
+		{
+			if(m_threaddata.m_shares.size()>0)
+			{
+				share=m_threaddata.m_shares[0];
+				m_threaddata.m_shares.erase(m_threaddata.m_shares.begin());
+				return true;
+			}
+		}
+		return false;
 	}
 
-	void SetMetaHashSize(const unsigned int size)
-	{
-		CRITICAL_BLOCK(m_threaddata.m_cs);
-		m_threaddata.m_metahashsize=size;
-	}
+	// threads that check every hash against the share target can be accounted with shares instead of metahashes
+	static const bool ReportsShares()	{ return false; }
 
-	void AddMetaHashPointer(unsigned char *ptr)
+	const bool HasWork()
 	{
-		CRITICAL_BLOCK(m_threaddata.m_cs);
-		m_threaddata.m_metahashptrs.push_back(ptr);
+		CRITICAL_BLOCK(m_threaddata.m_cs)
+		{
+			return m_threaddata.m_havework;
+		}
+		return false;
 	}
 
-protected:
-	static void Run(void *arg)	{ CRITICAL_BLOCK(((threaddata *)arg)->m_cs); ((threaddata *)arg)->m_done=true; }
-
-	void FreeMetaHashPointers()
+	void SetNextBlock(const int64 blockid, uint256 target, std::vector<unsigned char> &block, std::vector<unsigned char> &midstate, const unsigned int metahashsize, const uint256 &sharetarget, const unsigned int segmentsize, const unsigned int ntimewindow)
 	{
-		for(std::vector<unsigned char *>::iterator i=m_threaddata.m_metahashptrs.begin(); i!=m_threaddata.m_metahashptrs.end(); i++)
+		CRITICAL_BLOCK(m_threaddata.m_cs)
 		{
-			delete [] (*i);
+			m_threaddata.m_nextblock.m_blockid=blockid;
+			m_threaddata.m_nextblock.m_target=target;
+			m_threaddata.m_nextblock.m_block=block;
+			m_threaddata.m_nextblock.m_midstate=midstate;
+			m_threaddata.m_nextblock.m_metahashsize=metahashsize;
+			m_threaddata.m_nextblock.m_sharetarget=sharetarget;
+			m_threaddata.m_nextblock.m_segmentsize=segmentsize;
+			m_threaddata.m_nextblock.m_ntimewindow=ntimewindow;
+			m_threaddata.m_havework=true;
 		}
 	}
 
+protected:
+	static void Run(void *arg)	{ CRITICAL_BLOCK(((threaddata *)arg)->m_cs) { ((threaddata *)arg)->m_done=true; } }
+
 	static inline void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 	{
 		::memcpy(pstate, pinit, 32);
@@ -168,12 +192,29 @@ protected:
 		return blocks;
 	}
 
+	// moves nTime in the byte swapped block a second on, as long as the work allows
+	static const bool RollTime(unsigned char *block, unsigned int &timeoffset, const unsigned int ntimewindow)
+	{
+		if(timeoffset>=ntimewindow || timeoffset>=RemoteMinerMessage::MAX_ROLLEDTIME)
+		{
+			return false;
+		}
+		unsigned int *ntime=((unsigned int *)block)+1;
+		(*ntime)=CryptoPP::ByteReverse(CryptoPP::ByteReverse(*ntime)+1);
+		timeoffset++;
+		return true;
+	}
+
 	struct nextblock
 	{
 		int64 m_blockid;
 		uint256 m_target;
 		std::vector<unsigned char> m_midstate;
 		std::vector<unsigned char> m_block;
+		unsigned int m_metahashsize;		// each block can use its own metahash size
+		uint256 m_sharetarget;				// 0 when the work isn't accounted with shares
+		unsigned int m_segmentsize;			// nonces per metahash tree segment, 0 for a plain metahash digest
+		unsigned int m_ntimewindow;			// seconds nTime can be rolled on
 	};
 
 	struct threaddata
@@ -182,11 +223,10 @@ protected:
 		bool m_generate;
 		bool m_done;
 		bool m_havework;
-		int m_metahashsize;
 		nextblock m_nextblock;
 		std::vector<hashresult> m_hashresults;
 		std::vector<foundhash> m_foundhashes;
-		std::vector<unsigned char *> m_metahashptrs;
+		std::vector<foundhash> m_shares;
 	};
 
 	threaddata m_threaddata;
@@ -264,10 +304,6 @@ public:
 		{
 			if((*i)->GetHashResult(hashresult))
 			{
-				hashresult.m_metahashdigest.resize(SHA256_DIGEST_LENGTH,0);
-
-				SHA256(hashresult.m_metahashptr,m_metahashsize,&hashresult.m_metahashdigest[0]);
-				(*i)->AddMetaHashPointer(hashresult.m_metahashptr);
 				return true;
 			}
 		}
@@ -298,16 +334,37 @@ public:
 		return false;
 	}
 
-	void SetMetaHashSize(const unsigned int size)
+	const bool HaveShare()
+	{
+		for(std::vector<RemoteMinerThread *>::iterator i=m_minerthreads.begin(); i!=m_minerthreads.end(); i++)
+		{
+			if((*i)->HaveShare())
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	const bool GetShare(RemoteMinerThread::foundhash &share)
 	{
-		m_metahashsize=size;
 		for(std::vector<RemoteMinerThread *>::iterator i=m_minerthreads.begin(); i!=m_minerthreads.end(); i++)
 		{
-			(*i)->SetMetaHashSize(size);
+			if((*i)->GetShare(share))
+			{
+				return true;
+			}
 		}
+		return false;
+	}
+
+	// size used for work that doesn't come with its own
+	void SetMetaHashSize(const unsigned int size)
+	{
+		m_metahashsize=size;
 	}
 
-	void SetNextBlock(const int64 blockid, uint256 target, std::vector<unsigned char> &block, std::vector<unsigned char> &midstate)
+	void SetNextBlock(const int64 blockid, uint256 target, std::vector<unsigned char> &block, std::vector<unsigned char> &midstate, const unsigned int metahashsize=0, const uint256 &sharetarget=0, const unsigned int segmentsize=0, const unsigned int ntimewindow=0)
 	{
 		RemoteMinerThread *earliest=0;
 		int64 earliesttime=(std::numeric_limits<int64>::max)();
@@ -326,8 +383,7 @@ public:
 		}
 		if(earliest)
 		{
-			earliest->SetMetaHashSize(m_metahashsize);
-			earliest->SetNextBlock(blockid,target,block,midstate);
+			earliest->SetNextBlock(blockid,target,block,midstate,metahashsize>0 ? metahashsize : m_metahashsize,sharetarget,segmentsize,ntimewindow);
 			m_lastwork[earliest]=GetTimeMillis();
 		}
 	}
@@ -17,6 +17,9 @@
 **/
 
 #include "remoteminerthreadcpu.h"
+#include "../sha256.h"
+
+const SHA256Kernel *RemoteMinerThreadCPU::m_kernel=0;
 
 RemoteMinerThreadCPU::RemoteMinerThreadCPU()
 {
@@ -26,10 +29,66 @@ RemoteMinerThreadCPU::~RemoteMinerThreadCPU()
 {
 }
 
+void RemoteMinerThreadCPU::CheckHash(threaddata *td, uint256 &hash, const uint256 &currenttarget, const uint256 &sharetarget, const int64 currentblockid, const unsigned int nonce, uint256 &besthash, unsigned int &besthashnonce)
+{
+	if((((unsigned short*)&hash)[14]==0) && (((unsigned short*)&hash)[15]==0))
+	{
+		for (int i = 0; i < sizeof(hash)/4; i++)
+		{
+			((unsigned int*)&hash)[i] = CryptoPP::ByteReverse(((unsigned int*)&hash)[i]);
+		}
+		
+		if(hash<=currenttarget)
+		{
+			CRITICAL_BLOCK(td->m_cs)
+			{
+				td->m_foundhashes.push_back(foundhash(currentblockid,nonce));
+			}
+		}
+
+		if(hash<=sharetarget)
+		{
+			CRITICAL_BLOCK(td->m_cs)
+			{
+				td->m_shares.push_back(foundhash(currentblockid,nonce));
+			}
+		}
+
+		if(hash<besthash)
+		{
+			besthash=hash;
+			besthashnonce=nonce;
+		}
+	}
+	// hash isn't bytereversed yet, but besthash and sharetarget already are
+	else if(CryptoPP::ByteReverse(((unsigned int*)&hash)[7])<=((unsigned int *)&besthash)[7] || CryptoPP::ByteReverse(((unsigned int*)&hash)[7])<=((unsigned int *)&sharetarget)[7])
+	{
+		for (int i = 0; i < sizeof(hash)/4; i++)
+		{
+			((unsigned int*)&hash)[i] = CryptoPP::ByteReverse(((unsigned int*)&hash)[i]);
+		}
+		if(hash<=sharetarget)
+		{
+			CRITICAL_BLOCK(td->m_cs)
+			{
+				td->m_shares.push_back(foundhash(currentblockid,nonce));
+			}
+		}
+		if(hash<besthash)
+		{
+			besthash=hash;
+			besthashnonce=nonce;
+		}
+	}
+}
+
 void RemoteMinerThreadCPU::Run(void *arg)
 {
 	threaddata *td=(threaddata *)arg;
 	int64 currentblockid=-1;
+	int64 reportblockid=-1;			// the id with the seconds nTime was rolled on
+	unsigned int ntimewindow=0;
+	unsigned int timeoffset=0;
 
 	static const unsigned int SHA256InitState[8] ={0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
 	uint256 tempbuff[4];
@@ -37,6 +96,7 @@ void RemoteMinerThreadCPU::Run(void *arg)
 	uint256 hashbuff[4];
 	uint256 &hash=*alignup<16>(hashbuff);
 	uint256 currenttarget;
+	uint256 sharetarget;
 
 	unsigned char currentmidbuff[256];
 	unsigned char currentblockbuff[256];
@@ -50,8 +110,12 @@ void RemoteMinerThreadCPU::Run(void *arg)
 	uint256 besthash=~(uint256(0));
 	unsigned int besthashnonce=0;
 
-	// TODO - pointer
-	unsigned char *metahash=0;
+	DoubleBlockSHA256Function pDoubleBlock=m_kernel ? m_kernel->pDoubleBlock : 0;
+	unsigned int thash[9][NPAR];
+
+	MetaHashTree metahash;
+	std::vector<unsigned char> metahashdigest;
+	std::vector<unsigned char> metahashsegments;
 	unsigned int metahashsize=0;
 	unsigned int metahashpos=0;
 	unsigned int metahashstartnonce=0;
@@ -70,90 +134,72 @@ void RemoteMinerThreadCPU::Run(void *arg)
 		{
 			if(metahashstartnonce==0)
 			{
-				CRITICAL_BLOCK(td->m_cs);
-				if(currentblockid!=td->m_nextblock.m_blockid)
+				CRITICAL_BLOCK(td->m_cs)
 				{
-					currenttarget=td->m_nextblock.m_target;
-					currentblockid=td->m_nextblock.m_blockid;
-					::memcpy(midbuffptr,&td->m_nextblock.m_midstate[0],32);
-					::memcpy(blockbuffptr,&td->m_nextblock.m_block[0],64);
-					metahashpos=0;
-					metahashstartnonce=0;
-					(*nonce)=0;
-					besthash=~(uint256(0));
-					besthashnonce=0;
-					if(metahash==0 || td->m_metahashsize!=metahashsize)
+					if(currentblockid!=td->m_nextblock.m_blockid)
 					{
-						metahashsize=td->m_metahashsize;
-						if(metahash)
-						{
-							delete [] metahash;
-						}
-						metahash=new unsigned char[metahashsize];
+						currenttarget=td->m_nextblock.m_target;
+						sharetarget=td->m_nextblock.m_sharetarget;
+						currentblockid=td->m_nextblock.m_blockid;
+						reportblockid=currentblockid;
+						ntimewindow=td->m_nextblock.m_ntimewindow;
+						timeoffset=0;
+						::memcpy(midbuffptr,&td->m_nextblock.m_midstate[0],32);
+						::memcpy(blockbuffptr,&td->m_nextblock.m_block[0],64);
+						metahashpos=0;
+						metahashstartnonce=0;
+						(*nonce)=0;
+						besthash=~(uint256(0));
+						besthashnonce=0;
+						metahashsize=td->m_nextblock.m_metahashsize;
+						metahash.Reset(td->m_nextblock.m_segmentsize);
 					}
 				}
 			}
 
 			// do 10000 hashes at a time
-			for(unsigned int i=0; i<10000 && metahashpos<metahashsize; i++)
+			for(unsigned int i=0; i<10000 && metahashpos<metahashsize; )
 			{
-				SHA256Transform(&temphash,blockbuffptr,midbuffptr);
-				SHA256Transform(&hash,&temphash,SHA256InitState);
-
-				metahash[metahashpos++]=((unsigned char *)&hash)[0];
-
-				if((((unsigned short*)&hash)[14]==0) && (((unsigned short*)&hash)[15]==0))
+				// hash NPAR nonces at once while a whole batch still fits in the metahash
+				if(pDoubleBlock && metahashpos+NPAR<=metahashsize)
 				{
-					for (int i = 0; i < sizeof(hash)/4; i++)
+					pDoubleBlock(blockbuffptr,&temphash,midbuffptr,thash,SHA256InitState);
+					for(int j=0; j<NPAR; j++)
 					{
-						((unsigned int*)&hash)[i] = CryptoPP::ByteReverse(((unsigned int*)&hash)[i]);
-					}
-					
-					if(hash<=currenttarget)
-					{
-						CRITICAL_BLOCK(td->m_cs);
-						td->m_foundhashes.push_back(foundhash(currentblockid,(*nonce)));
-					}
-
-					if(hash<besthash)
-					{
-						besthash=hash;
-						besthashnonce=(*nonce);
-					}
-				}
-				// hash isn't bytereversed yet, but besthash already is
-				else if(CryptoPP::ByteReverse(((unsigned int*)&hash)[7])<=((unsigned int *)&besthash)[7])
-				{
-					for (int i = 0; i < sizeof(hash)/4; i++)
-					{
-						((unsigned int*)&hash)[i] = CryptoPP::ByteReverse(((unsigned int*)&hash)[i]);
-					}
-					if(hash<besthash)
-					{
-						besthash=hash;
-						besthashnonce=(*nonce);
+						for(int k=0; k<8; k++)
+						{
+							((unsigned int*)&hash)[k]=thash[k][j];
+						}
+						metahash.Add(((unsigned char *)&hash)[0]);
+						metahashpos++;
+						CheckHash(td,hash,currenttarget,sharetarget,reportblockid,(*nonce),besthash,besthashnonce);
+						(*nonce)++;
 					}
+					i+=NPAR;
+					continue;
 				}
 
+				SHA256Transform(&temphash,blockbuffptr,midbuffptr);
+				SHA256Transform(&hash,&temphash,SHA256InitState);
+
+				metahash.Add(((unsigned char *)&hash)[0]);
+				metahashpos++;
+				CheckHash(td,hash,currenttarget,sharetarget,reportblockid,(*nonce),besthash,besthashnonce);
+
 				(*nonce)++;
+				i++;
 			}
 
 			if(metahashpos>=metahashsize)
 			{
 
+				metahash.Final(metahashdigest,metahashsegments);
 				{
-					CRITICAL_BLOCK(td->m_cs);
-					// TODO - fix
-					td->m_hashresults.push_back(hashresult(currentblockid,besthash,besthashnonce,metahash,metahashstartnonce));
-
-					if(td->m_metahashptrs.size()>0)
-					{
-						metahash=td->m_metahashptrs[td->m_metahashptrs.size()-1];
-						td->m_metahashptrs.erase(td->m_metahashptrs.end()-1);
-					}
-					else
+					CRITICAL_BLOCK(td->m_cs)
 					{
-						metahash=new unsigned char[metahashsize];
+						td->m_hashresults.push_back(hashresult(reportblockid,besthash,besthashnonce,metahashdigest,metahashstartnonce,metahashsize));
+						td->m_hashresults.back().m_segments.swap(metahashsegments);
+						td->m_hashresults.back().m_rollstime=(timeoffset<ntimewindow);
 					}
 				}
 
@@ -162,17 +208,33 @@ void RemoteMinerThreadCPU::Run(void *arg)
 				besthash=~(uint256(0));
 				besthashnonce=0;
 
+				// when the nonces left can't fill another metahash the work goes on with nTime a second later
+				if(((*nonce)==0 || static_cast<boost::uint64_t>(*nonce)+metahashsize>0x100000000ULL) && RollTime(blockbuffptr,timeoffset,ntimewindow))
 				{
-					CRITICAL_BLOCK(td->m_cs);
-					if(currentblockid!=td->m_nextblock.m_blockid)
+					reportblockid=RemoteMinerMessage::RolledTimeBlockID(currentblockid,timeoffset);
+					metahashstartnonce=0;
+					(*nonce)=0;
+				}
+
+				{
+					CRITICAL_BLOCK(td->m_cs)
 					{
-						currenttarget=td->m_nextblock.m_target;
-						currentblockid=td->m_nextblock.m_blockid;
-						::memcpy(midbuffptr,&td->m_nextblock.m_midstate[0],32);
-						::memcpy(blockbuffptr,&td->m_nextblock.m_block[0],64);
-						metahashpos=0;
-						metahashstartnonce=0;
-						(*nonce)=0;
+						if(currentblockid!=td->m_nextblock.m_blockid)
+						{
+							currenttarget=td->m_nextblock.m_target;
+							sharetarget=td->m_nextblock.m_sharetarget;
+							currentblockid=td->m_nextblock.m_blockid;
+							reportblockid=currentblockid;
+							ntimewindow=td->m_nextblock.m_ntimewindow;
+							timeoffset=0;
+							::memcpy(midbuffptr,&td->m_nextblock.m_midstate[0],32);
+							::memcpy(blockbuffptr,&td->m_nextblock.m_block[0],64);
+							metahashpos=0;
+							metahashstartnonce=0;
+							(*nonce)=0;
+							metahashsize=td->m_nextblock.m_metahashsize;
+							metahash.Reset(td->m_nextblock.m_segmentsize);
+						}
 					}
 				}
 
@@ -186,7 +248,9 @@ void RemoteMinerThreadCPU::Run(void *arg)
 	}
 
 	{
-		CRITICAL_BLOCK(td->m_cs);
-		td->m_done=true;
+		CRITICAL_BLOCK(td->m_cs)
+		{
+			td->m_done=true;
+		}
 	}
 }
@@ -21,6 +21,8 @@
 
 #include "remoteminerthread.h"
 
+struct SHA256Kernel;
+
 class RemoteMinerThreadCPU:public RemoteMinerThread
 {
 public:
@@ -33,7 +35,6 @@ public:
 		m_threaddata.m_havework=false;
 		m_threaddata.m_generate=true;
 		m_threaddata.m_nextblock.m_blockid=0;
-		FreeMetaHashPointers();
 		if(!CreateThread(RemoteMinerThreadCPU::Run,&m_threaddata))
 		{
 			m_threaddata.m_done=true;
@@ -42,8 +43,16 @@ public:
 		return true;
 	}
 
+	static const bool ReportsShares()	{ return true; }
+
+	// SHA-256 kernel every CPU thread hashes with, picked once at startup
+	static void SetKernel(const SHA256Kernel *kernel)	{ m_kernel=kernel; }
+
 private:
+	static const SHA256Kernel *m_kernel;
+
 	static void Run(void *arg);
+	static inline void CheckHash(threaddata *td, uint256 &hash, const uint256 &currenttarget, const uint256 &sharetarget, const int64 currentblockid, const unsigned int nonce, uint256 &besthash, unsigned int &besthashnonce);
 
 };
 
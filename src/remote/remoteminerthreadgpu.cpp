@@ -32,6 +32,9 @@ void RemoteMinerThreadGPU::Run(void *arg)
 {
 	threaddata *td=(threaddata *)arg;
 	int64 currentblockid=-1;
+	int64 reportblockid=-1;			// the id with the seconds nTime was rolled on
+	unsigned int ntimewindow=0;
+	unsigned int timeoffset=0;
 
 	static const unsigned int SHA256InitState[8] ={0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
 	uint256 tempbuff[4];
@@ -53,8 +56,10 @@ void RemoteMinerThreadGPU::Run(void *arg)
 	uint256 besthash=~(uint256(0));
 	unsigned int besthashnonce=0;
 
-	unsigned char *metahash=0;
-	unsigned int metahashsize=td->m_metahashsize;
+	MetaHashTree metahash;
+	std::vector<unsigned char> metahashdigest;
+	std::vector<unsigned char> metahashsegments;
+	unsigned int metahashsize=0;
 	unsigned int metahashpos=0;
 	unsigned int metahashstartnonce=0;
 
@@ -74,35 +79,33 @@ void RemoteMinerThreadGPU::Run(void *arg)
 		{
 			if(metahashstartnonce==0)
 			{
-				CRITICAL_BLOCK(td->m_cs);
-				if(currentblockid!=td->m_nextblock.m_blockid)
+				CRITICAL_BLOCK(td->m_cs)
 				{
-					currenttarget=td->m_nextblock.m_target;
-					currentblockid=td->m_nextblock.m_blockid;
-					::memcpy(midbuffptr,&td->m_nextblock.m_midstate[0],32);
-					::memcpy(blockbuffptr,&td->m_nextblock.m_block[0],64);
-					metahashpos=0;
-					metahashstartnonce=0;
-					(*nonce)=0;
-					besthash=~(uint256(0));
-					besthashnonce=0;
-					if(metahash==0 || td->m_metahashsize!=metahashsize)
+					if(currentblockid!=td->m_nextblock.m_blockid)
 					{
-						metahashsize=td->m_metahashsize;
-						if(metahash)
+						currenttarget=td->m_nextblock.m_target;
+						currentblockid=td->m_nextblock.m_blockid;
+						reportblockid=currentblockid;
+						ntimewindow=td->m_nextblock.m_ntimewindow;
+						timeoffset=0;
+						::memcpy(midbuffptr,&td->m_nextblock.m_midstate[0],32);
+						::memcpy(blockbuffptr,&td->m_nextblock.m_block[0],64);
+						metahashpos=0;
+						metahashstartnonce=0;
+						(*nonce)=0;
+						besthash=~(uint256(0));
+						besthashnonce=0;
+						metahashsize=td->m_nextblock.m_metahashsize;
+						metahash.Reset(td->m_nextblock.m_segmentsize);
+
+						for(int i=0; i<8; i++)
 						{
-							delete [] metahash;
+							gpu.GetIn()->m_AH[i]=((unsigned int *)midbuffptr)[i];
 						}
-						metahash=new unsigned char[metahashsize];
+						gpu.GetIn()->m_merkle=((unsigned int *)blockbuffptr)[0];
+						gpu.GetIn()->m_ntime=((unsigned int *)blockbuffptr)[1];
+						gpu.GetIn()->m_nbits=((unsigned int *)blockbuffptr)[2];
 					}
-
-					for(int i=0; i<8; i++)
-					{
-						gpu.GetIn()->m_AH[i]=((unsigned int *)midbuffptr)[i];
-					}
-					gpu.GetIn()->m_merkle=((unsigned int *)blockbuffptr)[0];
-					gpu.GetIn()->m_ntime=((unsigned int *)blockbuffptr)[1];
-					gpu.GetIn()->m_nbits=((unsigned int *)blockbuffptr)[2];
 				}
 			}
 
@@ -116,8 +119,10 @@ void RemoteMinerThreadGPU::Run(void *arg)
 
 				if(gpu.GetOut()[i].m_bestnonce!=0 && hash!=0 && hash<=currenttarget)
 				{
-					CRITICAL_BLOCK(td->m_cs);
-					td->m_foundhashes.push_back(foundhash(currentblockid,gpu.GetOut()[i].m_bestnonce));
+					CRITICAL_BLOCK(td->m_cs)
+					{
+						td->m_foundhashes.push_back(foundhash(reportblockid,gpu.GetOut()[i].m_bestnonce));
+					}
 				}
 
 				if(gpu.GetOut()[i].m_bestnonce!=0 && hash!=0 && hash<besthash && gpu.GetOut()[i].m_bestnonce<metahashstartnonce+metahashsize)
@@ -129,23 +134,19 @@ void RemoteMinerThreadGPU::Run(void *arg)
 				for(int j=0; j<gpu.GetStepIterations(); j++)
 				{
 					(*nonce)++;
-					metahash[metahashpos++]=gpu.GetMetaHash()[(i*gpu.GetStepIterations())+j];
+					metahash.Add(gpu.GetMetaHash()[(i*gpu.GetStepIterations())+j]);
+					metahashpos++;
 
 					if(metahashpos>=metahashsize)
 					{
 
+						metahash.Final(metahashdigest,metahashsegments);
 						{
-							CRITICAL_BLOCK(td->m_cs);
-							td->m_hashresults.push_back(hashresult(currentblockid,besthash,besthashnonce,metahash,metahashstartnonce));
-
-							if(td->m_metahashptrs.size()>0)
-							{
-								metahash=td->m_metahashptrs[td->m_metahashptrs.size()-1];
-								td->m_metahashptrs.erase(td->m_metahashptrs.end()-1);
-							}
-							else
+							CRITICAL_BLOCK(td->m_cs)
 							{
-								metahash=new unsigned char[metahashsize];
+								td->m_hashresults.push_back(hashresult(reportblockid,besthash,besthashnonce,metahashdigest,metahashstartnonce,metahashsize));
+								td->m_hashresults.back().m_segments.swap(metahashsegments);
+								td->m_hashresults.back().m_rollstime=(timeoffset<ntimewindow);
 							}
 						}
 
@@ -154,24 +155,40 @@ void RemoteMinerThreadGPU::Run(void *arg)
 						besthash=~(uint256(0));
 						besthashnonce=0;
 
+						// when the nonces left can't fill another metahash the work goes on with nTime a second later
+						if(((*nonce)==0 || static_cast<boost::uint64_t>(*nonce)+metahashsize>0x100000000ULL) && RollTime(blockbuffptr,timeoffset,ntimewindow))
+						{
+							reportblockid=RemoteMinerMessage::RolledTimeBlockID(currentblockid,timeoffset);
+							metahashstartnonce=0;
+							(*nonce)=0;
+							gpu.GetIn()->m_ntime=((unsigned int *)blockbuffptr)[1];
+						}
+
 						{
-							CRITICAL_BLOCK(td->m_cs);
-							if(currentblockid!=td->m_nextblock.m_blockid)
+							CRITICAL_BLOCK(td->m_cs)
 							{
-								currenttarget=td->m_nextblock.m_target;
-								currentblockid=td->m_nextblock.m_blockid;
-								::memcpy(midbuffptr,&td->m_nextblock.m_midstate[0],32);
-								::memcpy(blockbuffptr,&td->m_nextblock.m_block[0],64);
-								metahashpos=0;
-								metahashstartnonce=0;
-								(*nonce)=0;
-								for(int i=0; i<8; i++)
+								if(currentblockid!=td->m_nextblock.m_blockid)
 								{
-									gpu.GetIn()->m_AH[i]=((unsigned int *)midbuffptr)[i];
+									currenttarget=td->m_nextblock.m_target;
+									currentblockid=td->m_nextblock.m_blockid;
+									reportblockid=currentblockid;
+									ntimewindow=td->m_nextblock.m_ntimewindow;
+									timeoffset=0;
+									::memcpy(midbuffptr,&td->m_nextblock.m_midstate[0],32);
+									::memcpy(blockbuffptr,&td->m_nextblock.m_block[0],64);
+									metahashpos=0;
+									metahashstartnonce=0;
+									(*nonce)=0;
+									metahashsize=td->m_nextblock.m_metahashsize;
+									metahash.Reset(td->m_nextblock.m_segmentsize);
+									for(int i=0; i<8; i++)
+									{
+										gpu.GetIn()->m_AH[i]=((unsigned int *)midbuffptr)[i];
+									}
+									gpu.GetIn()->m_merkle=((unsigned int *)blockbuffptr)[0];
+									gpu.GetIn()->m_ntime=((unsigned int *)blockbuffptr)[1];
+									gpu.GetIn()->m_nbits=((unsigned int *)blockbuffptr)[2];
 								}
-								gpu.GetIn()->m_merkle=((unsigned int *)blockbuffptr)[0];
-								gpu.GetIn()->m_ntime=((unsigned int *)blockbuffptr)[1];
-								gpu.GetIn()->m_nbits=((unsigned int *)blockbuffptr)[2];
 							}
 						}
 
@@ -189,8 +206,10 @@ void RemoteMinerThreadGPU::Run(void *arg)
 	}
 
 	{
-		CRITICAL_BLOCK(td->m_cs);
-		td->m_done=true;
+		CRITICAL_BLOCK(td->m_cs)
+		{
+			td->m_done=true;
+		}
 	}
 
 }
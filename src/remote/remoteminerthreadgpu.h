@@ -37,7 +37,6 @@ public:
 		m_threaddata.m_havework=false;
 		m_threaddata.m_generate=true;
 		m_threaddata.m_nextblock.m_blockid=0;
-		FreeMetaHashPointers();
 		if(!CreateThread(RemoteMinerThreadGPU::Run,&m_threaddata))
 		{
 			m_threaddata.m_done=true;
@@ -0,0 +1,719 @@
+/**
+    Copyright (C) 2010  puddinpop
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+**/
+
+#define NOMINMAX
+
+#include "remotestratum.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#ifdef _WIN32
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+#else
+	#include <arpa/inet.h>
+	#include <netinet/in.h>
+	#include <netdb.h>
+	#include <fcntl.h>
+	#include <errno.h>
+#endif
+
+BitcoinMinerStratumServer::connection::connection(RemoteClientConnection *client, const unsigned int extranonce1, const double difficulty):m_client(client),m_extranonce1(4,0),m_subscribed(false),m_difficulty(difficulty),m_previousdifficulty(difficulty),m_difficultytime(0),m_retargettime(time(0)),m_retargetdifficulty(0)
+{
+	m_extranonce1[0]=(extranonce1>>24) & 0xff;
+	m_extranonce1[1]=(extranonce1>>16) & 0xff;
+	m_extranonce1[2]=(extranonce1>>8) & 0xff;
+	m_extranonce1[3]=extranonce1 & 0xff;
+}
+
+BitcoinMinerStratumServer::BitcoinMinerStratumServer(BitcoinMinerRemoteServer *server):m_server(server),m_nextjobid(1),m_nextextranonce1(0),m_lastkhash(0),m_running(false),m_stop(false)
+{
+	m_mindifficulty=static_cast<double>(BITCOINMINERREMOTE_MINHASHESPERSHARE)/4294967296.0;
+	m_startdifficulty=(std::max)(atof(GetArg("-stratumdifficulty","1").c_str()),m_mindifficulty);
+	m_shareinterval=(std::max)(static_cast<int>(GetArg("-stratumshareinterval",10)),1);
+}
+
+BitcoinMinerStratumServer::~BitcoinMinerStratumServer()
+{
+	Stop();
+
+	for(std::vector<SOCKET>::iterator i=m_listensockets.begin(); i!=m_listensockets.end(); i++)
+	{
+		myclosesocket((*i));
+	}
+
+	for(std::vector<connection>::iterator i=m_connections.begin(); i!=m_connections.end(); i++)
+	{
+		(*i).m_client->Disconnect();
+		delete (*i).m_client;
+	}
+}
+
+const bool BitcoinMinerStratumServer::StartListen(const std::string &bindaddr, const std::string &bindport)
+{
+	SOCKET sock;
+	struct addrinfo hint,*result,*current;
+	result=current=NULL;
+	memset(&hint,0,sizeof(hint));
+	hint.ai_socktype=SOCK_STREAM;
+	hint.ai_protocol=IPPROTO_TCP;
+	hint.ai_flags=AI_PASSIVE;
+
+	if(getaddrinfo(bindaddr.c_str(),bindport.c_str(),&hint,&result)==0)
+	{
+		for(current=result; current!=NULL; current=current->ai_next)
+		{
+			sock=socket(current->ai_family,current->ai_socktype,current->ai_protocol);
+			if(sock!=INVALID_SOCKET)
+			{
+				#ifndef _WIN32
+				const int optval=1;
+				setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,&optval,sizeof(optval));
+				#endif
+				if(::bind(sock,current->ai_addr,current->ai_addrlen)==0 && listen(sock,SOMAXCONN)==0)
+				{
+					m_listensockets.push_back(sock);
+				}
+				else
+				{
+					myclosesocket(sock);
+				}
+			}
+		}
+	}
+
+	if(result)
+	{
+		freeaddrinfo(result);
+	}
+
+	if(m_listensockets.size()==0)
+	{
+		printf("Stratum server couldn't listen on any interface\n");
+	}
+	else
+	{
+		printf("Stratum server listening on %d interfaces\n",m_listensockets.size());
+	}
+
+	return (m_listensockets.size()>0);
+}
+
+const bool BitcoinMinerStratumServer::Start()
+{
+	m_stop=false;
+	m_running=true;
+	if(!CreateThread(BitcoinMinerStratumServer::ThreadStratum,this))
+	{
+		printf("Error: CreateThread(ThreadStratum) failed\n");
+		m_running=false;
+	}
+	return m_running;
+}
+
+void BitcoinMinerStratumServer::Stop()
+{
+	m_stop=true;
+	while(m_running)
+	{
+		Sleep(10);
+	}
+}
+
+void BitcoinMinerStratumServer::ThreadStratum(void *arg)
+{
+	BitcoinMinerStratumServer *stratum=(BitcoinMinerStratumServer *)arg;
+
+	while(stratum->m_stop==false && !fShutdown)
+	{
+		stratum->Step();
+	}
+
+	stratum->m_running=false;
+}
+
+void BitcoinMinerStratumServer::Step()
+{
+	SCOPEDTIME("BitcoinMinerStratumServer::Step");
+	fd_set readfs;
+	fd_set writefs;
+	struct timeval tv;
+	SOCKET highsocket=0;
+
+	// a new tip or template is sent to the miners before anything they submit is looked at
+	CheckNewJob();
+
+	FD_ZERO(&readfs);
+	FD_ZERO(&writefs);
+	for(std::vector<SOCKET>::iterator i=m_listensockets.begin(); i!=m_listensockets.end(); i++)
+	{
+		FD_SET((*i),&readfs);
+		highsocket=(std::max)(highsocket,(*i));
+	}
+	for(std::vector<connection>::iterator i=m_connections.begin(); i!=m_connections.end(); i++)
+	{
+		if((*i).m_client->IsConnected())
+		{
+			FD_SET((*i).m_client->GetSocket(),&readfs);
+			if((*i).m_client->SendBufferSize()>0)
+			{
+				FD_SET((*i).m_client->GetSocket(),&writefs);
+			}
+			highsocket=(std::max)(highsocket,(*i).m_client->GetSocket());
+		}
+	}
+
+	tv.tv_sec=0;
+	tv.tv_usec=100000;
+	if(select(highsocket+1,&readfs,&writefs,0,&tv)>0)
+	{
+		for(std::vector<connection>::iterator i=m_connections.begin(); i!=m_connections.end(); i++)
+		{
+			RemoteClientConnection *client=(*i).m_client;
+			if(client->IsConnected() && FD_ISSET(client->GetSocket(),&readfs))
+			{
+				std::string line;
+				client->SocketReceive();
+				while(client->IsConnected() && client->ReceiveLine(line))
+				{
+					HandleLine((*i),line);
+				}
+				// a line is never this long
+				if(client->ReceiveBufferSize()>65536)
+				{
+					printf("Stratum miner %s sent too long a line.  Disconnecting.\n",client->GetAddress().c_str());
+					client->Disconnect();
+				}
+			}
+			if(client->IsConnected() && FD_ISSET(client->GetSocket(),&writefs))
+			{
+				client->SocketSend();
+			}
+		}
+
+		// accepted last, so the connections aren't moved while they are worked on
+		for(std::vector<SOCKET>::iterator i=m_listensockets.begin(); i!=m_listensockets.end(); i++)
+		{
+			if(FD_ISSET((*i),&readfs))
+			{
+				AcceptConnection((*i));
+			}
+		}
+	}
+
+	if(m_lastkhash!=time(0))
+	{
+		for(std::vector<connection>::iterator i=m_connections.begin(); i!=m_connections.end(); i++)
+		{
+			CheckDifficulty((*i));
+		}
+		PublishKHash();
+		m_lastkhash=time(0);
+	}
+
+	for(std::vector<connection>::iterator i=m_connections.begin(); i!=m_connections.end(); )
+	{
+		if((*i).m_client->IsConnected()==false || (*i).m_client->DisconnectRequested())
+		{
+			printf("Stratum miner %s disconnected\n",(*i).m_client->GetAddress().c_str());
+			(*i).m_client->Disconnect();
+			delete (*i).m_client;
+			i=m_connections.erase(i);
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
+
+const bool BitcoinMinerStratumServer::AcceptConnection(const SOCKET listensocket)
+{
+	SOCKET newsock;
+	struct sockaddr_storage addr;
+	socklen_t addrlen=sizeof(addr);
+	newsock=accept(listensocket,(struct sockaddr *)&addr,&addrlen);
+	if(newsock!=INVALID_SOCKET)
+	{
+		RemoteClientConnection *newclient=new RemoteClientConnection(newsock,addr,addrlen);
+		if(m_server->IsBanned(newclient->GetAddress(false)))
+		{
+			printf("Banned stratum miner %s connected.  Disconnecting.\n",newclient->GetAddress().c_str());
+			newclient->Disconnect();
+			delete newclient;
+		}
+#ifndef _WIN32
+		else if(newsock>=FD_SETSIZE)
+#else
+		else if(m_connections.size()+m_listensockets.size()>=FD_SETSIZE)
+#endif
+		{
+			printf("Too many stratum miners to accept %s.  Disconnecting.\n",newclient->GetAddress().c_str());
+			newclient->Disconnect();
+			delete newclient;
+		}
+		else
+		{
+#ifdef _BITCOIN_REMOTE_EPOLL_
+			// the epoll build of the connection reads and writes until the socket would block
+			fcntl(newsock,F_SETFL,fcntl(newsock,F_GETFL,0)|O_NONBLOCK);
+#endif
+			m_connections.push_back(connection(newclient,m_nextextranonce1++,m_startdifficulty));
+			printf("Stratum miner %s connected\n",newclient->GetAddress().c_str());
+		}
+		return true;
+	}
+	return false;
+}
+
+/*
+	Makes a new job when the tip changed, when the coinbase only template got
+	its transactions and otherwise every BITCOINMINERREMOTE_STRATUMJOBINTERVAL
+	seconds, so the transactions, the distribution and the time the miners
+	roll from stay current.  Only a new tip makes the miners drop their jobs.
+*/
+void BitcoinMinerStratumServer::CheckNewJob()
+{
+	SCOPEDTIME("BitcoinMinerStratumServer::CheckNewJob");
+	const std::map<int64,job>::size_type maxjobs=8;
+	boost::shared_ptr<const RemoteBlockTemplate> blocktemplate=m_server->GetBlockTemplate();
+	bool clean=true;
+
+	if(m_jobs.size()>0)
+	{
+		const job &last=(*m_jobs.rbegin()).second;
+		if(last.m_template->m_indexprev==blocktemplate->m_indexprev)
+		{
+			if((last.m_template==blocktemplate || last.m_template->m_withtransactions) && difftime(time(0),last.m_created)<BITCOINMINERREMOTE_STRATUMJOBINTERVAL)
+			{
+				return;
+			}
+			clean=false;
+		}
+	}
+
+	job j;
+	j.m_id=m_nextjobid++;
+	j.m_template=blocktemplate;
+	j.m_key.MakeNewKey();
+	// extranonce1 and extranonce2 of the miner
+	m_server->CreateCoinbase(*blocktemplate,j.m_key,8,j.m_coinbase);
+	RemoteBlockTemplate::SplitCoinbase(j.m_coinbase,8,j.m_coinbase1,j.m_coinbase2);
+	j.m_time=(std::max)(blocktemplate->m_indexprev->GetMedianTimePast()+1,GetAdjustedTime());
+	j.m_created=time(0);
+
+	// stratum sends the previous hash with the bytes of every 4 byte word reversed, and the other fields as big endian hex
+	CBlock header;
+	uint256 prevhash=blocktemplate->m_indexprev->GetBlockHash();
+	std::vector<unsigned char> prev(prevhash.begin(),prevhash.end());
+	for(std::vector<unsigned char>::size_type i=0; i<prev.size(); i+=4)
+	{
+		std::reverse(prev.begin()+i,prev.begin()+i+4);
+	}
+
+	json_spirit::Array branch;
+	for(std::vector<uint256>::const_iterator i=blocktemplate->m_merklebranch.begin(); i!=blocktemplate->m_merklebranch.end(); i++)
+	{
+		branch.push_back(HexStr((const unsigned char *)&(*i),((const unsigned char *)&(*i))+32));
+	}
+
+	json_spirit::Array params;
+	params.push_back(strprintf("%"PRI64d,j.m_id));
+	params.push_back(HexStr(prev));
+	params.push_back(HexStr(j.m_coinbase1));
+	params.push_back(HexStr(j.m_coinbase2));
+	params.push_back(branch);
+	params.push_back(strprintf("%08x",header.nVersion));
+	params.push_back(strprintf("%08x",blocktemplate->m_bits));
+	params.push_back(strprintf("%08x",j.m_time));
+	params.push_back(clean);
+
+	json_spirit::Object obj;
+	obj.push_back(json_spirit::Pair("id",json_spirit::Value()));
+	obj.push_back(json_spirit::Pair("method","mining.notify"));
+	obj.push_back(json_spirit::Pair("params",params));
+	j.m_notify.reset(new std::string(json_spirit::write(obj)+"\n"));
+
+	if(clean)
+	{
+		m_jobs.clear();
+	}
+	m_jobs[j.m_id]=j;
+	while(m_jobs.size()>maxjobs)
+	{
+		m_jobs.erase(m_jobs.begin());
+	}
+
+	for(std::vector<connection>::iterator i=m_connections.begin(); i!=m_connections.end(); i++)
+	{
+		if((*i).m_subscribed)
+		{
+			SendLine((*i),j.m_notify);
+		}
+	}
+}
+
+// after 4 share intervals, or sooner when a miner sends shares much faster than it should, its difficulty is set so it sends one share per interval
+void BitcoinMinerStratumServer::CheckDifficulty(connection &conn)
+{
+	const double elapsed=difftime(time(0),conn.m_retargettime);
+	if(conn.m_subscribed==false || conn.m_workers.size()==0 || elapsed<=0)
+	{
+		return;
+	}
+
+	if(elapsed>=m_shareinterval*4 || conn.m_retargetdifficulty>=conn.m_difficulty*16)
+	{
+		double difficulty=conn.m_retargetdifficulty*m_shareinterval/elapsed;
+		difficulty=(std::max)((std::min)(difficulty,conn.m_difficulty*4),conn.m_difficulty/4);
+		difficulty=(std::max)(difficulty,m_mindifficulty);
+
+		conn.m_retargettime=time(0);
+		conn.m_retargetdifficulty=0;
+
+		// small changes aren't worth a message
+		if(difficulty<conn.m_difficulty/1.5 || difficulty>conn.m_difficulty*1.5)
+		{
+			conn.m_previousdifficulty=conn.m_difficulty;
+			conn.m_difficulty=difficulty;
+			conn.m_difficultytime=time(0);
+			SendDifficulty(conn);
+		}
+	}
+}
+
+void BitcoinMinerStratumServer::PublishKHash()
+{
+	std::map<uint160,int64> khash;
+	const time_t now=time(0);
+	for(std::map<uint160,HashRateWindow>::iterator i=m_hashrates.begin(); i!=m_hashrates.end(); )
+	{
+		const int64 total=(*i).second.GetTotal(now);
+		if(total>0)
+		{
+			khash[(*i).first]=total/(static_cast<int64>((*i).second.GetWindowSeconds())*1000);
+			i++;
+		}
+		else
+		{
+			m_hashrates.erase(i++);
+		}
+	}
+	m_server->SetStratumKHash(khash);
+}
+
+void BitcoinMinerStratumServer::HandleLine(connection &conn, const std::string &line)
+{
+	SCOPEDTIME("BitcoinMinerStratumServer::HandleLine");
+	json_spirit::Value value;
+
+	if(line.find_first_not_of(" \t\r")==std::string::npos)
+	{
+		return;
+	}
+
+	if(json_spirit::read(line,value)==false || value.type()!=json_spirit::obj_type)
+	{
+		printf("Stratum miner %s sent malformed JSON.  Disconnecting.\n",conn.m_client->GetAddress().c_str());
+		conn.m_client->Disconnect();
+		return;
+	}
+
+	const json_spirit::Object &obj=value.get_obj();
+	json_spirit::Value id=json_spirit::find_value(obj,"id");
+	json_spirit::Value method=json_spirit::find_value(obj,"method");
+	json_spirit::Value params=json_spirit::find_value(obj,"params");
+	json_spirit::Array paramsarr;
+	if(params.type()==json_spirit::array_type)
+	{
+		paramsarr=params.get_array();
+	}
+
+	if(method.type()!=json_spirit::str_type)
+	{
+		SendError(conn,id,20,"Method not found");
+	}
+	else if(method.get_str()=="mining.subscribe")
+	{
+		HandleSubscribe(conn,id);
+	}
+	else if(method.get_str()=="mining.authorize")
+	{
+		HandleAuthorize(conn,id,paramsarr);
+	}
+	else if(method.get_str()=="mining.submit")
+	{
+		HandleSubmit(conn,id,paramsarr);
+	}
+	else
+	{
+		SendError(conn,id,20,"Method not found");
+	}
+}
+
+void BitcoinMinerStratumServer::HandleSubscribe(connection &conn, const json_spirit::Value &id)
+{
+	const std::string subscription=HexStr(conn.m_extranonce1);
+	json_spirit::Array setdifficulty;
+	json_spirit::Array notify;
+	json_spirit::Array subscriptions;
+	json_spirit::Array result;
+
+	setdifficulty.push_back("mining.set_difficulty");
+	setdifficulty.push_back(subscription);
+	notify.push_back("mining.notify");
+	notify.push_back(subscription);
+	subscriptions.push_back(setdifficulty);
+	subscriptions.push_back(notify);
+
+	// extranonce1 and the size of extranonce2
+	result.push_back(subscriptions);
+	result.push_back(HexStr(conn.m_extranonce1));
+	result.push_back(4);
+	SendResult(conn,id,result);
+
+	conn.m_subscribed=true;
+	SendDifficulty(conn);
+	if(m_jobs.size()>0)
+	{
+		SendLine(conn,(*m_jobs.rbegin()).second.m_notify);
+	}
+}
+
+void BitcoinMinerStratumServer::HandleAuthorize(connection &conn, const json_spirit::Value &id, const json_spirit::Array &params)
+{
+	if(params.size()<1 || params[0].type()!=json_spirit::str_type)
+	{
+		SendError(conn,id,20,"Malformed request");
+		return;
+	}
+
+	// the worker name is the address that is credited, optionally followed by a dot and a name for the miner
+	const std::string worker=params[0].get_str();
+	const std::string password=(params.size()>1 && params[1].type()==json_spirit::str_type) ? params[1].get_str() : "";
+	uint160 address;
+
+	// stratum miners always send a password, so any is taken when the server has none
+	if(m_server->CheckPassword("")==false && m_server->CheckPassword(password)==false)
+	{
+		printf("Stratum miner %s sent the wrong password\n",conn.m_client->GetAddress().c_str());
+		SendError(conn,id,24,"Unauthorized worker");
+	}
+	else if(AddressToHash160(worker.substr(0,worker.find('.')),address)==false)
+	{
+		printf("Stratum miner %s sent worker %s, which isn't a bitcoin address\n",conn.m_client->GetAddress().c_str(),worker.c_str());
+		SendError(conn,id,24,"Unauthorized worker");
+	}
+	else
+	{
+		conn.m_workers[worker]=address;
+		SendResult(conn,id,true);
+	}
+}
+
+void BitcoinMinerStratumServer::HandleSubmit(connection &conn, const json_spirit::Value &id, const json_spirit::Array &params)
+{
+	SCOPEDTIME("BitcoinMinerStratumServer::HandleSubmit");
+
+	if(params.size()<5 || params[0].type()!=json_spirit::str_type || params[1].type()!=json_spirit::str_type || params[2].type()!=json_spirit::str_type || params[3].type()!=json_spirit::str_type || params[4].type()!=json_spirit::str_type)
+	{
+		SendError(conn,id,20,"Malformed request");
+		return;
+	}
+
+	std::map<std::string,uint160>::const_iterator worker=conn.m_workers.find(params[0].get_str());
+	if(worker==conn.m_workers.end())
+	{
+		SendError(conn,id,24,"Unauthorized worker");
+		return;
+	}
+
+	std::map<int64,job>::iterator ji=m_jobs.find(atoi64(params[1].get_str()));
+	if(ji==m_jobs.end() || (*ji).second.m_template->m_indexprev!=pindexBest)
+	{
+		SendError(conn,id,21,"Job not found");
+		return;
+	}
+	job &j=(*ji).second;
+
+	std::vector<unsigned char> extranonce2=ParseHex(params[2].get_str());
+	std::vector<unsigned char> ntime=ParseHex(params[3].get_str());
+	std::vector<unsigned char> nonce=ParseHex(params[4].get_str());
+	if(params[2].get_str().size()!=8 || extranonce2.size()!=4 || params[3].get_str().size()!=8 || ntime.size()!=4 || params[4].get_str().size()!=8 || nonce.size()!=4)
+	{
+		SendError(conn,id,20,"Malformed request");
+		return;
+	}
+
+	// every miner rolls its own extranonce2 behind its extranonce1, so the same share from two miners is still a duplicate
+	std::vector<unsigned char> share(conn.m_extranonce1);
+	share.insert(share.end(),extranonce2.begin(),extranonce2.end());
+	share.insert(share.end(),ntime.begin(),ntime.end());
+	share.insert(share.end(),nonce.begin(),nonce.end());
+	if(j.m_shares.find(share)!=j.m_shares.end())
+	{
+		SendError(conn,id,22,"Duplicate share");
+		return;
+	}
+
+	CBlock block;
+	block.nTime=(static_cast<unsigned int>(ntime[0])<<24) | (static_cast<unsigned int>(ntime[1])<<16) | (static_cast<unsigned int>(ntime[2])<<8) | ntime[3];
+	block.nNonce=(static_cast<unsigned int>(nonce[0])<<24) | (static_cast<unsigned int>(nonce[1])<<16) | (static_cast<unsigned int>(nonce[2])<<8) | nonce[3];
+	if(block.nTime<j.m_time || block.nTime>j.m_time+m_server->GetNTimeWindow())
+	{
+		SendError(conn,id,20,"Time out of range");
+		return;
+	}
+
+	// the job's coinbase with the extranonces put back in, only the header is hashed unless it is a block
+	std::vector<unsigned char> coinbasedata(j.m_coinbase1);
+	coinbasedata.insert(coinbasedata.end(),conn.m_extranonce1.begin(),conn.m_extranonce1.end());
+	coinbasedata.insert(coinbasedata.end(),extranonce2.begin(),extranonce2.end());
+	coinbasedata.insert(coinbasedata.end(),j.m_coinbase2.begin(),j.m_coinbase2.end());
+	CDataStream sscoinbase(coinbasedata,SER_NETWORK);
+	CTransaction coinbase;
+	sscoinbase >> coinbase;
+
+	block.hashPrevBlock=j.m_template->m_indexprev->GetBlockHash();
+	block.hashMerkleRoot=j.m_template->GetMerkleRoot(coinbase);
+	block.nBits=j.m_template->m_bits;
+	const uint256 hash=block.GetHash();
+
+	// miners may still be working on jobs they got before their difficulty went up
+	double difficulty=conn.m_difficulty;
+	if(hash>DifficultyToTarget(difficulty))
+	{
+		if(j.m_created<=conn.m_difficultytime && hash<=DifficultyToTarget(conn.m_previousdifficulty))
+		{
+			difficulty=conn.m_previousdifficulty;
+		}
+		else
+		{
+			SendError(conn,id,23,"Low difficulty share");
+			return;
+		}
+	}
+
+	j.m_shares.insert(share);
+	conn.m_retargetdifficulty+=difficulty;
+
+	// difficulty 1 takes 2^32 hashes on average
+	const int64 hashes=static_cast<int64>(difficulty*4294967296.0);
+	m_server->AddContributedHashes((*worker).second,hashes);
+	std::map<uint160,HashRateWindow>::iterator hr=m_hashrates.find((*worker).second);
+	if(hr==m_hashrates.end())
+	{
+		hr=m_hashrates.insert(std::make_pair((*worker).second,HashRateWindow(60,60))).first;
+	}
+	(*hr).second.Add(time(0),hashes);
+
+	if(hash<=CBigNum().SetCompact(block.nBits).getuint256())
+	{
+		bool accepted=false;
+		j.m_template->GetBlock(coinbase,block);
+
+		CRITICAL_BLOCK(cs_main)
+		{
+			if(j.m_template->m_indexprev==pindexBest)
+			{
+				// save the key
+				AddKey(j.m_key);
+
+				// Track how many getdata requests this block gets
+				CRITICAL_BLOCK(cs_mapRequestCount)
+					mapRequestCount[block.GetHash()] = 0;
+
+				// Process this block the same as if we had received it from another node
+				if (!ProcessBlock(NULL, &block))
+				{
+					printf("ERROR in BitcoinMinerStratumServer::HandleSubmit, ProcessBlock, block not accepted\n");
+				}
+				else
+				{
+					accepted=true;
+				}
+			}
+		}
+
+		if(accepted)
+		{
+			printf("Stratum miner %s found block %s\n",conn.m_client->GetAddress().c_str(),hash.GetHex().c_str());
+			m_server->BlockGenerated();
+		}
+		// the remote clients get new work as well, the miners get a new job once the tip changed
+		m_server->RequestWorkForAllClients();
+	}
+
+	SendResult(conn,id,true);
+}
+
+void BitcoinMinerStratumServer::SendResult(connection &conn, const json_spirit::Value &id, const json_spirit::Value &result)
+{
+	json_spirit::Object obj;
+	obj.push_back(json_spirit::Pair("id",id));
+	obj.push_back(json_spirit::Pair("result",result));
+	obj.push_back(json_spirit::Pair("error",json_spirit::Value()));
+	SendLine(conn,boost::shared_ptr<const std::string>(new std::string(json_spirit::write(obj)+"\n")));
+}
+
+void BitcoinMinerStratumServer::SendError(connection &conn, const json_spirit::Value &id, const int code, const std::string &message)
+{
+	json_spirit::Array error;
+	error.push_back(code);
+	error.push_back(message);
+	error.push_back(json_spirit::Value());
+
+	json_spirit::Object obj;
+	obj.push_back(json_spirit::Pair("id",id));
+	obj.push_back(json_spirit::Pair("result",json_spirit::Value()));
+	obj.push_back(json_spirit::Pair("error",error));
+	SendLine(conn,boost::shared_ptr<const std::string>(new std::string(json_spirit::write(obj)+"\n")));
+}
+
+void BitcoinMinerStratumServer::SendDifficulty(connection &conn)
+{
+	json_spirit::Array params;
+	params.push_back(conn.m_difficulty);
+
+	json_spirit::Object obj;
+	obj.push_back(json_spirit::Pair("id",json_spirit::Value()));
+	obj.push_back(json_spirit::Pair("method","mining.set_difficulty"));
+	obj.push_back(json_spirit::Pair("params",params));
+	SendLine(conn,boost::shared_ptr<const std::string>(new std::string(json_spirit::write(obj)+"\n")));
+}
+
+void BitcoinMinerStratumServer::SendLine(connection &conn, const boost::shared_ptr<const std::string> &line)
+{
+	std::vector<boost::shared_ptr<const std::string> > fragments(1,line);
+	conn.m_client->SendFragments(fragments);
+}
+
+// difficulty 1 is the target of the first blocks, a difficulty below 1 makes the target that much larger
+const uint256 BitcoinMinerStratumServer::DifficultyToTarget(const double difficulty)
+{
+	const int64 divisor=(std::max)(static_cast<int64>(difficulty*4294967296.0),static_cast<int64>(1));
+	CBigNum bntarget=(CBigNum().SetCompact(0x1d00ffff)<<32)/CBigNum(divisor);
+	if(bntarget>CBigNum(~uint256(0)))
+	{
+		return ~uint256(0);
+	}
+	return bntarget.getuint256();
+}
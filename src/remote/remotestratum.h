@@ -0,0 +1,117 @@
+/**
+    Copyright (C) 2010  puddinpop
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+**/
+
+#ifndef _bitcoin_remote_stratum_
+#define _bitcoin_remote_stratum_
+
+#include "remoteminer.h"
+#include "remoteminerhashrate.h"
+#include <boost/shared_ptr.hpp>
+#include <vector>
+#include <map>
+#include <set>
+#include <string>
+
+/*
+	Newline delimited JSON-RPC frontend for stratum miners, next to the
+	remote miner protocol.  Every job is one coinbase made by the server for
+	all stratum miners, split around 8 bytes at the end of its scriptSig.
+	Each connection gets the first 4 as its extranonce1 and rolls the other 4
+	itself, so the server only checks the shares it is sent, each with a
+	single hash.  Accepted shares are credited with the hashes expected to
+	find them, the same way the remote clients are.  The frontend runs on a
+	thread of its own and uses the server's templates, coinbase and accounting.
+*/
+class BitcoinMinerStratumServer
+{
+public:
+	BitcoinMinerStratumServer(BitcoinMinerRemoteServer *server);
+	~BitcoinMinerStratumServer();
+
+	const bool StartListen(const std::string &bindaddr, const std::string &bindport);
+	const bool Start();
+	void Stop();
+
+private:
+	struct job
+	{
+		job():m_id(0),m_time(0),m_created(0)	{ }
+
+		int64 m_id;
+		boost::shared_ptr<const RemoteBlockTemplate> m_template;
+		CKey m_key;
+		CTransaction m_coinbase;
+		std::vector<unsigned char> m_coinbase1;
+		std::vector<unsigned char> m_coinbase2;
+		unsigned int m_time;
+		time_t m_created;
+		boost::shared_ptr<const std::string> m_notify;		// mining.notify line, the same for every connection
+		std::set<std::vector<unsigned char> > m_shares;		// extranonce1, extranonce2, ntime and nonce of the accepted shares
+	};
+
+	struct connection
+	{
+		connection(RemoteClientConnection *client, const unsigned int extranonce1, const double difficulty);
+
+		RemoteClientConnection *m_client;		// only used for its socket and buffers
+		std::vector<unsigned char> m_extranonce1;
+		bool m_subscribed;
+		std::map<std::string,uint160> m_workers;	// authorized worker names and the address each is credited to
+		double m_difficulty;
+		double m_previousdifficulty;			// still accepted for jobs sent before m_difficultytime
+		time_t m_difficultytime;
+		time_t m_retargettime;
+		double m_retargetdifficulty;			// sum of the difficulty of the shares accepted since m_retargettime
+	};
+
+	static void ThreadStratum(void *arg);
+	void Step();
+	const bool AcceptConnection(const SOCKET listensocket);
+	void CheckNewJob();
+	void CheckDifficulty(connection &conn);
+	void PublishKHash();
+
+	void HandleLine(connection &conn, const std::string &line);
+	void HandleSubscribe(connection &conn, const json_spirit::Value &id);
+	void HandleAuthorize(connection &conn, const json_spirit::Value &id, const json_spirit::Array &params);
+	void HandleSubmit(connection &conn, const json_spirit::Value &id, const json_spirit::Array &params);
+
+	void SendResult(connection &conn, const json_spirit::Value &id, const json_spirit::Value &result);
+	void SendError(connection &conn, const json_spirit::Value &id, const int code, const std::string &message);
+	void SendDifficulty(connection &conn);
+	void SendLine(connection &conn, const boost::shared_ptr<const std::string> &line);
+
+	static const uint256 DifficultyToTarget(const double difficulty);
+
+	BitcoinMinerRemoteServer *m_server;
+	std::vector<SOCKET> m_listensockets;
+	std::vector<connection> m_connections;		// only touched by the stratum thread
+	std::map<int64,job> m_jobs;
+	std::map<uint160,HashRateWindow> m_hashrates;	// hashes credited to each address in the last minute
+	int64 m_nextjobid;
+	unsigned int m_nextextranonce1;
+	double m_startdifficulty;
+	double m_mindifficulty;					// shares are never worth less than BITCOINMINERREMOTE_MINHASHESPERSHARE
+	int m_shareinterval;					// seconds between shares the difficulty of each connection aims for
+	time_t m_lastkhash;
+	bool m_running;
+	bool m_stop;
+
+};
+
+#endif	// _bitcoin_remote_stratum_
@@ -20,8 +20,10 @@ public:
 		WriteStats(); 
 	}
 	
+	// sections are timed on the server thread and the message workers at the same time
 	void Add(const std::string &section, const int64 callcount, const int64 usec)
 	{
+		boost::mutex::scoped_lock lock(m_mutex);
 		m_stats[section].first+=callcount;
 		m_stats[section].second+=usec;
 		if((m_lastwritemillis+m_writedelay)<GetTimeMillis())
@@ -52,6 +54,7 @@ private:
 	int64 m_writedelay;
 	int64 m_lastwritemillis;
 	std::map<std::string,std::pair<int64,int64> > m_stats;
+	boost::mutex m_mutex;
 };
 
 class ScopedTimer
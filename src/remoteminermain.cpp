@@ -18,6 +18,8 @@
 
 #include "remote/remotebitcoinheaders.h"
 #include "remote/remoteminerclient.h"
+#include "remote/remoteminerthreadcpu.h"
+#include "sha256.h"
 
 #include <sstream>
 
@@ -95,8 +97,26 @@ int main(int argc, char *argv[])
 #endif
 	}
 
+#if !defined(_BITCOIN_MINER_CUDA_) && !defined(_BITCOIN_MINER_OPENCL_)
+	{
+		std::string kernel("");
+		if(mapArgs.count("-kernel")>0)
+		{
+			kernel=mapArgs["-kernel"];
+		}
+		const SHA256Kernel *pkernel=SelectSHA256Kernel(kernel,false);
+		std::cout << "Client will use " << pkernel->pszDescription << " SHA-256" << std::endl;
+		RemoteMinerThreadCPU::SetKernel(pkernel);
+	}
+#endif
+
 	RemoteMinerClient client;
 
+	if(mapArgs.count("-fullblock")>0)
+	{
+		client.SetRequestFullBlock(true);
+	}
+
 	client.Run(server,port,password,address,threadcount);
 
 	return 0;
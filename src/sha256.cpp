@@ -13,28 +13,8 @@
 #include <stdint.h>
 #include <stdio.h>
 
-#define NPAR 32
-
-extern void DoubleBlockSHA256(const void* pin, void* pout, const void* pinit, unsigned int hash[8][NPAR], const void* init2);
-
-static const unsigned int sha256_consts[] = {
-    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, /*  0 */
-    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, /*  8 */
-    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, /* 16 */
-    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, /* 24 */
-    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, /* 32 */
-    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, /* 40 */
-    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, /* 48 */
-    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, /* 56 */
-    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-};
+#include "sha256.h"
+#include "sha256simd.h"
 
 
 static inline __m128i Ch(const __m128i b, const __m128i c, const __m128i d) {
@@ -71,6 +51,7 @@ static inline void store_epi32(const __m128i x, unsigned int *x0, unsigned int *
     *x0 = box.ret[3]; *x1 = box.ret[2]; *x2 = box.ret[1]; *x3 = box.ret[0];
 }
 
+#define add3(x0, x1, x2) _mm_add_epi32(_mm_add_epi32(x0, x1), x2)
 #define add4(x0, x1, x2, x3) _mm_add_epi32(_mm_add_epi32(_mm_add_epi32(x0, x1), x2), x3)
 #define add5(x0, x1, x2, x3, x4) _mm_add_epi32(add4(x0, x1, x2, x3), x4)
 
@@ -106,36 +87,10 @@ T* alignup(T* p)
     return u.ptr;
 }
 
-static const unsigned int pSHA256InitState[8] =
-{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
-
-
+// sha256simd.h's 4 lane scan, with the nonce precomputation and the H7 early reject
 unsigned int ScanHash_4WaySSE2(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
 {
-    unsigned int& nNonce = *(unsigned int*)(pdata + 12);
-    for (;;)
-    {
-        nNonce += NPAR;
-        unsigned int thashbuf[9][NPAR];
-        unsigned int (&thash)[9][NPAR] = *alignup<16>(&thashbuf);
-        DoubleBlockSHA256(pdata, phash1, pmidstate, thash, pSHA256InitState);
-
-        for (int j = 0; j < NPAR; j++)
-        {
-            if (thash[7][j] == 0)
-            {
-                for (int i = 0; i < 32/4; i++)
-                    ((unsigned int*)phash)[i] = thash[i][j];
-                return nNonce + j;
-            }
-        }
-
-        if ((nNonce & 0xffff) == 0)
-        {
-            nHashesDone = 0xffff+1;
-            return -1;
-        }
-    }
+    return ScanHash_NWay<4>(pmidstate, pdata, phash1, phash, nHashesDone);
 }
 
 
@@ -157,12 +112,12 @@ void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsigned int
     /* nonce offset for vector */
     __m128i offset = _mm_set_epi32(0x00000003, 0x00000002, 0x00000001, 0x00000000);
 
+    /* rounds 0-3 and W16-W31 less their nonce terms, see sha256simd.h */
+    SHA256NoncePre noncepre;
+    SHA256PrecomputeNonce(noncepre, In, hPre);
+
 
     for(k = 0; k<NPAR; k+=4) {
-        w0 = _mm_set1_epi32(In[0]);
-        w1 = _mm_set1_epi32(In[1]);
-        w2 = _mm_set1_epi32(In[2]);
-        //w3 = _mm_set1_epi32(In[3]); nonce will be later hacked into the hash
         w4 = _mm_set1_epi32(In[4]);
         w5 = _mm_set1_epi32(In[5]);
         w6 = _mm_set1_epi32(In[6]);
@@ -176,25 +131,21 @@ void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsigned int
         w14 = _mm_set1_epi32(In[14]);
         w15 = _mm_set1_epi32(In[15]);
 
-        /* hack nonce into lowest byte of w3 */
+        /* the nonce of each lane, W3 */
         nonce = _mm_set1_epi32(In[3]);
         nonce = _mm_add_epi32(nonce, offset);
         nonce = _mm_add_epi32(nonce, _mm_set1_epi32(k));
-        w3 = nonce;
 
-        a = _mm_set1_epi32(hPre[0]);
-        b = _mm_set1_epi32(hPre[1]);
-        c = _mm_set1_epi32(hPre[2]);
-        d = _mm_set1_epi32(hPre[3]);
-        e = _mm_set1_epi32(hPre[4]);
-        f = _mm_set1_epi32(hPre[5]);
-        g = _mm_set1_epi32(hPre[6]);
-        h = _mm_set1_epi32(hPre[7]);
+        /* state after round 3, only a and e depend on the nonce */
+        a = _mm_add_epi32(_mm_set1_epi32(noncepre.nonce3[0]), nonce);
+        b = _mm_set1_epi32(noncepre.s3[1]);
+        c = _mm_set1_epi32(noncepre.s3[2]);
+        d = _mm_set1_epi32(noncepre.s3[3]);
+        e = _mm_add_epi32(_mm_set1_epi32(noncepre.nonce3[1]), nonce);
+        f = _mm_set1_epi32(noncepre.s3[5]);
+        g = _mm_set1_epi32(noncepre.s3[6]);
+        h = _mm_set1_epi32(noncepre.s3[7]);
 
-        SHA256ROUND(a, b, c, d, e, f, g, h, 0, w0);
-        SHA256ROUND(h, a, b, c, d, e, f, g, 1, w1);
-        SHA256ROUND(g, h, a, b, c, d, e, f, 2, w2);
-        SHA256ROUND(f, g, h, a, b, c, d, e, 3, w3);
         SHA256ROUND(e, f, g, h, a, b, c, d, 4, w4);
         SHA256ROUND(d, e, f, g, h, a, b, c, 5, w5);
         SHA256ROUND(c, d, e, f, g, h, a, b, 6, w6);
@@ -208,37 +159,38 @@ void DoubleBlockSHA256(const void* pin, void* pad, const void *pre, unsigned int
         SHA256ROUND(c, d, e, f, g, h, a, b, 14, w14);
         SHA256ROUND(b, c, d, e, f, g, h, a, 15, w15);
 
-        w0 = add4(SIGMA1_256(w14), w9, SIGMA0_256(w1), w0);
+        /* W16-W31 from the precomputed constants, adding only the nonce terms */
+        w0 = _mm_set1_epi32(noncepre.wc[16]);
         SHA256ROUND(a, b, c, d, e, f, g, h, 16, w0);
-        w1 = add4(SIGMA1_256(w15), w10, SIGMA0_256(w2), w1);
+        w1 = _mm_set1_epi32(noncepre.wc[17]);
         SHA256ROUND(h, a, b, c, d, e, f, g, 17, w1);
-        w2 = add4(SIGMA1_256(w0), w11, SIGMA0_256(w3), w2);
+        w2 = _mm_add_epi32(_mm_set1_epi32(noncepre.wc[18]), SIGMA0_256(nonce));
         SHA256ROUND(g, h, a, b, c, d, e, f, 18, w2);
-        w3 = add4(SIGMA1_256(w1), w12, SIGMA0_256(w4), w3);
+        w3 = _mm_add_epi32(_mm_set1_epi32(noncepre.wc[19]), nonce);
         SHA256ROUND(f, g, h, a, b, c, d, e, 19, w3);
-        w4 = add4(SIGMA1_256(w2), w13, SIGMA0_256(w5), w4);
+        w4 = _mm_add_epi32(_mm_set1_epi32(noncepre.wc[20]), SIGMA1_256(w2));
         SHA256ROUND(e, f, g, h, a, b, c, d, 20, w4);
-        w5 = add4(SIGMA1_256(w3), w14, SIGMA0_256(w6), w5);
+        w5 = _mm_add_epi32(_mm_set1_epi32(noncepre.wc[21]), SIGMA1_256(w3));
         SHA256ROUND(d, e, f, g, h, a, b, c, 21, w5);
-        w6 = add4(SIGMA1_256(w4), w15, SIGMA0_256(w7), w6);
+        w6 = _mm_add_epi32(_mm_set1_epi32(noncepre.wc[22]), SIGMA1_256(w4));
         SHA256ROUND(c, d, e, f, g, h, a, b, 22, w6);
-        w7 = add4(SIGMA1_256(w5), w0, SIGMA0_256(w8), w7);
+        w7 = _mm_add_epi32(_mm_set1_epi32(noncepre.wc[23]), SIGMA1_256(w5));
         SHA256ROUND(b, c, d, e, f, g, h, a, 23, w7);
-        w8 = add4(SIGMA1_256(w6), w1, SIGMA0_256(w9), w8);
+        w8 = _mm_add_epi32(_mm_set1_epi32(noncepre.wc[24]), SIGMA1_256(w6));
         SHA256ROUND(a, b, c, d, e, f, g, h, 24, w8);
-        w9 = add4(SIGMA1_256(w7), w2, SIGMA0_256(w10), w9);
+        w9 = add3(_mm_set1_epi32(noncepre.wc[25]), SIGMA1_256(w7), w2);
         SHA256ROUND(h, a, b, c, d, e, f, g, 25, w9);
-        w10 = add4(SIGMA1_256(w8), w3, SIGMA0_256(w11), w10);
+        w10 = add3(_mm_set1_epi32(noncepre.wc[26]), SIGMA1_256(w8), w3);
         SHA256ROUND(g, h, a, b, c, d, e, f, 26, w10);
-        w11 = add4(SIGMA1_256(w9), w4, SIGMA0_256(w12), w11);
+        w11 = add3(_mm_set1_epi32(noncepre.wc[27]), SIGMA1_256(w9), w4);
         SHA256ROUND(f, g, h, a, b, c, d, e, 27, w11);
-        w12 = add4(SIGMA1_256(w10), w5, SIGMA0_256(w13), w12);
+        w12 = add3(_mm_set1_epi32(noncepre.wc[28]), SIGMA1_256(w10), w5);
         SHA256ROUND(e, f, g, h, a, b, c, d, 28, w12);
-        w13 = add4(SIGMA1_256(w11), w6, SIGMA0_256(w14), w13);
+        w13 = add3(_mm_set1_epi32(noncepre.wc[29]), SIGMA1_256(w11), w6);
         SHA256ROUND(d, e, f, g, h, a, b, c, 29, w13);
-        w14 = add4(SIGMA1_256(w12), w7, SIGMA0_256(w15), w14);
+        w14 = add3(_mm_set1_epi32(noncepre.wc[30]), SIGMA1_256(w12), w7);
         SHA256ROUND(c, d, e, f, g, h, a, b, 30, w14);
-        w15 = add4(SIGMA1_256(w13), w8, SIGMA0_256(w0), w15);
+        w15 = add3(_mm_set1_epi32(noncepre.wc[31]), SIGMA1_256(w13), w8);
         SHA256ROUND(b, c, d, e, f, g, h, a, 31, w15);
 
         w0 = add4(SIGMA1_256(w14), w9, SIGMA0_256(w1), w0);
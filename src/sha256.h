@@ -0,0 +1,86 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SHA256_H
+#define BITCOIN_SHA256_H
+
+#include <string>
+
+// Nonces hashed per DoubleBlockSHA256 call, must divide 0x10000
+#define NPAR 32
+
+//
+// The ScanHash functions all share the ScanHash_CryptoPP interface: pdata
+// is the big endian second half of the block with the nonce at pdata+12,
+// nNonce is advanced in place and nHashesDone is set to 0x10000 when the
+// function gives up and returns -1.
+//
+typedef unsigned int (*ScanHashFunction)(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone);
+
+// Hashes NPAR nonces starting at the one in pin and leaves each lane's
+// final state in thash[0..7][lane] and its nonce in thash[8][lane]
+typedef void (*DoubleBlockSHA256Function)(const void* pin, void* pad, const void* pre, unsigned int thash[9][NPAR], const void* init);
+
+// Crypto++ SHA-256, one nonce at a time
+extern unsigned int ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone);
+extern void DoubleBlockSHA256_CryptoPP(const void* pin, void* pad, const void* pre, unsigned int thash[9][NPAR], const void* init);
+
+#ifdef FOURWAYSSE2
+// tcatm's 4-way 128-bit SSE2 SHA-256
+extern unsigned int ScanHash_4WaySSE2(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone);
+extern void DoubleBlockSHA256(const void* pin, void* pad, const void* pre, unsigned int thash[9][NPAR], const void* init);
+
+// 8-way 256-bit AVX2 SHA-256
+extern unsigned int ScanHash_8WayAVX2(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone);
+extern void DoubleBlockSHA256_8WayAVX2(const void* pin, void* pad, const void* pre, unsigned int thash[9][NPAR], const void* init);
+
+// 16-way 512-bit AVX-512 SHA-256
+extern unsigned int ScanHash_16WayAVX512(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone);
+extern void DoubleBlockSHA256_16WayAVX512(const void* pin, void* pad, const void* pre, unsigned int thash[9][NPAR], const void* init);
+
+// x86 SHA extensions, two nonces interleaved
+extern unsigned int ScanHash_SHANI(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone);
+extern void DoubleBlockSHA256_SHANI(const void* pin, void* pad, const void* pre, unsigned int thash[9][NPAR], const void* init);
+#endif
+
+
+//
+// CPU features the kernels depend on, as reported by CPUID and enabled by
+// the OS.  Always 0 on non-x86 or non-GCC builds.
+//
+enum
+{
+    CPUFEATURE_SSE2     = (1 << 0),
+    CPUFEATURE_SSSE3    = (1 << 1),
+    CPUFEATURE_SSE41    = (1 << 2),
+    CPUFEATURE_AVX      = (1 << 3),
+    CPUFEATURE_AVX2     = (1 << 4),
+    CPUFEATURE_AVX512F  = (1 << 5),
+    CPUFEATURE_SHA      = (1 << 6),
+};
+
+unsigned int GetCPUFeatures();
+std::string FormatCPUFeatures(unsigned int nFeatures);
+
+
+//
+// Registry of the SHA-256 kernels compiled into this binary
+//
+struct SHA256Kernel
+{
+    const char* pszName;            // name for -kernel=
+    const char* pszDescription;     // name for the log
+    unsigned int nFeatures;         // CPUFEATURE_* bits it needs
+    ScanHashFunction pScanHash;
+    DoubleBlockSHA256Function pDoubleBlock;
+};
+
+int GetSHA256Kernels(const SHA256Kernel** ppkernels);
+const SHA256Kernel* FindSHA256Kernel(const std::string& strName);
+bool IsSHA256KernelSupported(const SHA256Kernel* pkernel);
+bool CheckSHA256Kernel(const SHA256Kernel* pkernel);
+double TimeSHA256Kernel(const SHA256Kernel* pkernel, int nMillis, bool fScanHash);
+const SHA256Kernel* SelectSHA256Kernel(const std::string& strName, bool fScanHash);
+
+#endif
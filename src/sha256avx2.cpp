@@ -0,0 +1,25 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+// 8-way 256-bit AVX2 SHA-256, must be compiled with -mavx2
+
+#ifdef FOURWAYSSE2
+
+#ifndef __AVX2__
+#error "sha256avx2.cpp must be compiled with AVX2 enabled"
+#endif
+
+#include "sha256simd.h"
+
+unsigned int ScanHash_8WayAVX2(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
+{
+    return ScanHash_NWay<8>(pmidstate, pdata, phash1, phash, nHashesDone);
+}
+
+void DoubleBlockSHA256_8WayAVX2(const void* pin, void* pad, const void* pre, unsigned int thash[9][NPAR], const void* init)
+{
+    DoubleBlockSHA256N<8>(pin, pad, pre, thash, init);
+}
+
+#endif // FOURWAYSSE2
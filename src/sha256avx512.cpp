@@ -0,0 +1,25 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+// 16-way 512-bit AVX-512 SHA-256, must be compiled with -mavx512f
+
+#ifdef FOURWAYSSE2
+
+#ifndef __AVX512F__
+#error "sha256avx512.cpp must be compiled with AVX-512 enabled"
+#endif
+
+#include "sha256simd.h"
+
+unsigned int ScanHash_16WayAVX512(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
+{
+    return ScanHash_NWay<16>(pmidstate, pdata, phash1, phash, nHashesDone);
+}
+
+void DoubleBlockSHA256_16WayAVX512(const void* pin, void* pad, const void* pre, unsigned int thash[9][NPAR], const void* init)
+{
+    DoubleBlockSHA256N<16>(pin, pad, pre, thash, init);
+}
+
+#endif // FOURWAYSSE2
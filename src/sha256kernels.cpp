@@ -0,0 +1,384 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+// CPU feature probe and the registry of SHA-256 scanning kernels
+
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/date_time/gregorian/gregorian_types.hpp>
+
+#include "cryptopp/sha.h"
+#include "sha256.h"
+#include "sha256simd.h"
+
+#if defined(__GNUC__) && defined(CRYPTOPP_X86_ASM_AVAILABLE)
+#include <cpuid.h>
+#endif
+
+// bitcoin and bitcoinr both provide this, see util.h
+extern int OutputDebugStringF(const char* pszFormat, ...);
+#define printf OutputDebugStringF
+
+template<size_t nBytes, typename T>
+T* alignup(T* p)
+{
+    union
+    {
+        T* ptr;
+        size_t n;
+    } u;
+    u.ptr = p;
+    u.n = (u.n + (nBytes-1)) & ~(nBytes-1);
+    return u.ptr;
+}
+
+static inline void SHA256Transform(void* pstate, void* pinput, const void* pinit)
+{
+    memcpy(pstate, pinit, 32);
+    CryptoPP::SHA256::Transform((CryptoPP::word32*)pstate, (CryptoPP::word32*)pinput);
+}
+
+
+
+//
+// CPU features
+//
+
+#if defined(__GNUC__) && defined(CRYPTOPP_X86_ASM_AVAILABLE)
+static unsigned int GetXCR0()
+{
+    unsigned int a, d;
+    asm (
+        ".byte 0x0f, 0x01, 0xd0;" // xgetbv
+        :"=a"(a),"=d"(d) /* output */
+        :"c"(0) /* input */
+    );
+    return a;
+}
+
+static unsigned int ProbeCPUFeatures()
+{
+    unsigned int a, b, c, d;
+    unsigned int nFeatures = 0;
+    unsigned int nMaxLeaf = __get_cpuid_max(0, NULL);
+    if (nMaxLeaf < 1)
+        return 0;
+
+    __cpuid(1, a, b, c, d);
+    if (d & (1 << 26)) nFeatures |= CPUFEATURE_SSE2;
+    if (c & (1 << 9))  nFeatures |= CPUFEATURE_SSSE3;
+    if (c & (1 << 19)) nFeatures |= CPUFEATURE_SSE41;
+
+    // The vector registers are only usable if the OS saves them on a
+    // context switch: YMM needs XCR0 bits 1-2, ZMM and opmask bits 5-7 too
+    bool fOSXSAVE = (c & (1 << 27)) != 0;
+    unsigned int nXCR0 = fOSXSAVE ? GetXCR0() : 0;
+    bool fYMM = (nXCR0 & 0x06) == 0x06;
+    bool fZMM = fYMM && (nXCR0 & 0xe0) == 0xe0;
+    if (fYMM && (c & (1 << 28)))
+        nFeatures |= CPUFEATURE_AVX;
+
+    if (nMaxLeaf >= 7)
+    {
+        __cpuid_count(7, 0, a, b, c, d);
+        if ((nFeatures & CPUFEATURE_AVX) && (b & (1 << 5)))
+            nFeatures |= CPUFEATURE_AVX2;
+        if (fZMM && (b & (1 << 16)))
+            nFeatures |= CPUFEATURE_AVX512F;
+        if (b & (1 << 29))
+            nFeatures |= CPUFEATURE_SHA;
+    }
+    return nFeatures;
+}
+#else
+static unsigned int ProbeCPUFeatures() { return 0; }
+#endif
+
+unsigned int GetCPUFeatures()
+{
+    static unsigned int nFeatures = ProbeCPUFeatures();
+    return nFeatures;
+}
+
+std::string FormatCPUFeatures(unsigned int nFeatures)
+{
+    static const struct { unsigned int nFlag; const char* pszName; } features[] =
+    {
+        { CPUFEATURE_SSE2,    "sse2" },
+        { CPUFEATURE_SSSE3,   "ssse3" },
+        { CPUFEATURE_SSE41,   "sse4.1" },
+        { CPUFEATURE_AVX,     "avx" },
+        { CPUFEATURE_AVX2,    "avx2" },
+        { CPUFEATURE_AVX512F, "avx512f" },
+        { CPUFEATURE_SHA,     "sha" },
+    };
+    std::string str;
+    for (int i = 0; i < sizeof(features)/sizeof(features[0]); i++)
+    {
+        if (nFeatures & features[i].nFlag)
+        {
+            if (!str.empty())
+                str += " ";
+            str += features[i].pszName;
+        }
+    }
+    return str.empty() ? "none" : str;
+}
+
+
+
+//
+// Crypto++ kernel, works everywhere
+//
+
+//
+// ScanHash scans nonces looking for a hash with at least some zero bits.
+// It operates on big endian data.  Caller does the byte reversing.
+// All input buffers are 16-byte aligned.  nNonce is usually preserved
+// between calls, but periodically or if nNonce is 0xffff0000 or above,
+// the block is rebuilt and nNonce starts over at zero.
+//
+// Crypto++ can't start a hash part way through, so the scan runs the one
+// lane version of the vector code with the nonce precomputation and the
+// H7 early reject.
+//
+unsigned int ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
+{
+    return ScanHash_NWay<1>(pmidstate, pdata, phash1, phash, nHashesDone);
+}
+
+void DoubleBlockSHA256_CryptoPP(const void* pin, void* pad, const void* pre, unsigned int thash[9][NPAR], const void* init)
+{
+    unsigned int pdatabuf[16+4]; unsigned int* pdata = alignup<16>(pdatabuf);
+    unsigned int ptmpbuf[16+4];  unsigned int* ptmp  = alignup<16>(ptmpbuf);
+    unsigned int phashbuf[8+4];  unsigned int* phash = alignup<16>(phashbuf);
+    memcpy(pdata, pin, 64);
+    memcpy(ptmp, pad, 64);
+
+    for (int j = 0; j < NPAR; j++)
+    {
+        SHA256Transform(ptmp, pdata, pre);
+        SHA256Transform(phash, ptmp, init);
+        for (int i = 0; i < 8; i++)
+            thash[i][j] = phash[i];
+        thash[8][j] = pdata[3]++;
+    }
+}
+
+
+
+//
+// Registry
+//
+
+static const SHA256Kernel vSHA256Kernels[] =
+{
+    { "cryptopp", "Crypto++",       0,                                                 ScanHash_CryptoPP,    DoubleBlockSHA256_CryptoPP },
+#ifdef FOURWAYSSE2
+    { "sse2",     "4-way SSE2",     CPUFEATURE_SSE2,                                   ScanHash_4WaySSE2,    DoubleBlockSHA256 },
+    { "avx2",     "8-way AVX2",     CPUFEATURE_AVX2,                                   ScanHash_8WayAVX2,    DoubleBlockSHA256_8WayAVX2 },
+    { "avx512",   "16-way AVX-512", CPUFEATURE_AVX512F,                                ScanHash_16WayAVX512, DoubleBlockSHA256_16WayAVX512 },
+    { "shani",    "SHA-NI",         CPUFEATURE_SHA|CPUFEATURE_SSSE3|CPUFEATURE_SSE41, ScanHash_SHANI,       DoubleBlockSHA256_SHANI },
+#endif
+};
+
+int GetSHA256Kernels(const SHA256Kernel** ppkernels)
+{
+    *ppkernels = vSHA256Kernels;
+    return sizeof(vSHA256Kernels)/sizeof(vSHA256Kernels[0]);
+}
+
+const SHA256Kernel* FindSHA256Kernel(const std::string& strName)
+{
+    for (int i = 0; i < sizeof(vSHA256Kernels)/sizeof(vSHA256Kernels[0]); i++)
+        if (strName == vSHA256Kernels[i].pszName)
+            return &vSHA256Kernels[i];
+    return NULL;
+}
+
+bool IsSHA256KernelSupported(const SHA256Kernel* pkernel)
+{
+    return (GetCPUFeatures() & pkernel->nFeatures) == pkernel->nFeatures;
+}
+
+//
+// Hash one batch with the kernel and compare every lane with Crypto++
+//
+bool CheckSHA256Kernel(const SHA256Kernel* pkernel)
+{
+    unsigned int pmidstatebuf[8+4]; unsigned int* pmidstate = alignup<16>(pmidstatebuf);
+    unsigned int pdatabuf[16+4];    unsigned int* pdata     = alignup<16>(pdatabuf);
+    unsigned int phash1buf[16+4];   unsigned int* phash1    = alignup<16>(phash1buf);
+    unsigned int ptmpbuf[16+4];     unsigned int* ptmp      = alignup<16>(ptmpbuf);
+    unsigned int phashbuf[8+4];     unsigned int* phash     = alignup<16>(phashbuf);
+    unsigned int thash[9][NPAR];
+
+    // Arbitrary but fixed midstate and block tail, the nonce starts close
+    // enough to a carry that the lanes have to propagate it
+    for (int i = 0; i < 8; i++)
+        pmidstate[i] = pSHA256InitState[i] ^ (0x9e3779b9 * (i + 1));
+    for (int i = 0; i < 16; i++)
+        pdata[i] = 0x01234567 * (i + 3);
+    pdata[3] = 0x0000ffe0;
+    memset(phash1, 0, 64);
+    phash1[8] = 0x80000000;
+    phash1[15] = 256;
+
+    pkernel->pDoubleBlock(pdata, phash1, pmidstate, thash, pSHA256InitState);
+
+    bool fOk = true;
+    for (int j = 0; j < NPAR; j++, pdata[3]++)
+    {
+        memcpy(ptmp, phash1, 64);
+        SHA256Transform(ptmp, pdata, pmidstate);
+        SHA256Transform(phash, ptmp, pSHA256InitState);
+
+        if (thash[8][j] != pdata[3])
+            fOk = false;
+        for (int i = 0; i < 8; i++)
+            if (thash[i][j] != phash[i])
+                fOk = false;
+    }
+
+    // ScanHash rejects on H7 alone, so it needs a real hit: the genesis
+    // block header, with its nonce part way into a batch
+    static const unsigned int pGenesis[20] =
+    {
+        0x01000000, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x3ba3edfd, 0x7a7b12b2, 0x7ac72c3e, 0x67768f61, 0x7fc81bc3, 0x888a5132, 0x3a9fb8aa,
+        0x4b1e5e4a, 0x29ab5f49, 0xffff001d, 0x1dac2b7c,
+    };
+    memcpy(ptmp, pGenesis, 64);
+    SHA256Transform(pmidstate, ptmp, pSHA256InitState);
+    memset(pdata, 0, 64);
+    memcpy(pdata, &pGenesis[16], 16);
+    pdata[4] = 0x80000000;
+    pdata[15] = 640;
+
+    memcpy(ptmp, phash1, 64);
+    SHA256Transform(ptmp, pdata, pmidstate);
+    unsigned int phashGenesis[8];
+    SHA256Transform(phashGenesis, ptmp, pSHA256InitState);
+
+    pdata[3] = pGenesis[19] - NPAR - 5;
+    unsigned int nHashesDone = 0;
+    if (pkernel->pScanHash((char*)pmidstate, (char*)pdata, (char*)phash1, (char*)phash, nHashesDone) != pGenesis[19] ||
+        memcmp(phash, phashGenesis, 32) != 0)
+        fOk = false;
+    return fOk;
+}
+
+static int64_t GetTimeMicros()
+{
+    return (boost::posix_time::microsec_clock::universal_time() -
+            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
+}
+
+//
+// Hashes per second the kernel manages on this thread in about nMillis,
+// through pScanHash if fScanHash is set and through pDoubleBlock otherwise
+//
+double TimeSHA256Kernel(const SHA256Kernel* pkernel, int nMillis, bool fScanHash)
+{
+    unsigned int pdatabuf[16+4];  unsigned int* pdata  = alignup<16>(pdatabuf);
+    unsigned int phash1buf[16+4]; unsigned int* phash1 = alignup<16>(phash1buf);
+    unsigned int pmidbuf[8+4];    unsigned int* pmid   = alignup<16>(pmidbuf);
+    unsigned int phashbuf[8+4];   unsigned int* phash  = alignup<16>(phashbuf);
+    unsigned int thash[9][NPAR];
+    memset(pdata, 0, 64);
+    memset(phash1, 0, 64);
+    memcpy(pmid, pSHA256InitState, 32);
+
+    int64_t nStart = GetTimeMicros();
+    int64_t nElapsed = 0;
+    int64_t nHashes = 0;
+    do
+    {
+        if (fScanHash)
+        {
+            // Count the nonces the scanner went through, it returns early
+            // whenever a nonce passes its quick test
+            unsigned int nNonceStart = pdata[3];
+            while ((unsigned int)(pdata[3] - nNonceStart) < 0x10000)
+            {
+                unsigned int nHashesDone = 0;
+                pkernel->pScanHash((char*)pmid, (char*)pdata, (char*)phash1, (char*)phash, nHashesDone);
+            }
+            nHashes += (unsigned int)(pdata[3] - nNonceStart);
+        }
+        else
+        {
+            for (int i = 0; i < 64; i++)
+            {
+                pkernel->pDoubleBlock(pdata, phash1, pmid, thash, pSHA256InitState);
+                pdata[3] += NPAR;
+            }
+            nHashes += 64 * NPAR;
+        }
+        nElapsed = GetTimeMicros() - nStart;
+    }
+    while (nElapsed < nMillis * 1000);
+
+    return (double)nHashes * 1000000.0 / (double)nElapsed;
+}
+
+//
+// Pick the kernel to mine with.  strName forces one of the registered
+// kernels, otherwise every kernel the CPU supports is checked against
+// Crypto++ and timed, and the fastest wins.  fScanHash says which entry
+// point the caller hashes with, BitcoinMiner uses pScanHash and the remote
+// miner pDoubleBlock.  The automatic choice for each is only calibrated
+// once per process.
+//
+const SHA256Kernel* SelectSHA256Kernel(const std::string& strName, bool fScanHash)
+{
+    static boost::mutex mutex;
+    static const SHA256Kernel* pkernelAutoScan = NULL;
+    static const SHA256Kernel* pkernelAutoDouble = NULL;
+    const SHA256Kernel*& pkernelAuto = (fScanHash ? pkernelAutoScan : pkernelAutoDouble);
+    boost::mutex::scoped_lock lock(mutex);
+
+    if (!strName.empty() && strName != "auto")
+    {
+        const SHA256Kernel* pkernel = FindSHA256Kernel(strName);
+        if (!pkernel)
+            printf("SHA-256 kernel %s is unknown, picking one automatically\n", strName.c_str());
+        else if (!IsSHA256KernelSupported(pkernel))
+            printf("SHA-256 kernel %s is not supported by this CPU, picking one automatically\n", strName.c_str());
+        else if (!CheckSHA256Kernel(pkernel))
+            printf("ERROR: %s SHA-256 doesn't match Crypto++, picking one automatically\n", pkernel->pszDescription);
+        else
+            return pkernel;
+    }
+
+    if (pkernelAuto)
+        return pkernelAuto;
+
+    printf("CPU features: %s\n", FormatCPUFeatures(GetCPUFeatures()).c_str());
+    pkernelAuto = &vSHA256Kernels[0];
+    double dBest = 0;
+    for (int i = 0; i < sizeof(vSHA256Kernels)/sizeof(vSHA256Kernels[0]); i++)
+    {
+        const SHA256Kernel* pkernel = &vSHA256Kernels[i];
+        if (!IsSHA256KernelSupported(pkernel))
+            continue;
+        if (!CheckSHA256Kernel(pkernel))
+        {
+            printf("ERROR: %s SHA-256 doesn't match Crypto++, not using it\n", pkernel->pszDescription);
+            continue;
+        }
+        double dSpeed = TimeSHA256Kernel(pkernel, 50, fScanHash);
+        printf("SHA-256 kernel %-8s %8.0f khash/s %s\n", pkernel->pszName, dSpeed / 1000.0, fScanHash ? "ScanHash" : "DoubleBlock");
+        if (dSpeed > dBest)
+        {
+            dBest = dSpeed;
+            pkernelAuto = pkernel;
+        }
+    }
+    return pkernelAuto;
+}
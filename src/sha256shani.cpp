@@ -0,0 +1,247 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+// SHA-256 using the x86 SHA extensions, must be compiled with -msha -msse4.1
+
+#ifdef FOURWAYSSE2
+
+#if !defined(__SHA__) || !defined(__SSE4_1__)
+#error "sha256shani.cpp must be compiled with SHA and SSE4.1 enabled"
+#endif
+
+#include <immintrin.h>
+
+#include "sha256.h"
+
+namespace
+{
+
+static const unsigned int sha256_consts[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, /*  0 */
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, /*  8 */
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, /* 16 */
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, /* 24 */
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, /* 32 */
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, /* 40 */
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, /* 48 */
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, /* 56 */
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const unsigned int pSHA256InitState[8] =
+{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+// sha256rnds2 wants the state as ABEF and CDGH instead of ABCD and EFGH
+static inline void LoadState(const unsigned int* h, __m128i& s0, __m128i& s1)
+{
+    __m128i t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&h[0]), 0xB1);
+    s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&h[4]), 0x1B);
+    s0 = _mm_alignr_epi8(t, s1, 8);
+    s1 = _mm_blend_epi16(s1, t, 0xF0);
+}
+
+static inline void StoreState(unsigned int* h, __m128i s0, __m128i s1)
+{
+    __m128i t = _mm_shuffle_epi32(s0, 0x1B);
+    s1 = _mm_shuffle_epi32(s1, 0xB1);
+    _mm_storeu_si128((__m128i*)&h[0], _mm_blend_epi16(t, s1, 0xF0));
+    _mm_storeu_si128((__m128i*)&h[4], _mm_alignr_epi8(s1, t, 8));
+}
+
+// Four rounds of two independent streams, interleaved so one stream's
+// sha256rnds2 latency is hidden behind the other's
+#define QROUND2(i) \
+{ \
+    if (i >= 4) \
+    { \
+        a[i&3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(a[i&3], a[(i+1)&3]), _mm_alignr_epi8(a[(i+3)&3], a[(i+2)&3], 4)), a[(i+3)&3]); \
+        b[i&3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(b[i&3], b[(i+1)&3]), _mm_alignr_epi8(b[(i+3)&3], b[(i+2)&3], 4)), b[(i+3)&3]); \
+    } \
+    __m128i k = _mm_loadu_si128((const __m128i*)&sha256_consts[4*i]); \
+    __m128i ma = _mm_add_epi32(a[i&3], k); \
+    __m128i mb = _mm_add_epi32(b[i&3], k); \
+    as1 = _mm_sha256rnds2_epu32(as1, as0, ma); \
+    bs1 = _mm_sha256rnds2_epu32(bs1, bs0, mb); \
+    as0 = _mm_sha256rnds2_epu32(as0, as1, _mm_shuffle_epi32(ma, 0x0E)); \
+    bs0 = _mm_sha256rnds2_epu32(bs0, bs1, _mm_shuffle_epi32(mb, 0x0E)); \
+}
+
+// 64 rounds on two blocks whose words are already in host order
+static inline void SHA256Rounds2(__m128i& as0, __m128i& as1, __m128i a[4], __m128i& bs0, __m128i& bs1, __m128i b[4])
+{
+    QROUND2(0);  QROUND2(1);  QROUND2(2);  QROUND2(3);
+    QROUND2(4);  QROUND2(5);  QROUND2(6);  QROUND2(7);
+    QROUND2(8);  QROUND2(9);  QROUND2(10); QROUND2(11);
+    QROUND2(12); QROUND2(13); QROUND2(14); QROUND2(15);
+}
+
+// Rounds 2-63, the caller did rounds 0 and 1 once for every nonce: as0 and
+// bs0 hold the state before them, as1 and bs1 the ABEF half after them
+static inline void SHA256Rounds2From2(__m128i& as0, __m128i& as1, __m128i a[4], __m128i& bs0, __m128i& bs1, __m128i b[4])
+{
+    __m128i k = _mm_loadu_si128((const __m128i*)&sha256_consts[0]);
+    as0 = _mm_sha256rnds2_epu32(as0, as1, _mm_shuffle_epi32(_mm_add_epi32(a[0], k), 0x0E));
+    bs0 = _mm_sha256rnds2_epu32(bs0, bs1, _mm_shuffle_epi32(_mm_add_epi32(b[0], k), 0x0E));
+    QROUND2(1);  QROUND2(2);  QROUND2(3);
+    QROUND2(4);  QROUND2(5);  QROUND2(6);  QROUND2(7);
+    QROUND2(8);  QROUND2(9);  QROUND2(10); QROUND2(11);
+    QROUND2(12); QROUND2(13); QROUND2(14); QROUND2(15);
+}
+
+// Rounds 0-61, after which F has become the H of round 63, so that is all
+// the H7 == 0 test needs.  Returns F of each stream in the low lane.
+static inline void SHA256Rounds2H7(__m128i& as0, __m128i& as1, __m128i a[4], __m128i& bs0, __m128i& bs1, __m128i b[4])
+{
+    QROUND2(0);  QROUND2(1);  QROUND2(2);  QROUND2(3);
+    QROUND2(4);  QROUND2(5);  QROUND2(6);  QROUND2(7);
+    QROUND2(8);  QROUND2(9);  QROUND2(10); QROUND2(11);
+    QROUND2(12); QROUND2(13); QROUND2(14);
+    a[3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(a[3], a[0]), _mm_alignr_epi8(a[2], a[1], 4)), a[2]);
+    b[3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(b[3], b[0]), _mm_alignr_epi8(b[2], b[1], 4)), b[2]);
+    __m128i k = _mm_loadu_si128((const __m128i*)&sha256_consts[60]);
+    as1 = _mm_sha256rnds2_epu32(as1, as0, _mm_add_epi32(a[3], k));
+    bs1 = _mm_sha256rnds2_epu32(bs1, bs0, _mm_add_epi32(b[3], k));
+}
+
+}
+
+//
+// ScanHash with the nonce precomputation and the H7 early reject.  Only a
+// batch that has a zero H7 is hashed in full, to hand back the hash.
+//
+unsigned int ScanHash_SHANI(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
+{
+    unsigned int& nNonce = *(unsigned int*)(pdata + 12);
+    const unsigned int* In = (const unsigned int*)pdata;
+    const unsigned int* Pad = (const unsigned int*)phash1;
+    __m128i pres0, pres1, inits0, inits1;
+    LoadState((const unsigned int*)pmidstate, pres0, pres1);
+    LoadState(pSHA256InitState, inits0, inits1);
+
+    __m128i in[4], padhi[2];
+    for (int i = 0; i < 4; i++)
+        in[i] = _mm_loadu_si128((const __m128i*)&In[4*i]);
+    padhi[0] = _mm_loadu_si128((const __m128i*)&Pad[8]);
+    padhi[1] = _mm_loadu_si128((const __m128i*)&Pad[12]);
+
+    // rounds 0 and 1 only see W0 and W1, which are the same for every nonce
+    __m128i pre1 = _mm_sha256rnds2_epu32(pres1, pres0, _mm_add_epi32(in[0], _mm_loadu_si128((const __m128i*)&sha256_consts[0])));
+
+    unsigned int h7[NPAR];
+    for (;;)
+    {
+        nNonce += NPAR;
+        for (unsigned int k = 0; k < NPAR; k += 2)
+        {
+            __m128i a[4], b[4];
+            for (int i = 0; i < 4; i++)
+                a[i] = b[i] = in[i];
+            a[0] = _mm_insert_epi32(a[0], nNonce + k, 3);
+            b[0] = _mm_insert_epi32(b[0], nNonce + k + 1, 3);
+
+            // first hash, continuing from rounds 0 and 1
+            __m128i as0 = pres0, as1 = pre1, bs0 = pres0, bs1 = pre1;
+            SHA256Rounds2From2(as0, as1, a, bs0, bs1, b);
+            as0 = _mm_add_epi32(as0, pres0); as1 = _mm_add_epi32(as1, pres1);
+            bs0 = _mm_add_epi32(bs0, pres0); bs1 = _mm_add_epi32(bs1, pres1);
+
+            unsigned int ha[8], hb[8];
+            StoreState(ha, as0, as1);
+            StoreState(hb, bs0, bs1);
+            a[0] = _mm_loadu_si128((const __m128i*)&ha[0]); a[1] = _mm_loadu_si128((const __m128i*)&ha[4]);
+            b[0] = _mm_loadu_si128((const __m128i*)&hb[0]); b[1] = _mm_loadu_si128((const __m128i*)&hb[4]);
+            a[2] = b[2] = padhi[0];
+            a[3] = b[3] = padhi[1];
+
+            // second hash, as far as H7
+            as0 = inits0; as1 = inits1; bs0 = inits0; bs1 = inits1;
+            SHA256Rounds2H7(as0, as1, a, bs0, bs1, b);
+            h7[k] = _mm_cvtsi128_si32(as1) + pSHA256InitState[7];
+            h7[k+1] = _mm_cvtsi128_si32(bs1) + pSHA256InitState[7];
+        }
+
+        for (int j = 0; j < NPAR; j++)
+        {
+            if (h7[j] == 0)
+            {
+                unsigned int thash[9][NPAR];
+                DoubleBlockSHA256_SHANI(pdata, phash1, pmidstate, thash, pSHA256InitState);
+                for (int i = 0; i < 32/4; i++)
+                    ((unsigned int*)phash)[i] = thash[i][j];
+                return nNonce + j;
+            }
+        }
+
+        if ((nNonce & 0xffff) == 0)
+        {
+            nHashesDone = 0xffff+1;
+            return -1;
+        }
+    }
+}
+
+void DoubleBlockSHA256_SHANI(const void* pin, void* pad, const void* pre, unsigned int thash[9][NPAR], const void* init)
+{
+    const unsigned int* In = (const unsigned int*)pin;
+    const unsigned int* Pad = (const unsigned int*)pad;
+    __m128i pres0, pres1, inits0, inits1;
+    LoadState((const unsigned int*)pre, pres0, pres1);
+    LoadState((const unsigned int*)init, inits0, inits1);
+
+    __m128i in[4], padhi[2];
+    for (int i = 0; i < 4; i++)
+        in[i] = _mm_loadu_si128((const __m128i*)&In[4*i]);
+    padhi[0] = _mm_loadu_si128((const __m128i*)&Pad[8]);
+    padhi[1] = _mm_loadu_si128((const __m128i*)&Pad[12]);
+
+    // rounds 0 and 1 don't depend on the nonce
+    __m128i pre1 = _mm_sha256rnds2_epu32(pres1, pres0, _mm_add_epi32(in[0], _mm_loadu_si128((const __m128i*)&sha256_consts[0])));
+
+    for (unsigned int k = 0; k < NPAR; k += 2)
+    {
+        unsigned int nNonce = In[3] + k;
+        __m128i a[4], b[4];
+        for (int i = 0; i < 4; i++)
+            a[i] = b[i] = in[i];
+        a[0] = _mm_insert_epi32(a[0], nNonce, 3);
+        b[0] = _mm_insert_epi32(b[0], nNonce + 1, 3);
+
+        // first hash, continuing from rounds 0 and 1
+        __m128i as0 = pres0, as1 = pre1, bs0 = pres0, bs1 = pre1;
+        SHA256Rounds2From2(as0, as1, a, bs0, bs1, b);
+        as0 = _mm_add_epi32(as0, pres0); as1 = _mm_add_epi32(as1, pres1);
+        bs0 = _mm_add_epi32(bs0, pres0); bs1 = _mm_add_epi32(bs1, pres1);
+
+        // second hash of the 32 byte result plus padding
+        unsigned int ha[8], hb[8];
+        StoreState(ha, as0, as1);
+        StoreState(hb, bs0, bs1);
+        a[0] = _mm_loadu_si128((const __m128i*)&ha[0]); a[1] = _mm_loadu_si128((const __m128i*)&ha[4]);
+        b[0] = _mm_loadu_si128((const __m128i*)&hb[0]); b[1] = _mm_loadu_si128((const __m128i*)&hb[4]);
+        a[2] = b[2] = padhi[0];
+        a[3] = b[3] = padhi[1];
+
+        as0 = inits0; as1 = inits1; bs0 = inits0; bs1 = inits1;
+        SHA256Rounds2(as0, as1, a, bs0, bs1, b);
+        StoreState(ha, _mm_add_epi32(as0, inits0), _mm_add_epi32(as1, inits1));
+        StoreState(hb, _mm_add_epi32(bs0, inits0), _mm_add_epi32(bs1, inits1));
+
+        for (int i = 0; i < 8; i++)
+        {
+            thash[i][k] = ha[i];
+            thash[i][k+1] = hb[i];
+        }
+        thash[8][k] = nNonce;
+        thash[8][k+1] = nNonce + 1;
+    }
+}
+
+#endif // FOURWAYSSE2
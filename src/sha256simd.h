@@ -0,0 +1,447 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+// Lane-count templated SHA-256, generalised from tcatm's 4-way SSE2 code in
+// sha256.cpp.  Each translation unit that includes this is compiled with the
+// instruction set flags for the widths it instantiates, so everything here
+// stays in an anonymous namespace to keep the copies from being merged.
+
+#ifndef BITCOIN_SHA256SIMD_H
+#define BITCOIN_SHA256SIMD_H
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "sha256.h"
+
+namespace
+{
+
+const unsigned int sha256_consts[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, /*  0 */
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, /*  8 */
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, /* 16 */
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, /* 24 */
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, /* 32 */
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, /* 40 */
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, /* 48 */
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, /* 56 */
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+const unsigned int pSHA256InitState[8] =
+{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+//
+// SHA256Lanes<N> wraps the N x 32-bit vector operations the rounds need.
+// Ch, Maj and Xor3 are members so AVX-512 can use ternary logic for them.
+//
+template <int LANES>
+struct SHA256Lanes;
+
+// One lane in a plain register, for the nonce precomputation and the
+// Crypto++ kernel's scan
+template <>
+struct SHA256Lanes<1>
+{
+    typedef unsigned int vec;
+    static inline vec Set1(unsigned int x)          { return x; }
+    static inline vec Add(vec x, vec y)             { return x + y; }
+    static inline vec Xor3(vec x, vec y, vec z)     { return x ^ y ^ z; }
+    static inline vec Ch(vec b, vec c, vec d)       { return (b & c) ^ (~b & d); }
+    static inline vec Maj(vec b, vec c, vec d)      { return (b & c) | (d & (b | c)); }
+    template <int n> static inline vec ROTR(vec x)  { return (x >> n) | (x << (32 - n)); }
+    template <int n> static inline vec SHR(vec x)   { return x >> n; }
+    static inline vec LaneOffset()                  { return 0; }
+    static inline void Store(unsigned int* p, vec x) { *p = x; }
+};
+
+#ifdef __SSE2__
+template <>
+struct SHA256Lanes<4>
+{
+    typedef __m128i vec;
+    static inline vec Set1(unsigned int x)          { return _mm_set1_epi32(x); }
+    static inline vec Add(vec x, vec y)             { return _mm_add_epi32(x, y); }
+    static inline vec Xor3(vec x, vec y, vec z)     { return _mm_xor_si128(_mm_xor_si128(x, y), z); }
+    static inline vec Ch(vec b, vec c, vec d)       { return _mm_xor_si128(_mm_and_si128(b, c), _mm_andnot_si128(b, d)); }
+    static inline vec Maj(vec b, vec c, vec d)      { return _mm_or_si128(_mm_and_si128(b, c), _mm_and_si128(d, _mm_or_si128(b, c))); }
+    template <int n> static inline vec ROTR(vec x)  { return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+    template <int n> static inline vec SHR(vec x)   { return _mm_srli_epi32(x, n); }
+    static inline vec LaneOffset()                  { return _mm_set_epi32(3, 2, 1, 0); }
+    static inline void Store(unsigned int* p, vec x) { _mm_storeu_si128((__m128i*)p, x); }
+};
+#endif
+
+#ifdef __AVX2__
+template <>
+struct SHA256Lanes<8>
+{
+    typedef __m256i vec;
+    static inline vec Set1(unsigned int x)          { return _mm256_set1_epi32(x); }
+    static inline vec Add(vec x, vec y)             { return _mm256_add_epi32(x, y); }
+    static inline vec Xor3(vec x, vec y, vec z)     { return _mm256_xor_si256(_mm256_xor_si256(x, y), z); }
+    static inline vec Ch(vec b, vec c, vec d)       { return _mm256_xor_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d)); }
+    static inline vec Maj(vec b, vec c, vec d)      { return _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c))); }
+    template <int n> static inline vec ROTR(vec x)  { return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+    template <int n> static inline vec SHR(vec x)   { return _mm256_srli_epi32(x, n); }
+    static inline vec LaneOffset()                  { return _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0); }
+    static inline void Store(unsigned int* p, vec x) { _mm256_storeu_si256((__m256i*)p, x); }
+};
+#endif
+
+#ifdef __AVX512F__
+template <>
+struct SHA256Lanes<16>
+{
+    typedef __m512i vec;
+    static inline vec Set1(unsigned int x)          { return _mm512_set1_epi32(x); }
+    static inline vec Add(vec x, vec y)             { return _mm512_add_epi32(x, y); }
+    static inline vec Xor3(vec x, vec y, vec z)     { return _mm512_ternarylogic_epi32(x, y, z, 0x96); }
+    static inline vec Ch(vec b, vec c, vec d)       { return _mm512_ternarylogic_epi32(b, c, d, 0xca); }
+    static inline vec Maj(vec b, vec c, vec d)      { return _mm512_ternarylogic_epi32(b, c, d, 0xe8); }
+    template <int n> static inline vec ROTR(vec x)  { return _mm512_ror_epi32(x, n); }
+    template <int n> static inline vec SHR(vec x)   { return _mm512_srli_epi32(x, n); }
+    static inline vec LaneOffset()                  { return _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0); }
+    static inline void Store(unsigned int* p, vec x) { _mm512_storeu_si512((void*)p, x); }
+};
+#endif
+
+/* SHA256 Functions */
+#define BIGSIGMA0_256N(x)   (L::Xor3(L::template ROTR<2>(x), L::template ROTR<13>(x), L::template ROTR<22>(x)))
+#define BIGSIGMA1_256N(x)   (L::Xor3(L::template ROTR<6>(x), L::template ROTR<11>(x), L::template ROTR<25>(x)))
+#define SIGMA0_256N(x)      (L::Xor3(L::template ROTR<7>(x), L::template ROTR<18>(x), L::template SHR<3>(x)))
+#define SIGMA1_256N(x)      (L::Xor3(L::template ROTR<17>(x), L::template ROTR<19>(x), L::template SHR<10>(x)))
+
+#define add4N(x0, x1, x2, x3) L::Add(L::Add(x0, x1), L::Add(x2, x3))
+
+#define SHA256ROUNDN(a, b, c, d, e, f, g, h, i, w)                      \
+    T1 = L::Add(add4N(h, BIGSIGMA1_256N(e), L::Ch(e, f, g), L::Set1(sha256_consts[i])), w); \
+    d = L::Add(d, T1);                                                  \
+    h = L::Add(T1, L::Add(BIGSIGMA0_256N(a), L::Maj(a, b, c)));
+
+#define SHA256EXPANDN(j) \
+    w[j] = add4N(SIGMA1_256N(w[(j + 14) & 15]), w[(j + 9) & 15], SIGMA0_256N(w[(j + 1) & 15]), w[j]);
+
+// 64 rounds over the message schedule in w, starting from and leaving the
+// working variables in s.  w is expanded in place.
+template <int LANES>
+inline void SHA256RoundsN(typename SHA256Lanes<LANES>::vec s[8], typename SHA256Lanes<LANES>::vec w[16])
+{
+    typedef SHA256Lanes<LANES> L;
+    typename L::vec a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    typename L::vec T1;
+
+    for (int i = 0; i < 64; i += 16)
+    {
+        if (i > 0)
+        {
+            SHA256EXPANDN(0);  SHA256EXPANDN(1);  SHA256EXPANDN(2);  SHA256EXPANDN(3);
+            SHA256EXPANDN(4);  SHA256EXPANDN(5);  SHA256EXPANDN(6);  SHA256EXPANDN(7);
+            SHA256EXPANDN(8);  SHA256EXPANDN(9);  SHA256EXPANDN(10); SHA256EXPANDN(11);
+            SHA256EXPANDN(12); SHA256EXPANDN(13); SHA256EXPANDN(14); SHA256EXPANDN(15);
+        }
+        SHA256ROUNDN(a, b, c, d, e, f, g, h, i + 0, w[0]);
+        SHA256ROUNDN(h, a, b, c, d, e, f, g, i + 1, w[1]);
+        SHA256ROUNDN(g, h, a, b, c, d, e, f, i + 2, w[2]);
+        SHA256ROUNDN(f, g, h, a, b, c, d, e, i + 3, w[3]);
+        SHA256ROUNDN(e, f, g, h, a, b, c, d, i + 4, w[4]);
+        SHA256ROUNDN(d, e, f, g, h, a, b, c, i + 5, w[5]);
+        SHA256ROUNDN(c, d, e, f, g, h, a, b, i + 6, w[6]);
+        SHA256ROUNDN(b, c, d, e, f, g, h, a, i + 7, w[7]);
+        SHA256ROUNDN(a, b, c, d, e, f, g, h, i + 8, w[8]);
+        SHA256ROUNDN(h, a, b, c, d, e, f, g, i + 9, w[9]);
+        SHA256ROUNDN(g, h, a, b, c, d, e, f, i + 10, w[10]);
+        SHA256ROUNDN(f, g, h, a, b, c, d, e, i + 11, w[11]);
+        SHA256ROUNDN(e, f, g, h, a, b, c, d, i + 12, w[12]);
+        SHA256ROUNDN(d, e, f, g, h, a, b, c, i + 13, w[13]);
+        SHA256ROUNDN(c, d, e, f, g, h, a, b, i + 14, w[14]);
+        SHA256ROUNDN(b, c, d, e, f, g, h, a, i + 15, w[15]);
+    }
+
+    s[0] = a; s[1] = b; s[2] = c; s[3] = d; s[4] = e; s[5] = f; s[6] = g; s[7] = h;
+}
+
+//
+// Only W3, the nonce, changes between the hashes of one ScanHash call, so
+// rounds 0-2, most of round 3 and the nonce independent terms of W16-W31
+// are worked out once per call instead of once per nonce.
+//
+struct SHA256NoncePre
+{
+    unsigned int s3[8];     // working variables going into round 3
+    unsigned int nonce3[2]; // round 3's results in a and e, less the nonce
+    unsigned int w[16];     // the block tail, w[3] unused
+    unsigned int wc[32];    // nonce independent part of W16-W31
+};
+
+inline void SHA256PrecomputeNonce(SHA256NoncePre& pre, const unsigned int* In, const unsigned int* hPre)
+{
+    typedef SHA256Lanes<1> L;
+    unsigned int a = hPre[0], b = hPre[1], c = hPre[2], d = hPre[3], e = hPre[4], f = hPre[5], g = hPre[6], h = hPre[7];
+    unsigned int T1;
+    const unsigned int* w = In;
+    SHA256ROUNDN(a, b, c, d, e, f, g, h, 0, w[0]);
+    SHA256ROUNDN(h, a, b, c, d, e, f, g, 1, w[1]);
+    SHA256ROUNDN(g, h, a, b, c, d, e, f, 2, w[2]);
+    pre.s3[0] = a; pre.s3[1] = b; pre.s3[2] = c; pre.s3[3] = d;
+    pre.s3[4] = e; pre.s3[5] = f; pre.s3[6] = g; pre.s3[7] = h;
+
+    // round 3 is SHA256ROUNDN(f, g, h, a, b, c, d, e, 3, nonce)
+    T1 = add4N(e, BIGSIGMA1_256N(b), L::Ch(b, c, d), sha256_consts[3]);
+    pre.nonce3[0] = a + T1;
+    pre.nonce3[1] = T1 + BIGSIGMA0_256N(f) + L::Maj(f, g, h);
+
+    for (int i = 0; i < 16; i++)
+        pre.w[i] = In[i];
+
+    unsigned int* wc = pre.wc;
+    wc[16] = SIGMA1_256N(w[14]) + w[9] + SIGMA0_256N(w[1]) + w[0];
+    wc[17] = SIGMA1_256N(w[15]) + w[10] + SIGMA0_256N(w[2]) + w[1];
+    wc[18] = SIGMA1_256N(wc[16]) + w[11] + w[2];                    // + sigma0(W3)
+    wc[19] = SIGMA1_256N(wc[17]) + w[12] + SIGMA0_256N(w[4]);       // + W3
+    wc[20] = w[13] + SIGMA0_256N(w[5]) + w[4];                      // + sigma1(W18)
+    wc[21] = w[14] + SIGMA0_256N(w[6]) + w[5];                      // + sigma1(W19)
+    wc[22] = w[15] + SIGMA0_256N(w[7]) + w[6];                      // + sigma1(W20)
+    wc[23] = wc[16] + SIGMA0_256N(w[8]) + w[7];                     // + sigma1(W21)
+    wc[24] = wc[17] + SIGMA0_256N(w[9]) + w[8];                     // + sigma1(W22)
+    for (int t = 25; t < 31; t++)
+        wc[t] = SIGMA0_256N(w[t-15]) + w[t-16];                     // + sigma1(W[t-2]) + W[t-7]
+    wc[31] = SIGMA0_256N(wc[16]) + w[15];                           // + sigma1(W29) + W24
+}
+
+// First hash of LANES nonces continuing from the precomputed round 3,
+// leaving the midstate-added result in s
+template <int LANES>
+inline void SHA256FirstHashN(const SHA256NoncePre& pre, const unsigned int* hPre, typename SHA256Lanes<LANES>::vec nonce, typename SHA256Lanes<LANES>::vec s[8])
+{
+    typedef SHA256Lanes<LANES> L;
+    typename L::vec a = L::Set1(pre.s3[0]), b = L::Set1(pre.s3[1]), c = L::Set1(pre.s3[2]), d = L::Set1(pre.s3[3]);
+    typename L::vec e = L::Set1(pre.s3[4]), f = L::Set1(pre.s3[5]), g = L::Set1(pre.s3[6]), h = L::Set1(pre.s3[7]);
+    typename L::vec T1;
+    typename L::vec w[16];
+
+    a = L::Add(L::Set1(pre.nonce3[0]), nonce);
+    e = L::Add(L::Set1(pre.nonce3[1]), nonce);
+    SHA256ROUNDN(e, f, g, h, a, b, c, d, 4, L::Set1(pre.w[4]));
+    SHA256ROUNDN(d, e, f, g, h, a, b, c, 5, L::Set1(pre.w[5]));
+    SHA256ROUNDN(c, d, e, f, g, h, a, b, 6, L::Set1(pre.w[6]));
+    SHA256ROUNDN(b, c, d, e, f, g, h, a, 7, L::Set1(pre.w[7]));
+    SHA256ROUNDN(a, b, c, d, e, f, g, h, 8, L::Set1(pre.w[8]));
+    SHA256ROUNDN(h, a, b, c, d, e, f, g, 9, L::Set1(pre.w[9]));
+    SHA256ROUNDN(g, h, a, b, c, d, e, f, 10, L::Set1(pre.w[10]));
+    SHA256ROUNDN(f, g, h, a, b, c, d, e, 11, L::Set1(pre.w[11]));
+    SHA256ROUNDN(e, f, g, h, a, b, c, d, 12, L::Set1(pre.w[12]));
+    SHA256ROUNDN(d, e, f, g, h, a, b, c, 13, L::Set1(pre.w[13]));
+    SHA256ROUNDN(c, d, e, f, g, h, a, b, 14, L::Set1(pre.w[14]));
+    SHA256ROUNDN(b, c, d, e, f, g, h, a, 15, L::Set1(pre.w[15]));
+
+    // W16-W31, adding only the nonce dependent terms to the constants
+    w[0]  = L::Set1(pre.wc[16]);
+    w[1]  = L::Set1(pre.wc[17]);
+    w[2]  = L::Add(L::Set1(pre.wc[18]), SIGMA0_256N(nonce));
+    w[3]  = L::Add(L::Set1(pre.wc[19]), nonce);
+    w[4]  = L::Add(L::Set1(pre.wc[20]), SIGMA1_256N(w[2]));
+    w[5]  = L::Add(L::Set1(pre.wc[21]), SIGMA1_256N(w[3]));
+    w[6]  = L::Add(L::Set1(pre.wc[22]), SIGMA1_256N(w[4]));
+    w[7]  = L::Add(L::Set1(pre.wc[23]), SIGMA1_256N(w[5]));
+    w[8]  = L::Add(L::Set1(pre.wc[24]), SIGMA1_256N(w[6]));
+    w[9]  = L::Add(L::Add(L::Set1(pre.wc[25]), SIGMA1_256N(w[7])), w[2]);
+    w[10] = L::Add(L::Add(L::Set1(pre.wc[26]), SIGMA1_256N(w[8])), w[3]);
+    w[11] = L::Add(L::Add(L::Set1(pre.wc[27]), SIGMA1_256N(w[9])), w[4]);
+    w[12] = L::Add(L::Add(L::Set1(pre.wc[28]), SIGMA1_256N(w[10])), w[5]);
+    w[13] = L::Add(L::Add(L::Set1(pre.wc[29]), SIGMA1_256N(w[11])), w[6]);
+    w[14] = L::Add(L::Add(L::Set1(pre.wc[30]), SIGMA1_256N(w[12])), w[7]);
+    w[15] = L::Add(L::Add(L::Set1(pre.wc[31]), SIGMA1_256N(w[13])), w[8]);
+
+    for (int i = 16; i < 64; i += 16)
+    {
+        if (i > 16)
+        {
+            SHA256EXPANDN(0);  SHA256EXPANDN(1);  SHA256EXPANDN(2);  SHA256EXPANDN(3);
+            SHA256EXPANDN(4);  SHA256EXPANDN(5);  SHA256EXPANDN(6);  SHA256EXPANDN(7);
+            SHA256EXPANDN(8);  SHA256EXPANDN(9);  SHA256EXPANDN(10); SHA256EXPANDN(11);
+            SHA256EXPANDN(12); SHA256EXPANDN(13); SHA256EXPANDN(14); SHA256EXPANDN(15);
+        }
+        SHA256ROUNDN(a, b, c, d, e, f, g, h, i + 0, w[0]);
+        SHA256ROUNDN(h, a, b, c, d, e, f, g, i + 1, w[1]);
+        SHA256ROUNDN(g, h, a, b, c, d, e, f, i + 2, w[2]);
+        SHA256ROUNDN(f, g, h, a, b, c, d, e, i + 3, w[3]);
+        SHA256ROUNDN(e, f, g, h, a, b, c, d, i + 4, w[4]);
+        SHA256ROUNDN(d, e, f, g, h, a, b, c, i + 5, w[5]);
+        SHA256ROUNDN(c, d, e, f, g, h, a, b, i + 6, w[6]);
+        SHA256ROUNDN(b, c, d, e, f, g, h, a, i + 7, w[7]);
+        SHA256ROUNDN(a, b, c, d, e, f, g, h, i + 8, w[8]);
+        SHA256ROUNDN(h, a, b, c, d, e, f, g, i + 9, w[9]);
+        SHA256ROUNDN(g, h, a, b, c, d, e, f, i + 10, w[10]);
+        SHA256ROUNDN(f, g, h, a, b, c, d, e, i + 11, w[11]);
+        SHA256ROUNDN(e, f, g, h, a, b, c, d, i + 12, w[12]);
+        SHA256ROUNDN(d, e, f, g, h, a, b, c, i + 13, w[13]);
+        SHA256ROUNDN(c, d, e, f, g, h, a, b, i + 14, w[14]);
+        SHA256ROUNDN(b, c, d, e, f, g, h, a, i + 15, w[15]);
+    }
+
+    s[0] = L::Add(a, L::Set1(hPre[0])); s[1] = L::Add(b, L::Set1(hPre[1]));
+    s[2] = L::Add(c, L::Set1(hPre[2])); s[3] = L::Add(d, L::Set1(hPre[3]));
+    s[4] = L::Add(e, L::Set1(hPre[4])); s[5] = L::Add(f, L::Set1(hPre[5]));
+    s[6] = L::Add(g, L::Set1(hPre[6])); s[7] = L::Add(h, L::Set1(hPre[7]));
+}
+
+//
+// Second hash of the 32 byte first hash in w[0..7], stopping after round
+// 60: the e it produces is shifted into h by the last three rounds, so that
+// is all the H7 == 0 test needs.  The padding words are spelled out so the
+// compiler can drop the terms of the message schedule they zero.
+//
+template <int LANES>
+inline typename SHA256Lanes<LANES>::vec SHA256SecondHashH7N(typename SHA256Lanes<LANES>::vec w[16], const unsigned int* hInit)
+{
+    typedef SHA256Lanes<LANES> L;
+    w[8] = L::Set1(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = L::Set1(0);
+    w[15] = L::Set1(256);
+    typename L::vec a = L::Set1(hInit[0]), b = L::Set1(hInit[1]), c = L::Set1(hInit[2]), d = L::Set1(hInit[3]);
+    typename L::vec e = L::Set1(hInit[4]), f = L::Set1(hInit[5]), g = L::Set1(hInit[6]), h = L::Set1(hInit[7]);
+    typename L::vec T1;
+
+    for (int i = 0; i < 48; i += 16)
+    {
+        if (i > 0)
+        {
+            SHA256EXPANDN(0);  SHA256EXPANDN(1);  SHA256EXPANDN(2);  SHA256EXPANDN(3);
+            SHA256EXPANDN(4);  SHA256EXPANDN(5);  SHA256EXPANDN(6);  SHA256EXPANDN(7);
+            SHA256EXPANDN(8);  SHA256EXPANDN(9);  SHA256EXPANDN(10); SHA256EXPANDN(11);
+            SHA256EXPANDN(12); SHA256EXPANDN(13); SHA256EXPANDN(14); SHA256EXPANDN(15);
+        }
+        SHA256ROUNDN(a, b, c, d, e, f, g, h, i + 0, w[0]);
+        SHA256ROUNDN(h, a, b, c, d, e, f, g, i + 1, w[1]);
+        SHA256ROUNDN(g, h, a, b, c, d, e, f, i + 2, w[2]);
+        SHA256ROUNDN(f, g, h, a, b, c, d, e, i + 3, w[3]);
+        SHA256ROUNDN(e, f, g, h, a, b, c, d, i + 4, w[4]);
+        SHA256ROUNDN(d, e, f, g, h, a, b, c, i + 5, w[5]);
+        SHA256ROUNDN(c, d, e, f, g, h, a, b, i + 6, w[6]);
+        SHA256ROUNDN(b, c, d, e, f, g, h, a, i + 7, w[7]);
+        SHA256ROUNDN(a, b, c, d, e, f, g, h, i + 8, w[8]);
+        SHA256ROUNDN(h, a, b, c, d, e, f, g, i + 9, w[9]);
+        SHA256ROUNDN(g, h, a, b, c, d, e, f, i + 10, w[10]);
+        SHA256ROUNDN(f, g, h, a, b, c, d, e, i + 11, w[11]);
+        SHA256ROUNDN(e, f, g, h, a, b, c, d, i + 12, w[12]);
+        SHA256ROUNDN(d, e, f, g, h, a, b, c, i + 13, w[13]);
+        SHA256ROUNDN(c, d, e, f, g, h, a, b, i + 14, w[14]);
+        SHA256ROUNDN(b, c, d, e, f, g, h, a, i + 15, w[15]);
+    }
+
+    SHA256EXPANDN(0);  SHA256EXPANDN(1);  SHA256EXPANDN(2);  SHA256EXPANDN(3);
+    SHA256EXPANDN(4);  SHA256EXPANDN(5);  SHA256EXPANDN(6);  SHA256EXPANDN(7);
+    SHA256EXPANDN(8);  SHA256EXPANDN(9);  SHA256EXPANDN(10); SHA256EXPANDN(11);
+    SHA256EXPANDN(12);
+    SHA256ROUNDN(a, b, c, d, e, f, g, h, 48, w[0]);
+    SHA256ROUNDN(h, a, b, c, d, e, f, g, 49, w[1]);
+    SHA256ROUNDN(g, h, a, b, c, d, e, f, 50, w[2]);
+    SHA256ROUNDN(f, g, h, a, b, c, d, e, 51, w[3]);
+    SHA256ROUNDN(e, f, g, h, a, b, c, d, 52, w[4]);
+    SHA256ROUNDN(d, e, f, g, h, a, b, c, 53, w[5]);
+    SHA256ROUNDN(c, d, e, f, g, h, a, b, 54, w[6]);
+    SHA256ROUNDN(b, c, d, e, f, g, h, a, 55, w[7]);
+    SHA256ROUNDN(a, b, c, d, e, f, g, h, 56, w[8]);
+    SHA256ROUNDN(h, a, b, c, d, e, f, g, 57, w[9]);
+    SHA256ROUNDN(g, h, a, b, c, d, e, f, 58, w[10]);
+    SHA256ROUNDN(f, g, h, a, b, c, d, e, 59, w[11]);
+
+    // round 60 only as far as its e, which lands in h
+    T1 = L::Add(add4N(d, BIGSIGMA1_256N(a), L::Ch(a, b, c), L::Set1(sha256_consts[60])), w[12]);
+    return L::Add(L::Add(h, T1), L::Set1(hInit[7]));
+}
+
+// Same contract as tcatm's DoubleBlockSHA256, LANES nonces at a time
+template <int LANES>
+void DoubleBlockSHA256N(const void* pin, void* pad, const void* pre, unsigned int thash[9][NPAR], const void* init)
+{
+    typedef SHA256Lanes<LANES> L;
+    const unsigned int* In = (const unsigned int*)pin;
+    const unsigned int* Pad = (const unsigned int*)pad;
+    const unsigned int* hPre = (const unsigned int*)pre;
+    const unsigned int* hInit = (const unsigned int*)init;
+    typename L::vec w[16];
+    typename L::vec s[8];
+
+    SHA256NoncePre noncepre;
+    SHA256PrecomputeNonce(noncepre, In, hPre);
+
+    for (unsigned int k = 0; k < NPAR; k += LANES)
+    {
+        typename L::vec nonce = L::Add(L::Add(L::Set1(In[3]), L::LaneOffset()), L::Set1(k));
+        SHA256FirstHashN<LANES>(noncepre, hPre, nonce, w);
+        for (int i = 8; i < 16; i++)
+            w[i] = L::Set1(Pad[i]);
+
+        for (int i = 0; i < 8; i++)
+            s[i] = L::Set1(hInit[i]);
+        SHA256RoundsN<LANES>(s, w);
+
+        /* store results directly in thash */
+        for (int i = 0; i < 8; i++)
+            L::Store(&thash[i][k], L::Add(s[i], L::Set1(hInit[i])));
+        L::Store(&thash[8][k], nonce);
+    }
+}
+
+//
+// ScanHash with the nonce precomputation and the H7 early reject.  Only a
+// batch that has a zero H7 is hashed in full, to hand back the hash.
+//
+template <int LANES>
+unsigned int ScanHash_NWay(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
+{
+    typedef SHA256Lanes<LANES> L;
+    unsigned int& nNonce = *(unsigned int*)(pdata + 12);
+    const unsigned int* hPre = (const unsigned int*)pmidstate;
+    typename L::vec w[16];
+    unsigned int h7[NPAR];
+
+    SHA256NoncePre noncepre;
+    SHA256PrecomputeNonce(noncepre, (const unsigned int*)pdata, hPre);
+
+    for (;;)
+    {
+        nNonce += NPAR;
+        for (unsigned int k = 0; k < NPAR; k += LANES)
+        {
+            typename L::vec nonce = L::Add(L::Add(L::Set1(nNonce), L::LaneOffset()), L::Set1(k));
+            SHA256FirstHashN<LANES>(noncepre, hPre, nonce, w);
+            L::Store(&h7[k], SHA256SecondHashH7N<LANES>(w, pSHA256InitState));
+        }
+
+        for (int j = 0; j < NPAR; j++)
+        {
+            if (h7[j] == 0)
+            {
+                unsigned int thash[9][NPAR];
+                DoubleBlockSHA256N<LANES>(pdata, phash1, pmidstate, thash, pSHA256InitState);
+                for (int i = 0; i < 32/4; i++)
+                    ((unsigned int*)phash)[i] = thash[i][j];
+                return nNonce + j;
+            }
+        }
+
+        if ((nNonce & 0xffff) == 0)
+        {
+            nHashesDone = 0xffff+1;
+            return -1;
+        }
+    }
+}
+
+}
+
+#endif